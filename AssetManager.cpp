@@ -0,0 +1,198 @@
+#include "Header.hpp"
+
+#include "AssetPack.hpp"
+
+#include <iostream>
+#include <cstring>
+
+using namespace std;
+
+// *********** Asset manager ***********
+
+// Assets are looked up twice. acquireMesh() finds them by file name, which is free and
+// covers objects naming the same file. loadMesh() then looks up a hash of the file's
+// contents before parsing it, which catches the same file under another name (suzanne.obj
+// copied to suzanne2.obj, say) without reading any file on the main thread. The hash is
+// kept in the mesh cache, so the file is only read through to hash it when it is about to
+// be parsed anyway.
+//
+// Both tables hold weak_ptrs, so the manager never keeps an asset alive by itself; expired
+// entries are swept out the next time an asset is acquired.
+
+// Mixes together every MeshOptions setting that affects the mesh or its GL buffers. Two
+// loads of one file only share an asset if these match.
+static uint64_t meshOptionsKey(const MeshOptions& options)
+{
+	uint64_t key = 14695981039346656037ull; // FNV-1a
+	auto mix = [&key](uint64_t value) {
+		key = (key ^ value) * 1099511628211ull;
+	};
+
+	mix(static_cast<uint64_t>(options.parser));
+	mix(static_cast<uint64_t>(options.normalWeighting));
+	uint32_t creaseBits;
+	memcpy(&creaseBits, &options.creaseAngle, sizeof(creaseBits));
+	mix(creaseBits);
+	mix(options.optimise);
+	mix(static_cast<uint64_t>(options.lodCount));
+	mix(options.buildMeshlets);
+	mix(static_cast<uint64_t>(options.positionFormat));
+	mix(static_cast<uint64_t>(options.normalFormat));
+	mix(static_cast<uint64_t>(options.retention));
+	return key;
+}
+
+static string nameKey(const string& meshSource, const MeshOptions& options)
+{
+	return meshSource + "|" + to_string(meshOptionsKey(options));
+}
+
+MeshAsset::~MeshAsset()
+{
+	if (isUploaded)
+	{
+		pool.release(geometry);
+	}
+}
+
+size_t MeshAsset::upload()
+{
+	// Vertices are interleaved in the formats the mesh was loaded with, see MeshQuantise.cpp,
+	// and indices are written at the width the mesh chose for itself, see
+	// Mesh::chooseIndexType. A reload takes its new slice before giving back the old one, so
+	// the new mesh isn't written over space last frame's draws may still be reading.
+	GeometrySlice previous = geometry;
+	geometry = pool.allocate(mesh);
+	if (isUploaded)
+	{
+		pool.release(previous);
+	}
+	size_t uploadedSize = mesh.vertices.size() * mesh.vertexStride() + mesh.elements.size() * mesh.indexSize();
+	mtlFile = mesh.mtlFile;
+
+	// The GPU has its copy now; keep only what the options ask for
+	mesh.releaseCpuData(options.retention);
+	isUploaded = true;
+	return uploadedSize;
+}
+
+size_t MeshAsset::applyReload()
+{
+	// Objects hold the asset, not the mesh or the buffer IDs, so they all draw the new mesh
+	// from the next frame on. An alias gets buffers of its own here.
+	mesh = std::move(*reloaded);
+	reloaded.reset();
+	sameAs.reset();
+	isReloading = false;
+	return upload();
+}
+
+shared_ptr<MeshAsset> AssetManager::acquireMesh(string meshSource, MeshOptions options, bool& isNew)
+{
+	lock_guard<mutex> lock(mMutex);
+	pruneExpired();
+
+	string key = nameKey(meshSource, options);
+	shared_ptr<MeshAsset> asset = mByName[key].lock();
+	isNew = !asset;
+	if (isNew)
+	{
+		asset = make_shared<MeshAsset>(meshSource, options, mGeometry);
+		mByName[key] = asset;
+	}
+	return asset;
+}
+
+void AssetManager::loadMesh(const shared_ptr<MeshAsset>& asset)
+{
+	asset->contentHash = asset->options.useCache ? Mesh::cachedSourceHash(asset->source) : 0;
+	if (asset->contentHash == 0)
+	{
+		asset->contentHash = hashAsset(asset->source);
+	}
+
+	{
+		lock_guard<mutex> lock(mMutex);
+		pair<uint64_t, uint64_t> key(asset->contentHash, meshOptionsKey(asset->options));
+		shared_ptr<MeshAsset> original = mByContent[key].lock();
+		if (original && original != asset)
+		{
+			// Same bytes, possibly still being loaded by another thread. Once the main thread
+			// publishes the alias, whoever draws this asset follows sameAs, so it shows up
+			// when the original is uploaded.
+			cout << asset->source << " is a copy of " << original->source << ", sharing its mesh" << endl;
+			asset->copyOf = original;
+			return;
+		}
+		if (asset->contentHash != 0)
+		{
+			mByContent[key] = asset;
+		}
+	}
+
+	asset->mesh.load(asset->source, asset->options, asset->contentHash);
+}
+
+void AssetManager::reloadMesh(const shared_ptr<MeshAsset>& asset)
+{
+	// The old mesh is being drawn until the main thread swaps the new one in, so parse into
+	// a mesh of our own. Mesh::load finds the cache out of date and rewrites it.
+	unique_ptr<Mesh> mesh(new Mesh());
+	mesh->load(asset->source, asset->options);
+	uint64_t contentHash = mesh->sourceHash != 0 ? mesh->sourceHash : hashAsset(asset->source);
+
+	{
+		lock_guard<mutex> lock(mMutex);
+		pair<uint64_t, uint64_t> key(contentHash, meshOptionsKey(asset->options));
+		if (contentHash != 0 && mByContent[key].expired())
+		{
+			mByContent[key] = asset;
+		}
+	}
+
+	asset->contentHash = contentHash;
+	asset->reloaded = std::move(mesh);
+}
+
+size_t AssetManager::liveMeshCount()
+{
+	lock_guard<mutex> lock(mMutex);
+	pruneExpired();
+	size_t count = 0;
+	for (auto& entry : mByName)
+	{
+		shared_ptr<MeshAsset> asset = entry.second.lock();
+		if (asset && !asset->sameAs)
+		{
+			++count;
+		}
+	}
+	return count;
+}
+
+vector<shared_ptr<MeshAsset>> AssetManager::liveMeshes()
+{
+	lock_guard<mutex> lock(mMutex);
+	vector<shared_ptr<MeshAsset>> live;
+	for (auto& entry : mByName)
+	{
+		shared_ptr<MeshAsset> asset = entry.second.lock();
+		if (asset)
+		{
+			live.push_back(asset);
+		}
+	}
+	return live;
+}
+
+void AssetManager::pruneExpired()
+{
+	for (auto i = mByName.begin(); i != mByName.end();)
+	{
+		i = i->second.expired() ? mByName.erase(i) : next(i);
+	}
+	for (auto i = mByContent.begin(); i != mByContent.end();)
+	{
+		i = i->second.expired() ? mByContent.erase(i) : next(i);
+	}
+}
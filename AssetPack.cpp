@@ -0,0 +1,533 @@
+#include "AssetPack.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <set>
+
+using namespace std;
+
+// *********** Asset pack ***********
+
+// File layout: AssetPackHeader, then an AssetPackEntry per asset sorted by path, then the
+// paths themselves, then the payloads, each starting on a 16 byte boundary so that binary
+// assets (mesh caches in particular) can be read in place.
+//
+// Compressed entries use the LZ4 block format: a run of sequences, each a token byte
+// (literal count in the high nibble, match length - 4 in the low one, 15 meaning more
+// length bytes follow), the literals, and a two byte offset back into the output to copy
+// the match from. The last sequence has literals only. It decompresses at memory speed,
+// and halves the size of the text formats we ship (OBJ, MTL, GLSL).
+
+static const uint32_t assetPackVersion = 1;
+static const char assetPackMagic[4] = { 'P', 'A', 'C', 'K' };
+
+struct AssetPackHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t entryCount;
+	uint64_t namesOffset;
+	uint64_t namesSize;
+};
+
+enum AssetPackCompression : uint32_t { PackStored = 0, PackLz4 = 1 };
+
+struct AssetPackEntry {
+	uint64_t nameOffset; // Into the names block
+	uint32_t nameLength;
+	uint32_t compression;
+	uint64_t offset;     // Of the payload, from the start of the pack
+	uint64_t storedSize; // Size of the payload
+	uint64_t size;       // Size once decompressed
+	uint64_t writeTime;  // Of the file the entry was packed from
+};
+
+static uint64_t alignTo16(uint64_t offset)
+{
+	return (offset + 15) & ~static_cast<uint64_t>(15);
+}
+
+// Packs store '/' separated paths, whatever the caller used
+static string normalisePath(string path)
+{
+	replace(path.begin(), path.end(), '\\', '/');
+	while (path.compare(0, 2, "./") == 0)
+	{
+		path.erase(0, 2);
+	}
+	return path;
+}
+
+// *********** LZ4 block format ***********
+
+static void writeLength(vector<char>& out, size_t length)
+{
+	for (; length >= 255; length -= 255)
+	{
+		out.push_back(static_cast<char>(255));
+	}
+	out.push_back(static_cast<char>(length));
+}
+
+static void writeSequence(vector<char>& out, const char* literals, size_t literalCount, size_t offset, size_t matchLength)
+{
+	size_t matchCode = matchLength - 4;
+	unsigned char token = static_cast<unsigned char>((min<size_t>(literalCount, 15) << 4) | (offset != 0 ? min<size_t>(matchCode, 15) : 0));
+	out.push_back(static_cast<char>(token));
+	if (literalCount >= 15)
+	{
+		writeLength(out, literalCount - 15);
+	}
+	out.insert(out.end(), literals, literals + literalCount);
+	if (offset == 0)
+	{
+		return; // Last sequence
+	}
+	out.push_back(static_cast<char>(offset & 0xff));
+	out.push_back(static_cast<char>(offset >> 8));
+	if (matchCode >= 15)
+	{
+		writeLength(out, matchCode - 15);
+	}
+}
+
+// Greedy compressor finding matches through a hash of the next four bytes. Not as tight as
+// the reference LZ4 compressor, but packs are built offline and only decompression speed
+// matters at run time.
+static void lz4Compress(const char* source, size_t size, vector<char>& out)
+{
+	const int hashBits = 16;
+	const size_t noPosition = static_cast<size_t>(-1);
+	vector<size_t> table(static_cast<size_t>(1) << hashBits, noPosition);
+
+	// The format wants the last match to start at least 12 bytes from the end, and the last
+	// 5 bytes to be literals
+	size_t anchor = 0;
+	size_t position = 0;
+	size_t matchLimit = size > 12 ? size - 12 : 0;
+	while (position < matchLimit)
+	{
+		uint32_t next;
+		memcpy(&next, source + position, sizeof(next));
+		uint32_t hash = (next * 2654435761u) >> (32 - hashBits);
+		size_t candidate = table[hash];
+		table[hash] = position;
+
+		if (candidate == noPosition || position - candidate > 0xffff || memcmp(source + candidate, source + position, 4) != 0)
+		{
+			++position;
+			continue;
+		}
+
+		size_t length = 4;
+		while (position + length < size - 5 && source[candidate + length] == source[position + length])
+		{
+			++length;
+		}
+		writeSequence(out, source + anchor, position - anchor, position - candidate, length);
+		position += length;
+		anchor = position;
+	}
+	writeSequence(out, source + anchor, size - anchor, 0, 0);
+}
+
+static bool readLength(const unsigned char*& in, const unsigned char* inEnd, size_t& length)
+{
+	unsigned char byte;
+	do
+	{
+		if (in == inEnd)
+		{
+			return false;
+		}
+		byte = *in++;
+		length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+// Returns false if the data is corrupt or doesn't decompress to exactly size bytes
+static bool lz4Decompress(const char* source, size_t storedSize, char* out, size_t size)
+{
+	const unsigned char* in = reinterpret_cast<const unsigned char*>(source);
+	const unsigned char* inEnd = in + storedSize;
+	size_t written = 0;
+	while (in < inEnd)
+	{
+		unsigned char token = *in++;
+
+		size_t literalCount = token >> 4;
+		if (literalCount == 15 && !readLength(in, inEnd, literalCount))
+		{
+			return false;
+		}
+		if (literalCount > static_cast<size_t>(inEnd - in) || literalCount > size - written)
+		{
+			return false;
+		}
+		memcpy(out + written, in, literalCount);
+		in += literalCount;
+		written += literalCount;
+
+		if (in == inEnd)
+		{
+			break; // The last sequence has no match
+		}
+		if (inEnd - in < 2)
+		{
+			return false;
+		}
+		size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+		size_t length = (token & 15) + 4;
+		if ((token & 15) == 15 && !readLength(in, inEnd, length))
+		{
+			return false;
+		}
+		if (offset == 0 || offset > written || length > size - written)
+		{
+			return false;
+		}
+
+		// Matches may overlap the bytes they produce (a run of one character is a match at
+		// offset 1), so only copy in one go when they don't
+		char* to = out + written;
+		const char* from = to - offset;
+		if (offset >= length)
+		{
+			memcpy(to, from, length);
+		}
+		else
+		{
+			for (size_t i = 0; i < length; ++i)
+			{
+				to[i] = from[i];
+			}
+		}
+		written += length;
+	}
+	return written == size;
+}
+
+// *********** Mounted pack ***********
+
+class AssetPack
+{
+public:
+	bool open(const string& packFile)
+	{
+		MappedFile file;
+		if (!file.open(packFile) || file.size() < sizeof(AssetPackHeader))
+		{
+			return false;
+		}
+
+		AssetPackHeader header;
+		memcpy(&header, file.data(), sizeof(header));
+		if (memcmp(header.magic, assetPackMagic, sizeof(header.magic)) != 0 || header.version != assetPackVersion)
+		{
+			return false;
+		}
+
+		// Check every entry lies inside the file up front, so lookups can trust them
+		uint64_t entriesEnd = sizeof(AssetPackHeader) + header.entryCount * sizeof(AssetPackEntry);
+		if (header.entryCount > file.size() / sizeof(AssetPackEntry) || entriesEnd > file.size()
+			|| header.namesOffset > file.size() || header.namesSize > file.size() - header.namesOffset)
+		{
+			return false;
+		}
+		vector<AssetPackEntry> entries(static_cast<size_t>(header.entryCount));
+		memcpy(entries.data(), file.data() + sizeof(AssetPackHeader), entries.size() * sizeof(AssetPackEntry));
+		for (const AssetPackEntry& entry : entries)
+		{
+			if (entry.nameOffset > header.namesSize || entry.nameLength > header.namesSize - entry.nameOffset
+				|| entry.offset > file.size() || entry.storedSize > file.size() - entry.offset
+				|| (entry.compression == PackStored && entry.storedSize != entry.size)
+				|| entry.compression > PackLz4)
+			{
+				return false;
+			}
+		}
+
+		mFile = std::move(file);
+		mEntries.swap(entries);
+		mNames = mFile.data() + header.namesOffset;
+		return true;
+	}
+
+	// The entry for a path, or nullptr if the pack doesn't have it
+	const AssetPackEntry* find(const string& path) const
+	{
+		string name = normalisePath(path);
+		auto found = lower_bound(mEntries.begin(), mEntries.end(), name, [this](const AssetPackEntry& entry, const string& name) {
+			return compareName(entry, name) < 0;
+		});
+		return (found != mEntries.end() && compareName(*found, name) == 0) ? &*found : nullptr;
+	}
+
+	const char* payload(const AssetPackEntry& entry) const { return mFile.data() + entry.offset; }
+
+private:
+	int compareName(const AssetPackEntry& entry, const string& name) const
+	{
+		int order = memcmp(mNames + entry.nameOffset, name.data(), min<size_t>(entry.nameLength, name.size()));
+		if (order != 0)
+		{
+			return order;
+		}
+		return entry.nameLength < name.size() ? -1 : (entry.nameLength > name.size() ? 1 : 0);
+	}
+
+	MappedFile mFile;
+	vector<AssetPackEntry> mEntries;
+	const char* mNames = nullptr;
+};
+
+static AssetPack& mountedPack()
+{
+	static AssetPack pack;
+	return pack;
+}
+
+static AssetPriority mountedPriority = AssetPriority::PackFirst;
+
+// Paths given to preferLooseAsset. Written on the main thread while loader threads read it.
+static mutex looseAssetsMutex;
+static set<string> looseAssets;
+
+// Whether to try path's loose file before the pack, see the order in AssetPack.hpp
+static bool prefersLoose(const string& path)
+{
+	if (mountedPriority == AssetPriority::LooseFirst)
+	{
+		return true;
+	}
+	lock_guard<mutex> lock(looseAssetsMutex);
+	return !looseAssets.empty() && looseAssets.count(normalisePath(path)) != 0;
+}
+
+bool mountAssetPack(const string& packFile, AssetPriority priority)
+{
+	AssetPack pack;
+	if (!pack.open(packFile))
+	{
+		return false;
+	}
+	mountedPack() = std::move(pack);
+	mountedPriority = priority;
+	return true;
+}
+
+void preferLooseAsset(const string& path)
+{
+	lock_guard<mutex> lock(looseAssetsMutex);
+	looseAssets.insert(normalisePath(path));
+}
+
+void getAssetStamp(const string& path, uint64_t& size, uint64_t& writeTime)
+{
+	if (path != "" && prefersLoose(path))
+	{
+		getFileStamp(path, size, writeTime);
+		if (size != 0 || writeTime != 0)
+		{
+			return;
+		}
+	}
+	const AssetPackEntry* entry = path != "" ? mountedPack().find(path) : nullptr;
+	if (entry != nullptr)
+	{
+		size = entry->size;
+		writeTime = entry->writeTime;
+		return;
+	}
+	getFileStamp(path, size, writeTime);
+}
+
+uint64_t hashAsset(const string& path)
+{
+	AssetFile file;
+	if (!file.open(path))
+	{
+		return 0;
+	}
+	uint64_t hash = 14695981039346656037ull;
+	for (const char* p = file.data(); p != file.end(); ++p)
+	{
+		hash = (hash ^ static_cast<unsigned char>(*p)) * 1099511628211ull;
+	}
+	return hash;
+}
+
+bool AssetFile::open(const string& path)
+{
+	mLoose.close();
+	mUnpacked.clear();
+	mData = nullptr;
+	mSize = 0;
+
+	const AssetPack& pack = mountedPack();
+	const AssetPackEntry* entry = nullptr;
+	if (!prefersLoose(path) || !mLoose.open(path))
+	{
+		entry = pack.find(path);
+		if (entry == nullptr && !mLoose.open(path))
+		{
+			return false;
+		}
+	}
+	if (entry == nullptr)
+	{
+		mData = mLoose.data();
+		mSize = mLoose.size();
+		return true;
+	}
+
+	if (entry->compression == PackStored)
+	{
+		mData = pack.payload(*entry);
+		mSize = static_cast<size_t>(entry->size);
+		return true;
+	}
+
+	mUnpacked.resize(static_cast<size_t>(entry->size));
+	if (!lz4Decompress(pack.payload(*entry), static_cast<size_t>(entry->storedSize), mUnpacked.data(), mUnpacked.size()))
+	{
+		cerr << "Corrupt asset " << path << " in pack" << endl;
+		mUnpacked.clear();
+		return false;
+	}
+	mData = mUnpacked.data();
+	mSize = mUnpacked.size();
+	return true;
+}
+
+// *********** Pack writer ***********
+
+vector<string> listAssetFiles(const string& directory)
+{
+	vector<string> files;
+	WIN32_FIND_DATAA found;
+	HANDLE search = FindFirstFileA((directory + "\\*").c_str(), &found);
+	if (search == INVALID_HANDLE_VALUE)
+	{
+		return files;
+	}
+	do
+	{
+		if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		{
+			files.push_back(directory + "/" + found.cFileName);
+		}
+	} while (FindNextFileA(search, &found));
+	FindClose(search);
+	sort(files.begin(), files.end());
+	return files;
+}
+
+// Writes the pack to fileName, filling in the entries' offsets and sizes. On failure the
+// file may be left half written.
+static bool writePackFile(const string& fileName, const vector<string>& names, const AssetPackHeader& header, vector<AssetPackEntry>& entries)
+{
+	ofstream out(fileName, ios::out | ios::binary | ios::trunc);
+	if (!out)
+	{
+		cerr << "Cannot write " << fileName << endl;
+		return false;
+	}
+
+	// Payloads first, after space for the header, entries and names, which are only
+	// complete once every payload has been placed
+	uint64_t position = alignTo16(header.namesOffset + header.namesSize);
+	uint64_t totalSize = 0, totalStored = 0;
+	out.seekp(position);
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		MappedFile file;
+		if (!file.open(names[i]))
+		{
+			cerr << "Cannot open " << names[i] << endl;
+			return false;
+		}
+		uint64_t size;
+		getFileStamp(names[i], size, entries[i].writeTime);
+
+		// Only keep the compressed copy if it saves at least an eighth
+		vector<char> compressed;
+		lz4Compress(file.data(), file.size(), compressed);
+		bool useCompressed = compressed.size() < file.size() - file.size() / 8;
+		const char* payload = useCompressed ? compressed.data() : file.data();
+
+		entries[i].compression = useCompressed ? PackLz4 : PackStored;
+		entries[i].offset = position;
+		entries[i].size = file.size();
+		entries[i].storedSize = useCompressed ? compressed.size() : file.size();
+		out.write(payload, entries[i].storedSize);
+
+		static const char padding[16] = {};
+		uint64_t next = alignTo16(position + entries[i].storedSize);
+		out.write(padding, next - position - entries[i].storedSize);
+		position = next;
+		totalSize += entries[i].size;
+		totalStored += entries[i].storedSize;
+	}
+
+	out.seekp(0);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(AssetPackEntry));
+	for (const string& name : names)
+	{
+		out.write(name.data(), name.size());
+	}
+
+	if (!out)
+	{
+		cerr << "Failed writing " << fileName << endl;
+		return false;
+	}
+	cout << "Packed " << names.size() << " assets, " << totalSize << " bytes stored in " << totalStored << endl;
+	return true;
+}
+
+bool writeAssetPack(const string& packFile, const vector<string>& files)
+{
+	vector<string> names;
+	for (const string& file : files)
+	{
+		names.push_back(normalisePath(file));
+	}
+	sort(names.begin(), names.end());
+	names.erase(unique(names.begin(), names.end()), names.end());
+
+	AssetPackHeader header = AssetPackHeader();
+	memcpy(header.magic, assetPackMagic, sizeof(header.magic));
+	header.version = assetPackVersion;
+	header.entryCount = names.size();
+	header.namesOffset = sizeof(AssetPackHeader) + names.size() * sizeof(AssetPackEntry);
+
+	vector<AssetPackEntry> entries(names.size(), AssetPackEntry());
+	for (size_t i = 0; i < names.size(); ++i)
+	{
+		entries[i].nameOffset = header.namesSize;
+		entries[i].nameLength = static_cast<uint32_t>(names[i].size());
+		header.namesSize += names[i].size();
+	}
+
+	// A pack that failed part way is deleted rather than left truncated next to the real one
+	string tempFileName = packFile + ".tmp";
+	if (!writePackFile(tempFileName, names, header, entries))
+	{
+		DeleteFileA(tempFileName.c_str());
+		return false;
+	}
+
+	if (!MoveFileExA(tempFileName.c_str(), packFile.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		cerr << "Cannot replace " << packFile << endl;
+		DeleteFileA(tempFileName.c_str());
+		return false;
+	}
+	return true;
+}
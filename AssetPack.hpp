@@ -0,0 +1,117 @@
+#pragma once
+/***
+description: Access to asset files, whether they are loose files or entries of an asset
+pack. A pack is one file holding many assets (see AssetPack.cpp for the layout): it is
+memory mapped once when mounted, and opening an asset after that is a binary search of
+the pack's table of contents rather than a round of file system calls.
+
+Every loader opens its files through AssetFile (a contiguous block, like MappedFile) or
+AssetStream (an istream, for the line by line loaders). Which copy of an asset they read,
+when there is both a packed and a loose one, goes in this order:
+
+1. the loose file, for a path passed to preferLooseAsset (files hot reloading has seen
+   change, and mesh caches rewritten since the pack was built);
+2. the loose file, for any path, if the pack was mounted with AssetPriority::LooseFirst;
+3. the pack's copy;
+4. the loose file, for assets the pack doesn't have.
+
+getAssetStamp follows the same order, so caches are always checked against the copy
+that would actually be read. A game run without a pack reads straight from assets/.
+***/
+
+#ifndef ASSET_PACK_HPP
+#define ASSET_PACK_HPP
+
+#include "MappedFile.hpp"
+
+#include <istream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Whether loose files win over the pack. LooseFirst costs a file system lookup per asset
+// opened, so it is for development, where a pack left over from the last cook mustn't
+// hide edits made since.
+enum class AssetPriority { PackFirst, LooseFirst };
+
+// Mount a pack built by writeAssetPack. Returns false, leaving any pack already mounted in
+// place, if the file can't be opened or isn't a valid pack. Not thread safe: mount before
+// any loading starts.
+bool mountAssetPack(const std::string& packFile, AssetPriority priority = AssetPriority::PackFirst);
+
+// Read path from its loose file, while there is one, from now on whatever the priority.
+// Safe to call while other threads are opening assets.
+void preferLooseAsset(const std::string& path);
+
+// Build a pack from loose files. Paths are stored as given, with '\' turned into '/'.
+// Entries are compressed when that makes them noticeably smaller.
+bool writeAssetPack(const std::string& packFile, const std::vector<std::string>& files);
+
+// Size and last write time of an asset. For a packed asset these are the stamps of the
+// file it was packed from, so caches keyed on them stay valid whichever way it is read.
+void getAssetStamp(const std::string& path, uint64_t& size, uint64_t& writeTime);
+
+// FNV-1a of an asset's contents, 0 if it can't be read
+uint64_t hashAsset(const std::string& path);
+
+// Every loose file directly inside a directory, as "directory/name"
+std::vector<std::string> listAssetFiles(const std::string& directory);
+
+// The whole contents of an asset. Uncompressed pack entries point straight into the mapped
+// pack; compressed ones are decompressed into a buffer owned by the AssetFile. As with
+// MappedFile the block is NOT null terminated.
+class AssetFile
+{
+public:
+	AssetFile() : mData(nullptr), mSize(0) {}
+	explicit AssetFile(const std::string& path) : AssetFile() { open(path); }
+
+	AssetFile(const AssetFile&) = delete;
+	AssetFile& operator=(const AssetFile&) = delete;
+
+	// Returns false if the asset is neither in the pack nor a loose file
+	bool open(const std::string& path);
+
+	const char* data() const { return mData; }
+	const char* end() const { return mData + mSize; }
+	size_t size() const { return mSize; }
+
+private:
+	MappedFile mLoose;
+	std::vector<char> mUnpacked;
+	const char* mData;
+	size_t mSize;
+};
+
+// An istream reading an asset, for loaders written around ifstream. Lines keep any '\r'
+// the file has, as the stream is not in text mode.
+class AssetStream : public std::istream
+{
+public:
+	explicit AssetStream(const std::string& path)
+		: std::istream(nullptr)
+	{
+		if (mFile.open(path))
+		{
+			char* begin = const_cast<char*>(mFile.data());
+			mBuffer.setRange(begin, begin + mFile.size());
+			rdbuf(&mBuffer);
+		}
+		else
+		{
+			setstate(std::ios::failbit);
+		}
+	}
+
+private:
+	// Read-only view of a block of memory
+	struct MemoryBuffer : std::streambuf {
+		void setRange(char* begin, char* end) { setg(begin, begin, end); }
+	};
+
+	AssetFile mFile;
+	MemoryBuffer mBuffer;
+};
+
+#endif // ASSET_PACK_HPP
@@ -0,0 +1,114 @@
+#include "Header.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+// *********** Asset streaming ***********
+
+// Worker threads take assets off mRequests, load them with AssetManager::loadMesh (parsing,
+// normals, optimisation and the cache all happen in Mesh::load) and put them on mResults.
+// Reloads of changed files go through the same queue, with AssetManager::reloadMesh.
+// Nothing here touches OpenGL -- buffers can only be created on the thread that owns the
+// context, so uploading is left to whoever calls poll(), which is Game::uploadStreamedAssets.
+
+AssetStreamer::AssetStreamer(AssetManager& assets, unsigned threadCount)
+	: mAssets(assets), mLoading(0), mStopping(false)
+{
+	// Large OBJ files are already parsed on every core (see parseObjParallel), so a couple of
+	// workers are enough to keep small files and cache hits moving alongside them.
+	if (threadCount == 0)
+	{
+		threadCount = min(max(thread::hardware_concurrency() / 2, 1u), 4u);
+	}
+	for (unsigned i = 0; i < threadCount; ++i)
+	{
+		mWorkers.push_back(thread(&AssetStreamer::worker, this));
+	}
+}
+
+AssetStreamer::~AssetStreamer()
+{
+	{
+		lock_guard<mutex> lock(mMutex);
+		mStopping = true;
+		mRequests.clear();
+	}
+	mWakeWorkers.notify_all();
+	for (thread& worker : mWorkers)
+	{
+		worker.join();
+	}
+}
+
+void AssetStreamer::request(shared_ptr<MeshAsset> asset)
+{
+	{
+		lock_guard<mutex> lock(mMutex);
+		mRequests.push_back(Request{ asset, false });
+	}
+	mWakeWorkers.notify_one();
+}
+
+void AssetStreamer::requestReload(shared_ptr<MeshAsset> asset)
+{
+	{
+		lock_guard<mutex> lock(mMutex);
+		mRequests.push_back(Request{ asset, true });
+	}
+	mWakeWorkers.notify_one();
+}
+
+bool AssetStreamer::poll(shared_ptr<MeshAsset>& asset)
+{
+	lock_guard<mutex> lock(mMutex);
+	if (mResults.empty())
+	{
+		return false;
+	}
+	asset = std::move(mResults.front());
+	mResults.pop_front();
+	return true;
+}
+
+bool AssetStreamer::idle()
+{
+	lock_guard<mutex> lock(mMutex);
+	return mRequests.empty() && mLoading == 0 && mResults.empty();
+}
+
+void AssetStreamer::worker()
+{
+	unique_lock<mutex> lock(mMutex);
+	while (true)
+	{
+		mWakeWorkers.wait(lock, [this]() { return mStopping || !mRequests.empty(); });
+		if (mStopping)
+		{
+			return;
+		}
+
+		// The asset is moved rather than copied from queue to queue, so a worker never ends up
+		// dropping the last reference to an uploaded asset (and deleting GL buffers off the
+		// main thread)
+		Request request = std::move(mRequests.front());
+		mRequests.pop_front();
+		shared_ptr<MeshAsset> asset = std::move(request.asset);
+		++mLoading;
+
+		// Load without holding the lock, so the main thread can keep polling
+		lock.unlock();
+		if (request.isReload)
+		{
+			mAssets.reloadMesh(asset);
+		}
+		else
+		{
+			mAssets.loadMesh(asset);
+		}
+		lock.lock();
+
+		mResults.push_back(std::move(asset));
+		--mLoading;
+	}
+}
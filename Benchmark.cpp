@@ -0,0 +1,401 @@
+#include "Mesh.hpp"
+
+#include <Windows.h>
+#include <Psapi.h>
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+
+using namespace std;
+
+// *********** OBJ benchmark ***********
+
+// The benchmark is a command line program of its own (benchmark.vcxproj) measuring how
+// Mesh::load scales with the size of the file. It writes synthetic OBJ files -- tessellated
+// tori and height field grids from 10K to 10M triangles, with faces written as "f v",
+// "f v//vn" and "f v/vt/vn" -- into assets/benchmark/, loads each one with the cache off,
+// and records the phase timings from Mesh::loadTimings along with throughput and the peak
+// working set of the process. Results are written as JSON so runs can be compared.
+//
+// By default only the loading phases are run (read, tokenize, index, normals and MTL);
+// --full runs the LOD, optimise and meshlet phases as well.
+//
+// Usage: benchmark [--out results.json] [--max-triangles N] [--parser stream|mapped|parallel]
+//                  [--repeat N] [--full] [--keep]
+
+const string benchmarkDirectory = "assets/benchmark";
+
+// How the corners of a face are written
+enum class FaceStyle { Position, PositionNormal, PositionTexcoordNormal };
+
+static const char* faceStyleName(FaceStyle style)
+{
+	switch (style)
+	{
+	case FaceStyle::Position:
+		return "v";
+	case FaceStyle::PositionNormal:
+		return "v//vn";
+	default:
+		return "v/vt/vn";
+	}
+}
+
+// A surface made of columns x rows quads. The torus wraps round in both directions; the
+// grid doesn't, so it has an extra row and column of vertices.
+struct Surface {
+	string shape;
+	int columns, rows;
+	bool wraps;
+
+	int vertexColumns() const { return wraps ? columns : columns + 1; }
+	int vertexRows() const { return wraps ? rows : rows + 1; }
+	size_t triangleCount() const { return size_t(columns) * rows * 2; }
+
+	// Position, normal and texcoord of vertex (i, j)
+	void vertex(int i, int j, glm::vec3& position, glm::vec3& normal, glm::vec2& texcoord) const
+	{
+		float u = float(i) / columns;
+		float v = float(j) / rows;
+		texcoord = glm::vec2(u, v);
+		if (wraps)
+		{
+			// Tube of radius 0.25 round a ring of radius 1
+			float a = u * 6.2831853f, b = v * 6.2831853f;
+			glm::vec3 ring(cos(a), 0.0f, sin(a));
+			normal = ring * cos(b) + glm::vec3(0.0f, sin(b), 0.0f);
+			position = ring + normal * 0.25f;
+		}
+		else
+		{
+			// Gentle waves over a 2 x 2 square, so generated normals aren't all the same
+			float x = u * 2.0f - 1.0f, z = v * 2.0f - 1.0f;
+			float k = 12.0f, h = 0.05f;
+			position = glm::vec3(x, h * sin(k * x) * cos(k * z), z);
+			normal = glm::normalize(glm::vec3(-h * k * cos(k * x) * cos(k * z), 1.0f, h * k * sin(k * x) * sin(k * z)));
+		}
+	}
+
+	// 1-based OBJ index of vertex (i, j)
+	size_t index(int i, int j) const
+	{
+		if (wraps)
+		{
+			i %= columns;
+			j %= rows;
+		}
+		return size_t(j) * vertexColumns() + i + 1;
+	}
+};
+
+// The surface of the given shape with roughly the given number of triangles
+static Surface makeSurface(const string& shape, size_t triangles)
+{
+	Surface surface;
+	surface.shape = shape;
+	surface.wraps = shape == "torus";
+	if (surface.wraps)
+	{
+		// Twice as many quads round the ring as round the tube
+		surface.rows = max(3, int(sqrt(triangles / 4.0) + 0.5));
+		surface.columns = surface.rows * 2;
+	}
+	else
+	{
+		surface.rows = max(1, int(sqrt(triangles / 2.0) + 0.5));
+		surface.columns = surface.rows;
+	}
+	return surface;
+}
+
+// Write surface as an OBJ file using style for its faces. The first half of the faces use
+// one material and the rest another, so the faces are grouped and the MTL file is read as
+// for a real model. Returns the size of the file, or 0 if it couldn't be written.
+static uint64_t writeObj(const string& fileName, const Surface& surface, FaceStyle style)
+{
+	FILE* out = nullptr;
+	if (fopen_s(&out, fileName.c_str(), "wb") != 0 || !out)
+	{
+		cerr << "Cannot write " << fileName << endl;
+		return 0;
+	}
+
+	// Lines are formatted into a large buffer, as fprintf per number would dominate the time
+	vector<char> buffer;
+	buffer.reserve(1 << 20);
+	char line[256];
+	uint64_t size = 0;
+	auto flush = [&]() {
+		size += fwrite(buffer.data(), 1, buffer.size(), out);
+		buffer.clear();
+	};
+	auto append = [&](int length) {
+		buffer.insert(buffer.end(), line, line + length);
+		if (buffer.size() >= (1 << 20) - sizeof(line))
+		{
+			flush();
+		}
+	};
+
+	append(snprintf(line, sizeof(line), "# %s, %zu triangles\nmtllib benchmark/benchmark.mtl\n", surface.shape.c_str(), surface.triangleCount()));
+
+	glm::vec3 position, normal;
+	glm::vec2 texcoord;
+	for (int j = 0; j < surface.vertexRows(); ++j)
+	{
+		for (int i = 0; i < surface.vertexColumns(); ++i)
+		{
+			surface.vertex(i, j, position, normal, texcoord);
+			append(snprintf(line, sizeof(line), "v %.6f %.6f %.6f\n", position.x, position.y, position.z));
+			if (style == FaceStyle::PositionTexcoordNormal)
+			{
+				append(snprintf(line, sizeof(line), "vt %.6f %.6f\n", texcoord.x, texcoord.y));
+			}
+			if (style != FaceStyle::Position)
+			{
+				append(snprintf(line, sizeof(line), "vn %.6f %.6f %.6f\n", normal.x, normal.y, normal.z));
+			}
+		}
+	}
+
+	// Every vertex has its own texcoord and normal, so all three indices of a corner match
+	auto corner = [style](char* p, size_t room, size_t n) {
+		switch (style)
+		{
+		case FaceStyle::Position:
+			return snprintf(p, room, " %zu", n);
+		case FaceStyle::PositionNormal:
+			return snprintf(p, room, " %zu//%zu", n, n);
+		default:
+			return snprintf(p, room, " %zu/%zu/%zu", n, n, n);
+		}
+	};
+	for (int j = 0; j < surface.rows; ++j)
+	{
+		if (j == 0 || j == surface.rows / 2)
+		{
+			append(snprintf(line, sizeof(line), "usemtl %s\n", j == 0 ? "first" : "second"));
+		}
+		for (int i = 0; i < surface.columns; ++i)
+		{
+			size_t a = surface.index(i, j), b = surface.index(i + 1, j);
+			size_t c = surface.index(i + 1, j + 1), d = surface.index(i, j + 1);
+			int length = snprintf(line, sizeof(line), "f");
+			length += corner(line + length, sizeof(line) - length, a);
+			length += corner(line + length, sizeof(line) - length, d);
+			length += corner(line + length, sizeof(line) - length, c);
+			length += snprintf(line + length, sizeof(line) - length, "\nf");
+			length += corner(line + length, sizeof(line) - length, a);
+			length += corner(line + length, sizeof(line) - length, c);
+			length += corner(line + length, sizeof(line) - length, b);
+			length += snprintf(line + length, sizeof(line) - length, "\n");
+			append(length);
+		}
+	}
+
+	flush();
+	bool written = !ferror(out);
+	fclose(out);
+	return written ? size : 0;
+}
+
+static bool writeMtl(const string& fileName)
+{
+	ofstream out(fileName, ios::out | ios::trunc);
+	out << "newmtl first\nKa 0.1 0.1 0.1\nKd 0.8 0.2 0.2\nKs 0.5 0.5 0.5\nNs 32\n\n"
+		<< "newmtl second\nKa 0.1 0.1 0.1\nKd 0.2 0.2 0.8\nKs 0.5 0.5 0.5\nNs 32\n";
+	return static_cast<bool>(out);
+}
+
+static uint64_t peakWorkingSet()
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		return 0;
+	}
+	return counters.PeakWorkingSetSize;
+}
+
+// One line of the results
+struct BenchmarkResult {
+	string shape;
+	FaceStyle style;
+	size_t triangles;
+	size_t vertices;   // As loaded, after welding
+	uint64_t fileSize;
+	MeshLoadTimings timings;
+	uint64_t peakWorkingSet;
+};
+
+static void writeJson(ostream& out, const string& parser, int repeat, bool full, const vector<BenchmarkResult>& results)
+{
+	out.precision(6);
+	out << "{\n"
+		<< "  \"benchmark\": \"Mesh::load\",\n"
+		<< "  \"parser\": \"" << parser << "\",\n"
+		<< "  \"threads\": " << thread::hardware_concurrency() << ",\n"
+		<< "  \"repeat\": " << repeat << ",\n"
+		<< "  \"fullPipeline\": " << (full ? "true" : "false") << ",\n"
+		<< "  \"results\": [";
+	for (size_t r = 0; r < results.size(); ++r)
+	{
+		const BenchmarkResult& result = results[r];
+		const MeshLoadTimings& t = result.timings;
+		double parseSeconds = t.read + t.tokenize;
+		out << (r == 0 ? "\n" : ",\n")
+			<< "    {\n"
+			<< "      \"shape\": \"" << result.shape << "\",\n"
+			<< "      \"faces\": \"" << faceStyleName(result.style) << "\",\n"
+			<< "      \"triangles\": " << result.triangles << ",\n"
+			<< "      \"vertices\": " << result.vertices << ",\n"
+			<< "      \"fileBytes\": " << result.fileSize << ",\n"
+			<< "      \"seconds\": { \"read\": " << t.read << ", \"tokenize\": " << t.tokenize
+			<< ", \"index\": " << t.index << ", \"normals\": " << t.normals << ", \"materials\": " << t.materials
+			<< ", \"lods\": " << t.lods << ", \"optimise\": " << t.optimise << ", \"meshlets\": " << t.meshlets
+			<< ", \"total\": " << t.total << " },\n"
+			<< "      \"parseMegabytesPerSecond\": " << (parseSeconds > 0.0 ? result.fileSize / parseSeconds / 1e6 : 0.0) << ",\n"
+			<< "      \"trianglesPerSecond\": " << (t.total > 0.0 ? result.triangles / t.total : 0.0) << ",\n"
+			<< "      \"peakWorkingSetBytes\": " << result.peakWorkingSet << "\n"
+			<< "    }";
+	}
+	out << "\n  ]\n}\n";
+}
+
+int main(int argc, char* argv[])
+{
+	string outFile = "benchmark.json";
+	size_t maxTriangles = 10000000;
+	string parser = "parallel";
+	int repeat = 3;
+	bool full = false;
+	bool keep = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		string argument = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (argument == "--out" && hasValue)
+		{
+			outFile = argv[++i];
+		}
+		else if (argument == "--max-triangles" && hasValue)
+		{
+			maxTriangles = stoull(argv[++i]);
+		}
+		else if (argument == "--parser" && hasValue)
+		{
+			parser = argv[++i];
+		}
+		else if (argument == "--repeat" && hasValue)
+		{
+			repeat = max(1, stoi(argv[++i]));
+		}
+		else if (argument == "--full")
+		{
+			full = true;
+		}
+		else if (argument == "--keep")
+		{
+			keep = true;
+		}
+		else
+		{
+			cerr << "Usage: benchmark [--out results.json] [--max-triangles N] [--parser stream|mapped|parallel] [--repeat N] [--full] [--keep]" << endl;
+			return 1;
+		}
+	}
+
+	MeshOptions options;
+	options.useCache = false;
+	if (parser == "stream")
+	{
+		options.parser = MeshParser::Stream;
+	}
+	else if (parser == "mapped")
+	{
+		options.parser = MeshParser::Mapped;
+	}
+	else
+	{
+		parser = "parallel";
+		options.parser = MeshParser::Parallel;
+	}
+	if (!full)
+	{
+		options.lodCount = 1;
+		options.optimise = false;
+		options.buildMeshlets = false;
+	}
+
+	CreateDirectoryA(benchmarkDirectory.c_str(), nullptr);
+	if (!writeMtl(benchmarkDirectory + "/benchmark.mtl"))
+	{
+		cerr << "Cannot write to " << benchmarkDirectory << endl;
+		return 1;
+	}
+
+	// Smallest first, as the peak working set can only go up
+	vector<BenchmarkResult> results;
+	const FaceStyle styles[] = { FaceStyle::Position, FaceStyle::PositionNormal, FaceStyle::PositionTexcoordNormal };
+	for (size_t triangles = 10000; triangles <= maxTriangles; triangles *= 10)
+	{
+		for (const string& shape : { string("torus"), string("grid") })
+		{
+			for (FaceStyle style : styles)
+			{
+				Surface surface = makeSurface(shape, triangles);
+				string styleTag = style == FaceStyle::Position ? "v" : style == FaceStyle::PositionNormal ? "vn" : "vtn";
+				string fileName = benchmarkDirectory + "/" + shape + "_" + to_string(triangles) + "_" + styleTag + ".obj";
+
+				BenchmarkResult result;
+				result.shape = shape;
+				result.style = style;
+				result.triangles = surface.triangleCount();
+				result.fileSize = writeObj(fileName, surface, style);
+				if (result.fileSize == 0)
+				{
+					continue;
+				}
+
+				// Keep the fastest run; the first one also warms the file cache
+				for (int run = 0; run < repeat; ++run)
+				{
+					Mesh mesh;
+					mesh.load(fileName, options);
+					if (run == 0 || mesh.loadTimings.total < result.timings.total)
+					{
+						result.timings = mesh.loadTimings;
+						result.vertices = mesh.vertices.size();
+					}
+				}
+				result.peakWorkingSet = peakWorkingSet();
+				results.push_back(result);
+
+				cerr << fileName << ": " << result.fileSize / 1e6 << " MB, " << result.timings.total << "s" << endl;
+				if (!keep)
+				{
+					DeleteFileA(fileName.c_str());
+				}
+			}
+		}
+	}
+
+	if (!keep)
+	{
+		DeleteFileA((benchmarkDirectory + "/benchmark.mtl").c_str());
+		RemoveDirectoryA(benchmarkDirectory.c_str());
+	}
+
+	ofstream out(outFile, ios::out | ios::trunc);
+	writeJson(out, parser, repeat, full, results);
+	if (!out)
+	{
+		cerr << "Cannot write " << outFile << endl;
+		return 1;
+	}
+	return 0;
+}
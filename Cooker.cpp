@@ -0,0 +1,280 @@
+#include "Mesh.hpp"
+
+#include "AssetPack.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+// *********** Asset cooker ***********
+
+// The cooker is a command line program of its own (cooker.vcxproj) that turns assets/ into
+// what the game wants at startup. Every OBJ and GLB file goes through Mesh::load -- parsing,
+// welding, normals, materials, LODs, optimisation and meshlets -- which leaves the finished
+// mesh in its binary cache, and then the sources and caches are packed into assets.pack.
+//
+// Work is skipped by content rather than by date. A manifest next to the pack records the
+// hash of every source file, and for every mesh the hashes of it and of the MTL library
+// it uses when it was cooked. A mesh is cooked again only if one of those hashes has
+// changed or its cache is missing or was built with other options. Sources are only read
+// to hash them when their size or write time has changed, so an untouched tree costs one
+// directory listing and a stat per file.
+//
+// Usage: cooker [asset directory] [pack file] [--force]
+
+// A source file's stamps and content hash
+struct CookedFile {
+	uint64_t size;
+	uint64_t writeTime;
+	uint64_t hash;
+};
+
+// A mesh file as it was last cooked: its hash followed by the path and hash of each file it
+// depends on
+struct CookedMesh {
+	uint64_t hash;
+	vector<pair<string, uint64_t>> dependencies;
+};
+
+struct CookManifest {
+	map<string, CookedFile> files;
+	map<string, CookedMesh> meshes;
+};
+
+// Tab separated lines: "file <path> <size> <write time> <hash>" and
+// "mesh <path> <hash> [<dependency> <hash>]..."
+static CookManifest readManifest(const string& fileName)
+{
+	CookManifest manifest;
+	ifstream in(fileName, ios::in);
+	string line;
+	while (getline(in, line))
+	{
+		vector<string> fields;
+		istringstream s(line);
+		for (string field; getline(s, field, '\t');)
+		{
+			fields.push_back(field);
+		}
+
+		if (fields.size() == 5 && fields[0] == "file")
+		{
+			CookedFile& file = manifest.files[fields[1]];
+			file.size = stoull(fields[2]);
+			file.writeTime = stoull(fields[3]);
+			file.hash = stoull(fields[4], nullptr, 16);
+		}
+		else if (fields.size() >= 3 && fields.size() % 2 == 1 && fields[0] == "mesh")
+		{
+			CookedMesh& mesh = manifest.meshes[fields[1]];
+			mesh.hash = stoull(fields[2], nullptr, 16);
+			for (size_t i = 3; i < fields.size(); i += 2)
+			{
+				mesh.dependencies.push_back(make_pair(fields[i], stoull(fields[i + 1], nullptr, 16)));
+			}
+		}
+	}
+	return manifest;
+}
+
+static bool writeManifest(const string& fileName, const CookManifest& manifest)
+{
+	ofstream out(fileName, ios::out | ios::trunc);
+	for (auto& file : manifest.files)
+	{
+		out << "file\t" << file.first << '\t' << file.second.size << '\t' << file.second.writeTime << '\t' << hex << file.second.hash << dec << '\n';
+	}
+	for (auto& mesh : manifest.meshes)
+	{
+		out << "mesh\t" << mesh.first << '\t' << hex << mesh.second.hash;
+		for (auto& dependency : mesh.second.dependencies)
+		{
+			out << '\t' << dependency.first << '\t' << dependency.second;
+		}
+		out << dec << '\n';
+	}
+	return static_cast<bool>(out);
+}
+
+// Run job(i) for every i below count, on all cores
+template <typename Job>
+static void parallelFor(size_t count, Job job)
+{
+	atomic<size_t> next(0);
+	vector<thread> workers;
+	unsigned threadCount = max(thread::hardware_concurrency(), 1u);
+	for (unsigned t = 0; t < threadCount; ++t)
+	{
+		workers.push_back(thread([&]() {
+			for (size_t i = next++; i < count; i = next++)
+			{
+				job(i);
+			}
+		}));
+	}
+	for (thread& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+static bool endsWith(const string& text, const string& suffix)
+{
+	return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(int argc, char* argv[])
+{
+	string assetDirectory = "assets";
+	string packFile = "assets.pack";
+	bool force = false;
+	vector<string> positional;
+	for (int i = 1; i < argc; ++i)
+	{
+		string argument = argv[i];
+		if (argument == "--force")
+		{
+			force = true;
+		}
+		else
+		{
+			positional.push_back(argument);
+		}
+	}
+	if (positional.size() > 0) assetDirectory = positional[0];
+	if (positional.size() > 1) packFile = positional[1];
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	auto secondsSince = [](chrono::steady_clock::time_point from) {
+		return chrono::duration<double>(chrono::steady_clock::now() - from).count();
+	};
+
+	// The caches are outputs, not sources
+	vector<string> sources;
+	for (const string& file : listAssetFiles(assetDirectory))
+	{
+		if (!endsWith(file, ".meshcache") && !endsWith(file, ".tmp"))
+		{
+			sources.push_back(file);
+		}
+	}
+
+	string manifestFile = packFile + ".manifest";
+	CookManifest previous = force ? CookManifest() : readManifest(manifestFile);
+	CookManifest manifest;
+
+	// Hash whatever has changed on disk since the last cook
+	vector<CookedFile> stamps(sources.size());
+	atomic<size_t> hashedCount(0);
+	parallelFor(sources.size(), [&](size_t i) {
+		CookedFile& file = stamps[i];
+		getFileStamp(sources[i], file.size, file.writeTime);
+		auto known = previous.files.find(sources[i]);
+		if (known != previous.files.end() && known->second.size == file.size && known->second.writeTime == file.writeTime)
+		{
+			file.hash = known->second.hash;
+		}
+		else
+		{
+			file.hash = hashAsset(sources[i]);
+			++hashedCount;
+		}
+	});
+	for (size_t i = 0; i < sources.size(); ++i)
+	{
+		manifest.files[sources[i]] = stamps[i];
+	}
+	auto currentHash = [&manifest](const string& path) {
+		auto found = manifest.files.find(path);
+		return found != manifest.files.end() ? found->second.hash : 0;
+	};
+
+	// Work out which meshes need cooking. The game loads with the default options, so that
+	// is what the caches are built with.
+	MeshOptions options;
+	vector<string> dirty;
+	for (const string& source : sources)
+	{
+		if (!endsWith(source, ".obj") && !endsWith(source, ".glb"))
+		{
+			continue;
+		}
+
+		auto cooked = previous.meshes.find(source);
+		bool upToDate = cooked != previous.meshes.end() && cooked->second.hash == currentHash(source);
+		for (size_t d = 0; upToDate && d < cooked->second.dependencies.size(); ++d)
+		{
+			upToDate = cooked->second.dependencies[d].second == currentHash(cooked->second.dependencies[d].first);
+		}
+
+		// A source saved again without changing has new stamps, which the cache has to
+		// record or the game would find it out of date
+		if (upToDate && Mesh::restampCache(source, options))
+		{
+			manifest.meshes[source] = cooked->second;
+		}
+		else
+		{
+			dirty.push_back(source);
+		}
+	}
+
+	// Biggest first, so a large file isn't left running on its own at the end
+	sort(dirty.begin(), dirty.end(), [&manifest](const string& a, const string& b) {
+		return manifest.files[a].size > manifest.files[b].size;
+	});
+
+	chrono::steady_clock::time_point cookStart = chrono::steady_clock::now();
+	vector<CookedMesh> cookedMeshes(dirty.size());
+	parallelFor(dirty.size(), [&](size_t i) {
+		// The cache goes first, so Mesh::load can't mistake it for up to date
+		Mesh::removeCache(dirty[i]);
+		Mesh mesh;
+		mesh.load(dirty[i], options);
+
+		CookedMesh& cooked = cookedMeshes[i];
+		cooked.hash = currentHash(dirty[i]);
+		if (mesh.mtlFile != "")
+		{
+			cooked.dependencies.push_back(make_pair(mesh.mtlFile, currentHash(mesh.mtlFile)));
+		}
+	});
+	for (size_t i = 0; i < dirty.size(); ++i)
+	{
+		manifest.meshes[dirty[i]] = cookedMeshes[i];
+	}
+	double cookSeconds = secondsSince(cookStart);
+
+	// Repack unless nothing at all has changed
+	vector<string> packed = sources;
+	for (auto& mesh : manifest.meshes)
+	{
+		packed.push_back(mesh.first + ".meshcache");
+	}
+	uint64_t packSize, packWriteTime;
+	getFileStamp(packFile, packSize, packWriteTime);
+	bool repack = force || hashedCount > 0 || !dirty.empty() || previous.files.size() != manifest.files.size() || packSize == 0;
+
+	chrono::steady_clock::time_point packStart = chrono::steady_clock::now();
+	if (repack && !writeAssetPack(packFile, packed))
+	{
+		return 1;
+	}
+	if (!writeManifest(manifestFile, manifest))
+	{
+		cerr << "Cannot write " << manifestFile << endl;
+		return 1;
+	}
+
+	cout << "Hashed " << hashedCount << " of " << sources.size() << " files, cooked " << dirty.size() << " of "
+		<< manifest.meshes.size() << " meshes in " << cookSeconds << "s, "
+		<< (repack ? "packed in " + to_string(secondsSince(packStart)) + "s" : "pack up to date")
+		<< ", " << secondsSince(start) << "s in all" << endl;
+	return 0;
+}
@@ -0,0 +1,146 @@
+#pragma once
+/***
+description: Watches a set of files for changes using the directory change notifications
+of FindFirstChangeNotification. Polling with changedFiles() never blocks, so the game can
+check once a frame; the file stamps of a directory are only read after the OS has signalled
+that something in it changed.
+
+A file is reported once it has stopped changing for settleTime, so an exporter writing a
+large file in several goes causes one reload rather than a reload of a half written file.
+***/
+
+#ifndef FILE_WATCHER_HPP
+#define FILE_WATCHER_HPP
+
+#include "MappedFile.hpp"
+
+#include <Windows.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cstdint>
+
+class FileWatcher
+{
+public:
+	explicit FileWatcher(std::chrono::milliseconds settleTime = std::chrono::milliseconds(200))
+		: mSettleTime(settleTime) {}
+
+	~FileWatcher()
+	{
+		for (auto& directory : mDirectories)
+		{
+			if (directory.second != INVALID_HANDLE_VALUE)
+			{
+				FindCloseChangeNotification(directory.second);
+			}
+		}
+	}
+
+	// Notification handles are owned, so a watcher can't be copied
+	FileWatcher(const FileWatcher&) = delete;
+	FileWatcher& operator=(const FileWatcher&) = delete;
+
+	// Start watching a file. Watching a file twice, or an empty name, does nothing.
+	void watch(const std::string& fileName)
+	{
+		if (fileName == "")
+		{
+			return;
+		}
+		for (const WatchedFile& file : mFiles)
+		{
+			if (file.name == fileName)
+			{
+				return;
+			}
+		}
+
+		WatchedFile file;
+		file.name = fileName;
+		file.directory = directoryOf(fileName);
+		getFileStamp(fileName, file.size, file.writeTime);
+		file.isPending = false;
+		mFiles.push_back(file);
+
+		if (mDirectories.count(file.directory) == 0)
+		{
+			// Renames are watched as well as writes, as some exporters write a temporary file
+			// and rename it over the old one
+			HANDLE handle = FindFirstChangeNotificationA(file.directory.c_str(), FALSE,
+				FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_FILE_NAME);
+			if (handle == INVALID_HANDLE_VALUE)
+			{
+				std::cerr << "Cannot watch " << file.directory << " for changes" << std::endl;
+			}
+			mDirectories[file.directory] = handle;
+		}
+	}
+
+	// Adds every watched file that has changed and settled since the last call to changed
+	void changedFiles(std::vector<std::string>& changed)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+		for (auto& directory : mDirectories)
+		{
+			if (directory.second == INVALID_HANDLE_VALUE || WaitForSingleObject(directory.second, 0) != WAIT_OBJECT_0)
+			{
+				continue;
+			}
+			FindNextChangeNotification(directory.second);
+
+			for (WatchedFile& file : mFiles)
+			{
+				if (file.directory != directory.first)
+				{
+					continue;
+				}
+				uint64_t size, writeTime;
+				getFileStamp(file.name, size, writeTime);
+				if (size != file.size || writeTime != file.writeTime)
+				{
+					file.size = size;
+					file.writeTime = writeTime;
+					file.isPending = true;
+					file.changedAt = now;
+				}
+			}
+		}
+
+		// A file that has gone (mid rename, say) is left pending until it is back
+		for (WatchedFile& file : mFiles)
+		{
+			if (file.isPending && file.size != 0 && now - file.changedAt >= mSettleTime)
+			{
+				file.isPending = false;
+				changed.push_back(file.name);
+			}
+		}
+	}
+
+private:
+	struct WatchedFile {
+		std::string name;
+		std::string directory;
+		uint64_t size;
+		uint64_t writeTime;
+		bool isPending; // Changed, waiting to settle
+		std::chrono::steady_clock::time_point changedAt;
+	};
+
+	static std::string directoryOf(const std::string& fileName)
+	{
+		size_t slash = fileName.find_last_of("/\\");
+		return slash == std::string::npos ? "." : fileName.substr(0, slash);
+	}
+
+	std::chrono::milliseconds mSettleTime;
+	std::map<std::string, HANDLE> mDirectories;
+	std::vector<WatchedFile> mFiles;
+};
+
+#endif // FILE_WATCHER_HPP
@@ -8,261 +8,106 @@
 
 #include "Libs\glm-0.9.8.4\glm\glm\gtc\type_ptr.hpp"
 
+#include "AssetPack.hpp"
+#include "FileWatcher.hpp"
+
 using namespace std;
 
-// *********** Mesh ***********
+// ************* KeyHandler *********************
+
+
+// ************* GameObject *********************
 
-void Mesh::load(string meshSource)
+void GameObject::renderSubmesh(size_t submesh, size_t lod, const MeshletCuller* culler, DrawScratch& scratch)
 {
-	ifstream in(meshSource, ios::in);
-	if (!in)
+	MeshAsset* asset = getMeshAsset();
+	const Mesh& mesh = asset->mesh;
+	scratch.ranges.clear();
+	submeshRanges(submesh, lod, culler, scratch.ranges);
+
+	// The pool's vertex array is left bound by the caller. The mesh is somewhere in the middle
+	// of its buffers, so index offsets start at the slice and indices count from its base vertex.
+	// Several ranges, one per run of visible meshlets, go in one glMultiDrawElements.
+	const GeometrySlice& geometry = asset->geometry;
+	scratch.counts.clear();
+	scratch.offsets.clear();
+	for (const IndexRange& range : scratch.ranges)
 	{
-		cerr << "Cannot open " << meshSource << endl; exit(1);
+		scratch.counts.push_back(static_cast<GLsizei>(range.indexCount));
+		scratch.offsets.push_back(reinterpret_cast<const GLvoid*>(geometry.indexOffset + range.firstIndex * mesh.indexSize()));
 	}
 
-	// The processing of the OBJ file given here is not very efficient but for smallish models
-	// it's not too bad, and gets the job done in a easily understandable way.
-	// Also note that there is no error handling -- it is assumed that the OBJ file is well formed
-	// and that all vertex lines contain only three numbers (ie the mesh as been triangulated).
-
-	// An OBJ file will typically have a MTL (for materials file) associated with it.
-	// If we find one we will store it's location in the following variable then process the MTL file
-	// after the OBJ file.
-	string mtlFile = "";
-
-	string line;
-	while (getline(in, line))
-	{   // See: http://www.cplusplus.com/reference/string/string/substr/
-		if (line.substr(0, 2) == "v ") // process vertex lines
-		{
-			istringstream s(line.substr(2));
-			glm::vec4 v;
-			s >> v.x;
-			s >> v.y;
-			s >> v.z;
-			v.w = 1.0f;  // Complete the vec4.
-			vertices.push_back(v);
-		}
-		else if (line.substr(0, 2) == "f ") // process face lines
-		{
-			// The original of this clause assumed that face lines were of the form
-			// f 1 4 9
-			// ie an 'f' followed by 3 integers.
-			// We want to be able to process face lines of the form
-			// f 1//3 4//2 9//3
-			// (which includes normal indices) or
-			// f 1/2/3 4/7/2 9/4/6
-			// (which include texture indices).
-
-			// Approach is to read each group into a separate string and then extract the indices.
-
-			istringstream s(line.substr(2));
-			string s1, s2, s3;
-			s >> s1 >> s2 >> s3;
-
-			// For each of the substrings s1,s2,s3 we need to split '10/2/3' into '10', '2', '3', or '1//37' into '1', '','37' etc
-
-			GLushort a, b, c;
-
-			// The std::string method find returns the position of the first occurence of the string it is searching for (or
-			// the length of the searched string if it cannot find any occurrences).
-			// See: http://www.cplusplus.com/reference/string/string/find/
-			// We can use the find method to split up the strings as follows
-
-			// This code assumes that entries on face lines will be like 1/2/3 or 2//4 -- what happens if entries are not one of these types?
-			int sl1pos = s1.find('/', 0);
-			string i1 = s1.substr(0, sl1pos);
-			int sl2pos = s1.find('/', sl1pos + 1); // Start searching for next slash one position beyond first.
-			string i2 = s1.substr(sl1pos + 1, sl2pos - (sl1pos + 1));
-			string i3 = s1.substr(sl2pos + 1); // Everything from second slash to end of string (this is assumed to be an integer)
-
-											   // Currently we will only make use of the first index found 
-			a = stoi(i1); // See: http://www.cplusplus.com/reference/string/stoi/
-
-						  // The splitting code now needs to be repeated for s2 and s3.
-						  // There is an obvious refactoring to make here -- move this splitting code to a separate function!
-
-			sl1pos = s2.find('/', 0);
-			i1 = s2.substr(0, sl1pos);
-			sl2pos = s2.find('/', sl1pos + 1); // Start searching for next slash one position beyond first.
-			i2 = s2.substr(sl1pos + 1, sl2pos - (sl1pos + 1));
-			i3 = s2.substr(sl2pos + 1); // Everything from second slash to end of string (this is assumed to be an integer)
-
-			b = stoi(i1);
-
-
-			sl1pos = s3.find('/', 0);
-			i1 = s3.substr(0, sl1pos);
-			sl2pos = s3.find('/', sl1pos + 1); // Start searching for next slash one position beyond first.
-			i2 = s3.substr(sl1pos + 1, sl2pos - (sl1pos + 1));
-			i3 = s3.substr(sl2pos + 1); // Everything from second slash to end of string (this is assumed to be an integer)
-
-			c = stoi(i1);
-
-			a--;  // Indices in OBJ files are 1-based, whilst C++ arrays are 0-based.
-			b--;
-			c--;
-			elements.push_back(a);
-			elements.push_back(b);
-			elements.push_back(c);
-		}
-		else if (line[0] == '#') // this is a comment line
-		{
-			/* ignoring this line */
-		}
-		else if (line.substr(0, 3) == "vn ") // will want to process normal lines (those beginning "vn ") at sometime
-		{
-			/* ignoring this line */
-		}
-		else if (line.substr(0, 7) == "mtllib ")
-		{
-			istringstream s(line.substr(7));
-			s >> mtlFile;
-			mtlFile = "assets/" + mtlFile;
-			cout << "Found mtllib: " << mtlFile << endl;
-		}
-		else
-		{
-			/* ignoring this line */
-		}
+	if (scratch.counts.size() == 1)
+	{
+		glDrawElementsBaseVertex(GL_TRIANGLES, scratch.counts[0], mesh.indexType, scratch.offsets[0], geometry.baseVertex);
 	}
+	else if (!scratch.counts.empty())
+	{
+		scratch.baseVertices.assign(scratch.counts.size(), geometry.baseVertex);
+		glMultiDrawElementsBaseVertex(GL_TRIANGLES, scratch.counts.data(), mesh.indexType, scratch.offsets.data(),
+			static_cast<GLsizei>(scratch.counts.size()), scratch.baseVertices.data());
+	}
+}
 
-	normals.resize(vertices.size(), glm::vec3(0.0, 0.0, 0.0));
-	for (int i = 0; i < elements.size(); i += 3)
+void GameObject::submeshRanges(size_t submesh, size_t lod, const MeshletCuller* culler, vector<IndexRange>& ranges)
+{
+	const Mesh& mesh = getMesh();
+	if (culler == nullptr || lod != 0 || mesh.submeshes[submesh].meshletCount == 0)
 	{
-		GLushort ia = elements[i];
-		GLushort ib = elements[i + 1];
-		GLushort ic = elements[i + 2];
-		glm::vec3 normal = glm::normalize(glm::cross(
-			glm::vec3(vertices[ib]) - glm::vec3(vertices[ia]),
-			glm::vec3(vertices[ic]) - glm::vec3(vertices[ia])));
-		normals[ia] = normals[ib] = normals[ic] = normal;
+		ranges.push_back(mesh.lods[lod].ranges[submesh]);
+		return;
 	}
 
-	glm::vec4 ambient;
-	glm::vec4 diffusive;
-	glm::vec4 specular;
-	float shininess;
-	float alpha = 1.0;
+	// Meshlets of a submesh are consecutive in the index buffer, so each run of visible
+	// meshlets is one range
+	size_t runFirst = 0, runEnd = 0;
+	auto endRun = [&]() {
+		if (runEnd > runFirst)
+		{
+			ranges.push_back(IndexRange{ runFirst, runEnd - runFirst });
+		}
+	};
 
-	if (mtlFile != "")
+	const Submesh& drawn = mesh.submeshes[submesh];
+	for (size_t m = drawn.firstMeshlet; m < drawn.firstMeshlet + drawn.meshletCount; ++m)
 	{
-		// Process MTL file
-		cout << "Processing MTL file." << endl;
-		ifstream mtlIn(mtlFile, ios::in);
-		if (!mtlIn)
+		const Meshlet& meshlet = mesh.meshlets[m];
+		if (!culler->isVisible(meshlet))
 		{
-			cerr << "Cannot open " << mtlFile << endl;
-			ambient = glm::vec4(0.329412f, 0.223529f, 0.027451f, 1.0f);
-			diffusive = glm::vec4(0.780392f, 0.568627f, 0.113725f, 1.0f);
-			specular = glm::vec4(0.992157f, 0.941176f, 0.807843f, 1.0f);
-			shininess = 27.8;
+			continue;
 		}
-		else
+		if (meshlet.firstIndex != runEnd)
 		{
-			string mtlLine;
-			while (getline(mtlIn, mtlLine))
-			{
-				cout << mtlLine << endl;
-				if (mtlLine.substr(0, 3) == "Ka ")
-				{
-					// Process ambient reflectivity settings
-					istringstream s(mtlLine.substr(3));
-					s >> ambient.r;
-					s >> ambient.g;
-					s >> ambient.b;
-					ambient.a = alpha;  // Complete the vec4.
-				}
-				else if (mtlLine.substr(0, 3) == "Kd ")
-				{
-					// Process diffusive reflectivity settings
-					istringstream s(mtlLine.substr(3));
-					s >> diffusive.r;
-					s >> diffusive.g;
-					s >> diffusive.b;
-					diffusive.a = alpha;  // Complete the vec4.
-				}
-				else if (mtlLine.substr(0, 3) == "Ks ")
-				{
-					// Process specular reflectivity settings
-					istringstream s(mtlLine.substr(3));
-					s >> specular.r;
-					s >> specular.g;
-					s >> specular.b;
-					specular.a = alpha;  // Complete the vec4.
-				}
-				else if (mtlLine.substr(0, 3) == "Ns ")
-				{
-					// Process shininess setting
-					istringstream s(mtlLine.substr(3));
-					s >> shininess;
-				}
-				else if (mtlLine.substr(0, 2) == "d ")
-				{
-					// Process transparency setting
-					istringstream s(mtlLine.substr(2));
-					s >> alpha;
-				}
-				else
-				{
-					// Ignore this line at the moment
-				}
-			}
-
-			ambient.a = alpha;
-			diffusive.a = alpha;
-			specular.a = alpha;
+			endRun();
+			runFirst = meshlet.firstIndex;
 		}
+		runEnd = meshlet.firstIndex + meshlet.indexCount;
 	}
-	else
-	{
-		ambient = glm::vec4(0.329412f, 0.223529f, 0.027451f, 1.0f);
-		diffusive = glm::vec4(0.780392f, 0.568627f, 0.113725f, 1.0f);
-		specular = glm::vec4(0.992157f, 0.941176f, 0.807843f, 1.0f);
-		shininess = 27.8;
-	}
-
-	material.ambientReflectivity = ambient;
-	material.diffuseReflectivity = diffusive;
-	material.specularRelectivity = specular;
-	material.shininess = shininess;
+	endRun();
 }
 
-// ************* KeyHandler *********************
-
-
-// ************* GameObject *********************
-
-void GameObject::loadObject()
+size_t GameObject::selectLod(const glm::mat4& view, const glm::mat4& projection, int screenHeight)
 {
-	// get mesh
-	mMesh.load(mMeshSource);
-
-	// set up buffers to hold mesh data
-	// Error handling missing
-	glGenBuffers(1, &mVertexBufferID);
-	glGenBuffers(1, &mNormalBufferID);
-	glGenBuffers(1, &mElementBufferID);
-
-	glBindBuffer(GL_ARRAY_BUFFER, mVertexBufferID);
-	int dataSize = mMesh.vertices.size() * sizeof(mMesh.vertices[0]);
-	glBufferData(GL_ARRAY_BUFFER, dataSize, mMesh.vertices.data(), GL_STATIC_DRAW);
-
-	glBindBuffer(GL_ARRAY_BUFFER, mNormalBufferID);
-	int ndataSize = mMesh.normals.size() * sizeof(mMesh.normals[0]);
-	glBufferData(GL_ARRAY_BUFFER, ndataSize, mMesh.normals.data(), GL_STATIC_DRAW);
-
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mElementBufferID);
-	int indicesSize = mMesh.elements.size() * sizeof(mMesh.elements[0]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indicesSize, mMesh.elements.data(), GL_STATIC_DRAW);
-}
-
-void GameObject::render()
-{
-	glBindBuffer(GL_ARRAY_BUFFER, mVertexBufferID);
-	glBindBuffer(GL_ARRAY_BUFFER, mNormalBufferID);
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mElementBufferID);
-	glDrawElements(GL_TRIANGLES, mMesh.elements.size(), GL_UNSIGNED_SHORT, 0);
+	// Distance from the eye to the centre of the bounding box, and how many pixels one model
+	// unit covers at that distance. Inside the bounds the object is as close as it gets.
+	const Mesh& mesh = getMesh();
+	glm::vec3 centre = (mesh.boundsMin + mesh.boundsMax) * 0.5f;
+	float radius = glm::length(mesh.boundsMax - mesh.boundsMin) * 0.5f;
+	glm::vec4 eyeCentre = view * mModelTransform * glm::vec4(centre, 1.0f);
+	float scale = max(glm::length(glm::vec3(mModelTransform[0])),
+		max(glm::length(glm::vec3(mModelTransform[1])), glm::length(glm::vec3(mModelTransform[2]))));
+	float distance = glm::length(glm::vec3(eyeCentre));
+
+	if (distance <= radius * scale)
+	{
+		mLod = 0;
+	}
+	else
+	{
+		float pixelsPerUnit = scale * projection[1][1] * 0.5f * screenHeight / distance;
+		mLod = mesh.chooseLod(pixelsPerUnit, mLod);
+	}
+	return mLod;
 }
 
 void GameObject::move(glm::vec3 d)
@@ -279,6 +124,19 @@ void Game::initialise()
 	// Initialise SDL
 	SDL_Init(SDL_INIT_EVERYTHING);
 
+	// Read assets from the pack if there is one, otherwise from the loose files in assets/.
+	// Debug builds read a loose file over its packed copy, so edits made since the pack was
+	// cooked show up; release builds only do that for files hot reloading sees change.
+#ifdef _DEBUG
+	AssetPriority priority = AssetPriority::LooseFirst;
+#else
+	AssetPriority priority = AssetPriority::PackFirst;
+#endif
+	if (mountAssetPack("assets.pack", priority))
+	{
+		cout << "Reading assets from assets.pack" << endl;
+	}
+
 	screenWidth = 500;
 	screenHeight = 500;
 
@@ -309,19 +167,31 @@ void Game::initialise()
 
 	// Load assets
 
-
-	// Set up OpenGL buffers
-	GLuint vao;
-	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
-
 	// Load game objects
 	mGameWorld.push_back(GameObject("Suzanne", "assets/suzanne2.obj"));
 	mGameWorld.push_back(GameObject("Torus", "assets/torus.obj"));
 	mGameWorld.push_back(GameObject("Grid", "assets/grid.obj"));
 
+	// Meshes are loaded in the background and uploaded by run() as they arrive, so the
+	// first frames are drawn straight away and objects appear once they are ready.
+	// Objects using the same mesh share one asset, which is only loaded once.
+	mAssetManager = new AssetManager();
+	mAssetStreamer = new AssetStreamer(*mAssetManager);
+	mUploadBudget = 4 << 20; // bytes per frame
 	for (int i = 0; i < mGameWorld.size(); ++i) {
-		mGameWorld[i].loadObject();
+		// Nothing reads these meshes on the CPU once they are drawn from GL buffers. Hot
+		// reloading parses the file again, so it doesn't need the old data either.
+		MeshOptions options = mGameWorld[i].getMeshOptions();
+		options.retention = MeshRetention::MetadataOnly;
+		mGameWorld[i].setMeshOptions(options);
+
+		bool isNew;
+		shared_ptr<MeshAsset> asset = mAssetManager->acquireMesh(mGameWorld[i].getMeshSource(), mGameWorld[i].getMeshOptions(), isNew);
+		mGameWorld[i].setMeshAsset(asset);
+		if (isNew)
+		{
+			mAssetStreamer->request(asset);
+		}
 		//should read in these values from a file
 		mGameWorld[i].setMaterial(glm::vec4(0.329412f, 0.223529f, 0.027451f, 1.0f),
 			glm::vec4(0.780392f, 0.568627f, 0.113725f, 1.0f),
@@ -344,23 +214,12 @@ void Game::initialise()
 	view = glm::lookAt(glm::vec3(0.0, 0.0, 0.0), glm::vec3(0.0, 0.0, -4.0), glm::vec3(0.0, 1.0, 0.0));
 	projection = glm::perspective(45.0f, 1.0f*screenWidth / screenHeight, 1.0f, 100.0f);
 
-	// Default shaders
+	// Default shaders, and the buffer their uniform blocks are read from
+	mUniformBuffer = new UniformBuffer();
 
 	try {
 		defaultShader = new ShaderProgram();
-		defaultShader->initFromFiles("assets/default.vert", "assets/default.frag");
-		defaultShader->addAttribute("vPosition");
-		defaultShader->addAttribute("vNormal");
-		defaultShader->addUniform("P");
-		defaultShader->addUniform("M");
-		defaultShader->addUniform("V");
-		defaultShader->addUniform("lightPosition");
-		defaultShader->addUniform("ambientContrib");
-		defaultShader->addUniform("diffuseContrib");
-		defaultShader->addUniform("specularContrib");
-		defaultShader->addUniform("shininess");
-
-		defaultShader->use();
+		initDefaultShader(*defaultShader);
 	}
 	catch (const runtime_error& error) {
 		cerr << "Error in shader processing!" << endl;
@@ -371,8 +230,71 @@ void Game::initialise()
 		// Might be better to terminate program at this point.
 	}
 
+	// Where the GL can, the scene is submitted with multi-draw indirect, which costs the same
+	// few calls however many objects there are. Otherwise, or if its shader doesn't build,
+	// objects are drawn one by one as before.
+	mIndirectRenderer = nullptr;
+	indirectShader = nullptr;
+	mUseIndirect = false;
+	if (IndirectRenderer::isSupported()) {
+		indirectShader = new ShaderProgram();
+		try {
+			initIndirectShader(*indirectShader, mFirstDraw);
+			mIndirectRenderer = new IndirectRenderer();
+			mUseIndirect = true;
+		}
+		catch (const runtime_error& error) {
+			cerr << "Error in indirect shader processing, drawing objects one by one" << endl;
+			cerr << error.what() << endl;
+			delete indirectShader;
+			indirectShader = nullptr;
+		}
+	}
+	cout << (mUseIndirect ? "Drawing with multi-draw indirect" : "Drawing objects one by one") << endl;
+
 	glEnable(GL_DEPTH_TEST);
+	// Meshlets facing away from the camera are skipped whole (see MeshMeshlets.cpp), so
+	// back faces are culled everywhere else too to keep closed and open meshes consistent
+	glEnable(GL_CULL_FACE);
+
+	// Watch the shaders for edits. Meshes and their MTL files are watched as they arrive,
+	// see uploadStreamedAssets.
+	mFileWatcher = new FileWatcher();
+	mFileWatcher->watch("assets/default.vert");
+	mFileWatcher->watch("assets/default.frag");
+	mFileWatcher->watch("assets/indirect.vert");
+	mFileWatcher->watch("assets/lighting.glsl");
+}
+
+void Game::initDefaultShader(ShaderProgram& shader)
+{
+	shader.initFromFiles("assets/default.vert", "assets/default.frag");
 
+	// Meshes set up their vertex arrays without knowing the shader (see MeshAsset::upload),
+	// so its inputs have to be where they put the attributes
+	if (shader.addAttribute("vPosition") != PositionAttributeLocation || shader.addAttribute("vNormal") != NormalAttributeLocation)
+	{
+		throw runtime_error("Vertex shader inputs are not at the attribute locations meshes use");
+	}
+	shader.bindUniformBlock("Frame", FrameBlockBinding);
+	shader.bindUniformBlock("Material", MaterialBlockBinding);
+	shader.bindUniformBlock("Object", ObjectBlockBinding);
+
+	shader.use();
+}
+
+void Game::initIndirectShader(ShaderProgram& shader, Uniform<GLint>& firstDraw)
+{
+	// Objects, materials and draws are storage buffers with their bindings in the shader
+	// itself (see assets/indirect.vert); only the frame block is bound here
+	shader.initFromFiles("assets/indirect.vert", "assets/default.frag");
+	if (shader.addAttribute("vPosition") != PositionAttributeLocation || shader.addAttribute("vNormal") != NormalAttributeLocation)
+	{
+		throw runtime_error("Vertex shader inputs are not at the attribute locations meshes use");
+	}
+	shader.bindUniformBlock("Frame", FrameBlockBinding);
+	shader.addUniform("firstDraw");
+	firstDraw = shader.uniformHandle<GLint>("firstDraw");
 }
 
 void Game::run()
@@ -400,6 +322,10 @@ void Game::run()
 			}
 		}
 
+		// Pick up any meshes that have finished loading or reloading, and start reloading
+		// any whose files have changed
+		uploadStreamedAssets();
+		reloadChangedAssets();
 		// Update game in response to user input
 		update(theKey);
 		// Render the game world.
@@ -408,9 +334,128 @@ void Game::run()
 	}
 }
 
+void Game::uploadStreamedAssets()
+{
+	// Always take at least one mesh, so that one bigger than the budget still gets uploaded
+	// Copies of another asset have nothing of their own to upload.
+	size_t uploaded = 0;
+	shared_ptr<MeshAsset> asset;
+	while (uploaded < mUploadBudget && mAssetStreamer->poll(asset))
+	{
+		asset->publishCopy();
+		if (asset->reloaded)
+		{
+			uploaded += asset->applyReload();
+		}
+		else if (!asset->sameAs)
+		{
+			uploaded += asset->upload();
+		}
+
+		// An alias's MTL file is its original's, which is watched when the original is uploaded
+		mFileWatcher->watch(asset->source);
+		mFileWatcher->watch(asset->mtlFile);
+	}
+}
+
+void Game::reloadChangedAssets()
+{
+	vector<string> changed;
+	mFileWatcher->changedFiles(changed);
+	bool shadersChanged = false;
+	for (const string& fileName : changed)
+	{
+		// The edit is in the loose file, so that has to win over the pack from now on, for
+		// the reload and for the stamps the caches are checked against
+		cout << fileName << " has changed" << endl;
+		preferLooseAsset(fileName);
+		shadersChanged |= (fileName == "assets/default.vert" || fileName == "assets/default.frag" || fileName == "assets/indirect.vert" || fileName == "assets/lighting.glsl");
+	}
+
+	// Changes to assets that were busy loading last time round are tried again
+	changed.insert(changed.end(), mDeferredChanges.begin(), mDeferredChanges.end());
+	mDeferredChanges.clear();
+	if (changed.empty())
+	{
+		return;
+	}
+
+	// A shader that fails to build leaves the old one in use, so a typo can be fixed without
+	// restarting
+	if (shadersChanged)
+	{
+		ShaderProgram* shader = new ShaderProgram();
+		try {
+			initDefaultShader(*shader);
+			delete defaultShader;
+			defaultShader = shader;
+		}
+		catch (const runtime_error& error) {
+			cerr << "Error in shader processing, keeping the old shaders!" << endl;
+			cerr << error.what() << endl;
+			delete shader;
+			defaultShader->use();
+		}
+
+		// The indirect shader shares default.frag and lighting.glsl, so it is rebuilt on any change too
+		if (mIndirectRenderer != nullptr)
+		{
+			ShaderProgram* shader = new ShaderProgram();
+			Uniform<GLint> firstDraw;
+			try {
+				initIndirectShader(*shader, firstDraw);
+				delete indirectShader;
+				indirectShader = shader;
+				mFirstDraw = firstDraw;
+			}
+			catch (const runtime_error& error) {
+				cerr << "Error in indirect shader processing, keeping the old shaders!" << endl;
+				cerr << error.what() << endl;
+				delete shader;
+			}
+		}
+	}
+
+	// Reload assets whose OBJ or MTL file changed. Aliases of a changed asset no longer
+	// match it, so they are reloaded too, into meshes of their own. The old mesh stays on
+	// screen until the new one is uploaded. Only uploaded assets have an MTL file to match,
+	// as the mesh of one still loading belongs to the worker loading it.
+	for (const shared_ptr<MeshAsset>& asset : mAssetManager->liveMeshes())
+	{
+		const MeshAsset* holder = asset->resolve();
+		for (const string& fileName : changed)
+		{
+			if (fileName != asset->source && fileName != holder->source && fileName != holder->mtlFile)
+			{
+				continue;
+			}
+			if (asset->isReloading || (!asset->isUploaded && !asset->sameAs))
+			{
+				mDeferredChanges.push_back(fileName); // Might have read the old file
+			}
+			else
+			{
+				asset->isReloading = true;
+				mAssetStreamer->requestReload(asset);
+			}
+			break;
+		}
+	}
+}
+
 void Game::shutdown()
 {
 	// Shutdown
+	// Assets free their GL buffers when the last object using them goes, so that has to
+	// happen while the context still exists
+	delete mAssetStreamer;
+	delete mFileWatcher;
+	mGameWorld.clear();
+	mCurrentTarget = nullptr;
+	delete mAssetManager;
+	delete mUniformBuffer;
+	delete mIndirectRenderer;
+	delete indirectShader;
 	SDL_GL_DeleteContext(context);
 	SDL_Quit();
 }
@@ -419,7 +464,7 @@ void Game::readConfigFile()
 {
 	string line;
 	string key;
-	ifstream ifs(configFile, ifstream::in);
+	AssetStream ifs(configFile);
 
 	while (ifs.good() && !ifs.eof() && getline(ifs, line))
 	{
@@ -480,6 +525,12 @@ void Game::bindKeyboard()
 		view = glm::translate(view, glm::vec3(0.0f, 0.0f, 0.5f));
 	});
 	commandHandler["zoomIn"] = zoomIn;
+
+	KeyHandler *toggleIndirect = new KeyHandler([this]() {
+		mUseIndirect = !mUseIndirect && mIndirectRenderer != nullptr;
+		cout << (mUseIndirect ? "Drawing with multi-draw indirect" : "Drawing objects one by one") << endl;
+	});
+	commandHandler["toggleIndirect"] = toggleIndirect;
 }
 
 void Game::update(SDL_Keycode aKey)
@@ -496,52 +547,146 @@ void Game::update(SDL_Keycode aKey)
 	}
 }
 
+// Object model transform, and how to undo position quantisation and whether normals need
+// unfolding
+static ObjectBlock objectBlock(GameObject& object)
+{
+	const Mesh& mesh = object.getMesh();
+	ObjectBlock block;
+	block.M = object.getModelTransform();
+	block.positionScale = mesh.positionScale;
+	block.padding = 0.0f;
+	block.positionOffset = mesh.positionOffset;
+	block.octahedralNormals = mesh.normalFormat == NormalFormat::Octahedral;
+	return block;
+}
+
+static MaterialBlock materialBlock(const Material& material)
+{
+	MaterialBlock block;
+	block.ambientReflectivity = material.ambientReflectivity;
+	block.diffuseReflectivity = material.diffuseReflectivity;
+	block.specularReflectivity = material.specularRelectivity;
+	block.shininess = material.shininess;
+	block.padding[0] = block.padding[1] = block.padding[2] = 0.0f;
+	return block;
+}
+
 void Game::render()
 {
 	// Display model
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
-	// Associate view matrix with shader uniform V
-	glUniformMatrix4fv(defaultShader->uniform("V"), 1, GL_FALSE, glm::value_ptr(view));
-	// Associate projection matrix with shader uniform P
-	glUniformMatrix4fv(defaultShader->uniform("P"), 1, GL_FALSE, glm::value_ptr(projection));
+	// Every uniform the shader reads is in a block, and every block drawn this frame goes
+	// into mUniformBuffer first: the frame's camera and light, then each visible object and
+	// each material it uses, once however many submeshes share it. The buffer is sent in
+	// one go, after which each draw only binds ranges of it.
+	mUniformBuffer->clear();
+
+	FrameBlock frame;
+	frame.V = view;
+	frame.P = projection;
+	frame.lightPosition = theLight.position;
+	frame.lightAmbient = theLight.ambientColour;
+	frame.lightDiffuse = theLight.diffuseColour;
+	frame.lightSpecular = theLight.specularColour;
+	GLintptr frameOffset = mUniformBuffer->add(frame);
+
+	// With multi-draw indirect only the frame block comes from here, see renderIndirect
+	if (mUseIndirect) {
+		mUniformBuffer->upload();
+		mUniformBuffer->bind<FrameBlock>(FrameBlockBinding, frameOffset);
+		renderIndirect();
+		SDL_GL_SwapWindow(window);
+		return;
+	}
+	defaultShader->use();
+
+	vector<GLintptr> objectOffsets(mGameWorld.size());
+	vector<GLintptr> materialOffsets; // For each submesh drawn, in drawing order
+	map<const Material*, GLintptr> materialsAdded;
+	for (int i = 0; i < mGameWorld.size(); ++i) {
+		if (mGameWorld[i].isVisible()) {
+			const Mesh& mesh = mGameWorld[i].getMesh();
+			objectOffsets[i] = mUniformBuffer->add(objectBlock(mGameWorld[i]));
+
+			for (size_t j = 0; j < mesh.submeshes.size(); ++j) {
+				const Material& material = mGameWorld[i].getMaterial(j);
+				auto added = materialsAdded.find(&material);
+				if (added == materialsAdded.end()) {
+					added = materialsAdded.insert(make_pair(&material, mUniformBuffer->add(materialBlock(material)))).first;
+				}
+				materialOffsets.push_back(added->second);
+			}
+		}
+	}
+
+	mUniformBuffer->upload();
+	mUniformBuffer->bind<FrameBlock>(FrameBlockBinding, frameOffset);
 
+	// Meshes with the same vertex format share the geometry pool's buffers and one vertex
+	// array, which is only bound again when the format changes
+	size_t drawn = 0;
+	GLuint boundVertexArray = 0;
 	for (int i = 0; i < mGameWorld.size(); ++i) {
 		if (mGameWorld[i].isVisible()) {
-			// Need to set up shader attributes and uniforms before rendering object.
-			// Methods of defaultShader object will throw a runtime_error exception if
-			// there is an error detected in the shader processing.
-			// This code should therefore be wrapped in a try..catch block
-
-			// Associate vertex shader inputs with vertex attributes
-
-			glEnableVertexAttribArray(defaultShader->attribute("vPosition"));
-			glBindBuffer(GL_ARRAY_BUFFER, mGameWorld[i].getVertexBufferID());
-			glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, 0);
-
-			glEnableVertexAttribArray(defaultShader->attribute("vNormal"));
-			glBindBuffer(GL_ARRAY_BUFFER, mGameWorld[i].getNormalBufferID());
-			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-
-			// Set up uniforms for materials values for this object
-			glm::vec4 ambientContrib = theLight.ambientColour * mGameWorld[i].getAmbientReflectivity();
-			glm::vec4 diffuseContrib = theLight.diffuseColour * mGameWorld[i].getDiffusiveReflectivity();
-			glm::vec4 specularContrib = theLight.specularColour * mGameWorld[i].getSpecularReflectivity();
-			float shininess = mGameWorld[i].getShininess();
-
-			glUniform4fv(defaultShader->uniform("ambientContrib"), 1, glm::value_ptr(ambientContrib));
-			glUniform4fv(defaultShader->uniform("diffuseContrib"), 1, glm::value_ptr(diffuseContrib));
-			glUniform4fv(defaultShader->uniform("specularContrib"), 1, glm::value_ptr(specularContrib));
-			glUniform4fv(defaultShader->uniform("lightPosition"), 1, glm::value_ptr(theLight.position));
-			glUniform1f(defaultShader->uniform("shininess"), shininess);
-
-			// Object model transform
-			glm::mat4 mt = mGameWorld[i].getModelTransform();
-			glUniformMatrix4fv(defaultShader->uniform("M"), 1, GL_FALSE, glm::value_ptr(mt));
-			mGameWorld[i].render();
+			const Mesh& mesh = mGameWorld[i].getMesh();
+			GLuint vertexArray = mGameWorld[i].getGeometry().vertexArrayID;
+			if (vertexArray != boundVertexArray) {
+				glBindVertexArray(vertexArray);
+				boundVertexArray = vertexArray;
+			}
+			mUniformBuffer->bind<ObjectBlock>(ObjectBlockBinding, objectOffsets[i]);
+
+			// One draw per material. Faces are grouped by material when the mesh is loaded,
+			// so each is a single range of the index buffer.
+			// The level of detail is picked from the object's size on screen, and at full
+			// detail only the meshlets that pass the culler are drawn.
+			size_t lod = mGameWorld[i].selectLod(view, projection, screenHeight);
+			MeshletCuller culler(mGameWorld[i].getModelTransform(), view, projection);
+			for (size_t j = 0; j < mesh.submeshes.size(); ++j) {
+				mUniformBuffer->bind<MaterialBlock>(MaterialBlockBinding, materialOffsets[drawn++]);
+				mGameWorld[i].renderSubmesh(j, lod, &culler, mDrawScratch);
+			}
 		}
 	}
 
 	SDL_GL_SwapWindow(window);
+}
+
+void Game::renderIndirect()
+{
+	// The same objects, levels of detail and meshlets as render() draws, but each draw is
+	// recorded rather than made, and the lot goes to the GPU in one go
+	indirectShader->use();
+	mIndirectRenderer->clear();
+
+	map<const Material*, GLuint> materialsAdded;
+	vector<IndexRange>& ranges = mDrawScratch.ranges;
+	for (int i = 0; i < mGameWorld.size(); ++i) {
+		if (mGameWorld[i].isVisible()) {
+			const Mesh& mesh = mGameWorld[i].getMesh();
+			const GeometrySlice& geometry = mGameWorld[i].getGeometry();
+			GLuint object = mIndirectRenderer->addObject(objectBlock(mGameWorld[i]));
+
+			size_t lod = mGameWorld[i].selectLod(view, projection, screenHeight);
+			MeshletCuller culler(mGameWorld[i].getModelTransform(), view, projection);
+			for (size_t j = 0; j < mesh.submeshes.size(); ++j) {
+				const Material& material = mGameWorld[i].getMaterial(j);
+				auto added = materialsAdded.find(&material);
+				if (added == materialsAdded.end()) {
+					added = materialsAdded.insert(make_pair(&material, mIndirectRenderer->addMaterial(materialBlock(material)))).first;
+				}
+
+				ranges.clear();
+				mGameWorld[i].submeshRanges(j, lod, &culler, ranges);
+				for (const IndexRange& range : ranges) {
+					mIndirectRenderer->addDraw(geometry, mesh.indexType, range, object, added->second);
+				}
+			}
+		}
+	}
+
+	mIndirectRenderer->submit(mFirstDraw);
 }
\ No newline at end of file
@@ -0,0 +1,291 @@
+#include "Header.hpp"
+
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+
+// *********** Geometry pool ***********
+
+// Giving every mesh buffers of its own means binding a different vertex array for every
+// object drawn. Here meshes share big buffers instead, one vertex buffer and one index
+// buffer per vertex format (positions, normals and whether there are texture coordinates),
+// so a frame binds one vertex array per format in use however many objects there are.
+//
+// Vertex space is counted in vertices, so a slice's offset is its base vertex. Index space
+// is counted in bytes, with every slice starting and ending on a multiple of 4: meshes pick
+// their own index type (see Mesh::chooseIndexType) and any of them can be read from there.
+//
+// Each arena starts at initialVertexBytes and initialIndexBytes and doubles as needed.
+// Growing copies the old contents on the GPU with glCopyBufferSubData and points the
+// arena's vertex array at the new buffers, so slices already handed out stay valid.
+//
+// Meshes are written to a staging buffer and copied into their slice on the GPU, see
+// writeRange. Copies go through GL_COPY_WRITE_BUFFER rather than GL_ELEMENT_ARRAY_BUFFER,
+// whose binding belongs to whatever vertex array is bound at the time.
+
+static const size_t initialVertexBytes = 8 << 20;
+static const size_t initialIndexBytes = 4 << 20;
+
+// The arena a mesh's vertices go in
+static int vertexFormat(const Mesh& mesh)
+{
+	return static_cast<int>(mesh.positionFormat) * 8 + static_cast<int>(mesh.normalFormat) * 2 + (mesh.texcoords.empty() ? 0 : 1);
+}
+
+// First fit: take length from the first free range long enough, returning its offset, or
+// SIZE_MAX if there is none
+static size_t takeRange(map<size_t, size_t>& freeRanges, size_t length)
+{
+	for (auto range = freeRanges.begin(); range != freeRanges.end(); ++range)
+	{
+		if (range->second >= length)
+		{
+			size_t offset = range->first;
+			size_t left = range->second - length;
+			freeRanges.erase(range);
+			if (left > 0)
+			{
+				freeRanges[offset + length] = left;
+			}
+			return offset;
+		}
+	}
+	return SIZE_MAX;
+}
+
+// Return a range to the free list, merging it with free neighbours
+static void returnRange(map<size_t, size_t>& freeRanges, size_t offset, size_t length)
+{
+	if (length == 0)
+	{
+		return;
+	}
+	auto next = freeRanges.lower_bound(offset);
+	if (next != freeRanges.end() && offset + length == next->first)
+	{
+		length += next->second;
+		next = freeRanges.erase(next);
+	}
+	if (next != freeRanges.begin())
+	{
+		auto previous = prev(next);
+		if (previous->first + previous->second == offset)
+		{
+			previous->second += length;
+			return;
+		}
+	}
+	freeRanges[offset] = length;
+}
+
+// Immutable storage where there is ARB_buffer_storage, as the pool's buffers are never
+// resized in place anyway, only replaced. They are only ever written by copies, so the
+// CPU needs no access.
+static void createStorage(GLuint& buffer, size_t size)
+{
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	if (GLEW_ARB_buffer_storage)
+	{
+		glBufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, 0);
+	}
+	else
+	{
+		glBufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STATIC_DRAW);
+	}
+}
+
+// Replace a buffer with a bigger one holding the same contents
+static void growBuffer(GLuint& buffer, size_t oldSize, size_t newSize)
+{
+	GLuint grown;
+	createStorage(grown, newSize);
+	if (oldSize > 0)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldSize);
+		glDeleteBuffers(1, &buffer);
+	}
+	buffer = grown;
+}
+
+// Have write() fill size bytes at offset in buffer. Mapping the arena itself would make the
+// driver wait for every draw still reading any part of it, and freed space is handed out
+// again straight away. So write() fills a freshly orphaned staging buffer instead, and
+// glCopyBufferSubData moves the bytes into place on the GPU, queued behind those draws.
+// Unmapping fails if the contents were lost while mapped (on a display mode change, say),
+// in which case they are written again.
+template <typename Write>
+static void writeRange(GLuint staging, GLuint buffer, size_t offset, size_t size, Write write)
+{
+	if (size == 0)
+	{
+		return;
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, staging);
+	for (int attempt = 0; attempt < 2; ++attempt)
+	{
+		glBufferData(GL_COPY_READ_BUFFER, size, nullptr, GL_STREAM_DRAW);
+		void* mapped = glMapBufferRange(GL_COPY_READ_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (mapped == nullptr)
+		{
+			cerr << "Cannot map " << size << " bytes to upload to the geometry pool" << endl;
+			return;
+		}
+		write(static_cast<GLubyte*>(mapped));
+		if (glUnmapBuffer(GL_COPY_READ_BUFFER) == GL_TRUE)
+		{
+			glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, offset, size);
+			return;
+		}
+	}
+	cerr << "Lost the contents of " << size << " bytes of the geometry pool" << endl;
+}
+
+GeometryPool::~GeometryPool()
+{
+	for (auto& entry : mArenas)
+	{
+		Arena& arena = entry.second;
+		glDeleteVertexArrays(1, &arena.vertexArrayID);
+		glDeleteBuffers(1, &arena.vertexBufferID);
+		glDeleteBuffers(1, &arena.elementBufferID);
+	}
+	glDeleteBuffers(1, &mStagingBuffer);
+}
+
+GeometrySlice GeometryPool::allocate(const Mesh& mesh)
+{
+	GeometrySlice slice;
+	slice.format = vertexFormat(mesh);
+	slice.vertexCount = mesh.vertices.size();
+	slice.indexBytes = (mesh.elements.size() * mesh.indexSize() + 3) & ~size_t(3);
+
+	Arena& arena = mArenas[slice.format];
+	if (arena.vertexArrayID == 0)
+	{
+		glGenVertexArrays(1, &arena.vertexArrayID);
+		arena.position = mesh.positionAttribute();
+		arena.normal = mesh.normalAttribute();
+		arena.texcoord = mesh.texcoordAttribute();
+	}
+
+	size_t firstVertex = takeRange(arena.freeVertices, slice.vertexCount);
+	size_t indexOffset = takeRange(arena.freeIndices, slice.indexBytes);
+	if (firstVertex == SIZE_MAX || indexOffset == SIZE_MAX)
+	{
+		// Give back whichever half fitted, so growing can merge it with the new space
+		if (firstVertex != SIZE_MAX)
+		{
+			returnRange(arena.freeVertices, firstVertex, slice.vertexCount);
+		}
+		if (indexOffset != SIZE_MAX)
+		{
+			returnRange(arena.freeIndices, indexOffset, slice.indexBytes);
+		}
+		grow(arena, slice.vertexCount, slice.indexBytes);
+		firstVertex = takeRange(arena.freeVertices, slice.vertexCount);
+		indexOffset = takeRange(arena.freeIndices, slice.indexBytes);
+	}
+
+	slice.vertexArrayID = arena.vertexArrayID;
+	slice.baseVertex = static_cast<GLint>(firstVertex);
+	slice.indexOffset = indexOffset;
+
+	if (mStagingBuffer == 0)
+	{
+		glGenBuffers(1, &mStagingBuffer);
+	}
+	GLsizei stride = arena.position.stride;
+	writeRange(mStagingBuffer, arena.vertexBufferID, firstVertex * stride, slice.vertexCount * stride, [&mesh](GLubyte* out) { mesh.packVertices(out); });
+	writeRange(mStagingBuffer, arena.elementBufferID, indexOffset, mesh.elements.size() * mesh.indexSize(), [&mesh](GLubyte* out) { mesh.packElements(out); });
+	return slice;
+}
+
+void GeometryPool::release(const GeometrySlice& slice)
+{
+	auto found = mArenas.find(slice.format);
+	if (found == mArenas.end() || found->second.vertexArrayID != slice.vertexArrayID)
+	{
+		return;
+	}
+	returnRange(found->second.freeVertices, static_cast<size_t>(slice.baseVertex), slice.vertexCount);
+	returnRange(found->second.freeIndices, slice.indexOffset, slice.indexBytes);
+}
+
+size_t GeometryPool::capacityBytes() const
+{
+	size_t bytes = 0;
+	for (auto& entry : mArenas)
+	{
+		const Arena& arena = entry.second;
+		bytes += arena.vertexCapacity * arena.position.stride + arena.indexCapacity;
+	}
+	return bytes;
+}
+
+void GeometryPool::grow(Arena& arena, size_t vertexCount, size_t indexBytes)
+{
+	// Whatever is free at the end of the arena counts towards the space needed
+	auto freeAtEnd = [](const map<size_t, size_t>& freeRanges, size_t capacity) -> size_t {
+		if (freeRanges.empty())
+		{
+			return 0;
+		}
+		auto last = prev(freeRanges.end());
+		return last->first + last->second == capacity ? last->second : 0;
+	};
+
+	size_t stride = arena.position.stride;
+	size_t vertexCapacity = max(arena.vertexCapacity, initialVertexBytes / stride);
+	while (vertexCapacity - arena.vertexCapacity + freeAtEnd(arena.freeVertices, arena.vertexCapacity) < vertexCount)
+	{
+		vertexCapacity *= 2;
+	}
+	size_t indexCapacity = max(arena.indexCapacity, initialIndexBytes);
+	while (indexCapacity - arena.indexCapacity + freeAtEnd(arena.freeIndices, arena.indexCapacity) < indexBytes)
+	{
+		indexCapacity *= 2;
+	}
+
+	if (vertexCapacity > arena.vertexCapacity)
+	{
+		growBuffer(arena.vertexBufferID, arena.vertexCapacity * stride, vertexCapacity * stride);
+		returnRange(arena.freeVertices, arena.vertexCapacity, vertexCapacity - arena.vertexCapacity);
+		arena.vertexCapacity = vertexCapacity;
+	}
+	if (indexCapacity > arena.indexCapacity)
+	{
+		growBuffer(arena.elementBufferID, arena.indexCapacity, indexCapacity);
+		returnRange(arena.freeIndices, arena.indexCapacity, indexCapacity - arena.indexCapacity);
+		arena.indexCapacity = indexCapacity;
+	}
+	bindAttributes(arena);
+}
+
+// Record an attribute in the bound vertex array. One the format doesn't have is disabled,
+// so the shader reads a constant instead.
+static void setAttribute(GLuint location, const VertexAttribute& attribute)
+{
+	if (attribute.size == 0)
+	{
+		glDisableVertexAttribArray(location);
+		return;
+	}
+	glEnableVertexAttribArray(location);
+	glVertexAttribPointer(location, attribute.size, attribute.type, attribute.normalized, attribute.stride,
+		reinterpret_cast<const GLvoid*>(static_cast<size_t>(attribute.offset)));
+}
+
+void GeometryPool::bindAttributes(const Arena& arena)
+{
+	glBindVertexArray(arena.vertexArrayID);
+	glBindBuffer(GL_ARRAY_BUFFER, arena.vertexBufferID);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.elementBufferID);
+	setAttribute(PositionAttributeLocation, arena.position);
+	setAttribute(NormalAttributeLocation, arena.normal);
+	setAttribute(TexcoordAttributeLocation, arena.texcoord);
+	glBindVertexArray(0);
+}
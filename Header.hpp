@@ -20,24 +20,18 @@
 #include <map>
 
 #include <functional>
-
+#include <memory>
+#include <cstdint>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "Mesh.hpp"
 #include "Shader.hpp"
+#include "UniformBuffer.hpp"
 
-struct Material {
-	glm::vec4 ambientReflectivity;
-	glm::vec4 diffuseReflectivity;
-	glm::vec4 specularRelectivity;
-	float shininess;
-};
-
-struct Mesh {
-	void load(std::string meshSource);
-	std::vector<glm::vec4> vertices;
-	std::vector<glm::vec3> normals;
-	std::vector<glm::vec2> texcoords;
-	std::vector<GLushort> elements;
-	Material material;
-};
+class FileWatcher;
 
 struct Light {
 	glm::vec4 position;
@@ -46,55 +40,362 @@ struct Light {
 	glm::vec4 specularColour;
 };
 
+// The uniform blocks of the default shader, laid out as std140 places them (see
+// assets/default.vert), and the binding points they are read from. Frame is written once a
+// frame, Material once for each material drawn and Object once for each object.
+const GLuint FrameBlockBinding = 0;
+const GLuint MaterialBlockBinding = 1;
+const GLuint ObjectBlockBinding = 2;
+
+struct FrameBlock {
+	glm::mat4 V;
+	glm::mat4 P;
+	glm::vec4 lightPosition;
+	glm::vec4 lightAmbient;
+	glm::vec4 lightDiffuse;
+	glm::vec4 lightSpecular;
+};
+
+struct MaterialBlock {
+	glm::vec4 ambientReflectivity;
+	glm::vec4 diffuseReflectivity;
+	glm::vec4 specularReflectivity;
+	GLfloat shininess;
+	GLfloat padding[3];
+};
+
+struct ObjectBlock {
+	glm::mat4 M;
+	glm::vec3 positionScale;
+	GLfloat padding;
+	glm::vec3 positionOffset;
+	GLint octahedralNormals; // Packs into the end of positionOffset's 16 bytes
+};
+
+static_assert(sizeof(FrameBlock) == 192, "FrameBlock must match the std140 layout of Frame");
+static_assert(sizeof(MaterialBlock) == 64, "MaterialBlock must match the std140 layout of Material");
+static_assert(sizeof(ObjectBlock) == 96, "ObjectBlock must match the std140 layout of Object");
+
+// Where a mesh's vertices and indices are in a GeometryPool. Indices are stored relative to
+// the mesh's first vertex, so draws pass baseVertex to glDrawElementsBaseVertex and add
+// indexOffset to the offsets of their index ranges.
+struct GeometrySlice {
+	GLuint vertexArrayID = 0; // Shared by every mesh with the same vertex format
+	GLint baseVertex = 0;
+	size_t vertexCount = 0;
+	size_t indexOffset = 0;   // In bytes, a multiple of 4 so it suits any index type
+	size_t indexBytes = 0;
+	int format = 0;           // Which of the pool's arenas the slice is in
+};
+
+// A few large vertex and index buffers that every mesh is sub-allocated from: one pair per
+// vertex format, each pair with one vertex array over it. Meshes with the same format are
+// drawn one after another without binding anything in between. Space is handed out first
+// fit from a free list, and freed ranges are merged with their neighbours; an arena that
+// runs out grows by copying into buffers twice the size. Implemented in GeometryPool.cpp.
+// Main thread only, as it uses OpenGL.
+class GeometryPool {
+public:
+	GeometryPool() {}
+	~GeometryPool();
+	GeometryPool(const GeometryPool&) = delete;
+	GeometryPool& operator=(const GeometryPool&) = delete;
+
+	// Copy the vertices and indices of a mesh into the pool, in their GPU formats. Needs the
+	// CPU copy of the mesh, so it has to happen before releaseCpuData.
+	GeometrySlice allocate(const Mesh& mesh);
+	// Give a slice's space back. Draws already issued from it still read the old contents,
+	// as whatever is written to the space next is copied in on the GPU after them.
+	void release(const GeometrySlice& slice);
+
+	size_t arenaCount() const { return mArenas.size(); }
+	size_t capacityBytes() const; // GPU memory held, used or not
+
+private:
+	struct Arena {
+		GLuint vertexArrayID = 0, vertexBufferID = 0, elementBufferID = 0;
+		VertexAttribute position, normal, texcoord;
+		size_t vertexCapacity = 0; // In vertices
+		size_t indexCapacity = 0;  // In bytes
+		std::map<size_t, size_t> freeVertices, freeIndices; // Offset to length of each free range
+	};
+
+	void grow(Arena& arena, size_t vertexCount, size_t indexBytes);
+	void bindAttributes(const Arena& arena);
+
+	std::map<int, Arena> mArenas; // By vertex format
+	GLuint mStagingBuffer = 0; // What allocate() writes meshes to before they are copied into an arena
+};
+
+// Submits a whole scene with glMultiDrawElementsIndirect: one call per vertex array and
+// index type, rather than one draw per submesh with uniforms set in between. Each draw
+// names an object and a material, which the vertex shader (assets/indirect.vert) looks up
+// in storage buffers using gl_DrawIDARB. Implemented in IndirectRenderer.cpp.
+const GLuint ObjectStorageBinding = 0;
+const GLuint MaterialStorageBinding = 1;
+const GLuint DrawStorageBinding = 2;
+
+class IndirectRenderer {
+public:
+	// Needs OpenGL 4.3 for indirect multi-draws and storage buffers, and
+	// ARB_shader_draw_parameters for gl_DrawIDARB
+	static bool isSupported();
+
+	IndirectRenderer(); // Needs a current GL context
+	~IndirectRenderer();
+	IndirectRenderer(const IndirectRenderer&) = delete;
+	IndirectRenderer& operator=(const IndirectRenderer&) = delete;
+
+	// Start a new frame
+	void clear();
+	// Returns the index draws refer to the object or material by
+	GLuint addObject(const ObjectBlock& object);
+	GLuint addMaterial(const MaterialBlock& material);
+	// A range of a mesh's indices in the geometry pool, as for glDrawElementsBaseVertex.
+	// range is in elements of the mesh, from the start of its slice.
+	void addDraw(const GeometrySlice& geometry, GLenum indexType, const IndexRange& range, GLuint object, GLuint material);
+
+	// Upload everything added since clear() and draw it. firstDraw is the shader's uniform
+	// for where a call's draws start in the draw buffer, as gl_DrawIDARB counts from 0 in
+	// every call.
+	void submit(const Uniform<GLint>& firstDraw);
+
+	size_t drawCount() const { return mDrawCount; }
+	size_t callCount() const { return mCallCount; } // Multi-draws made by the last submit()
+
+private:
+	// Laid out as glMultiDrawElementsIndirect reads it
+	struct DrawElementsIndirectCommand {
+		GLuint count;
+		GLuint instanceCount;
+		GLuint firstIndex;
+		GLint baseVertex;
+		GLuint baseInstance;
+	};
+
+	// An object and a material index, a uvec2 in the shader
+	struct DrawRecord {
+		GLuint object;
+		GLuint material;
+	};
+
+	// Draws sharing a vertex array and index type, which go in one call
+	struct Batch {
+		std::vector<DrawElementsIndirectCommand> commands;
+		std::vector<DrawRecord> records;
+	};
+
+	std::vector<ObjectBlock> mObjects;
+	std::vector<MaterialBlock> mMaterials;
+	std::map<std::pair<GLuint, GLenum>, Batch> mBatches; // By vertex array and index type
+	size_t mDrawCount;
+	size_t mCallCount;
+
+	GLuint mCommandBuffer, mObjectBuffer, mMaterialBuffer, mDrawBuffer;
+	std::vector<DrawElementsIndirectCommand> mCommands; // Every batch's commands end to end, reused between frames
+	std::vector<DrawRecord> mRecords;
+};
+
+// A mesh and its slice of the GeometryPool, shared by every GameObject drawing it. Handed
+// out by AssetManager, and freed (slice included) when the last shared_ptr to it goes.
+struct MeshAsset {
+	MeshAsset(std::string meshSource, MeshOptions options, GeometryPool& pool)
+		: source(meshSource), options(options), pool(pool) {}
+	~MeshAsset();
+	MeshAsset(const MeshAsset&) = delete;
+	MeshAsset& operator=(const MeshAsset&) = delete;
+
+	std::string source;
+	MeshOptions options;
+	uint64_t contentHash = 0; // Of the OBJ file, set by AssetManager::loadMesh
+
+	// If another asset was found to have the same file contents, this asset is left
+	// empty and points at that one instead. sameAs is read every frame without a lock, so
+	// the loader, on whatever thread, only records the original in copyOf, and the main
+	// thread moves it across with publishCopy() once it has the asset back from the loader.
+	std::shared_ptr<MeshAsset> sameAs;
+	std::shared_ptr<MeshAsset> copyOf;
+
+	Mesh mesh;
+	GeometryPool& pool;
+	GeometrySlice geometry; // Set once isUploaded
+	bool isUploaded = false;
+	// mesh.mtlFile, copied by upload(). The main thread reads this rather than mesh, which a
+	// worker may still be filling in.
+	std::string mtlFile;
+
+	// Hot reloading, see Game::reloadChangedAssets. A worker parses the changed file into
+	// reloaded while mesh is still being drawn, and applyReload() swaps it in between frames.
+	std::unique_ptr<Mesh> reloaded;
+	bool isReloading = false;
+
+	// The asset actually holding the mesh, following sameAs
+	MeshAsset* resolve() { return sameAs ? sameAs->resolve() : this; }
+	void publishCopy() { if (copyOf) sameAs = std::move(copyOf); }
+	// Copies the mesh into the pool, then frees whatever of the CPU copy options.retention
+	// doesn't keep. Returns the number of bytes uploaded.
+	size_t upload();
+	size_t applyReload(); // Replaces mesh with reloaded and uploads it, giving back the old slice
+};
+
+// Hands out shared MeshAssets, so that N objects using one mesh cost one parse, one CPU
+// copy and one slice of the geometry pool, which the manager owns. Assets are found first
+// by file name and options, and failing that, once loaded, by a hash of the file contents,
+// which catches copies of the same file under different names. Implemented in
+// AssetManager.cpp.
+class AssetManager {
+public:
+	// Returns the asset for meshSource, creating it if needed. isNew is set when the caller
+	// got a new asset, which still has to be loaded with loadMesh().
+	std::shared_ptr<MeshAsset> acquireMesh(std::string meshSource, MeshOptions options, bool& isNew);
+
+	// Loads the mesh of an asset returned by acquireMesh(), unless the same contents are
+	// already loaded, in which case the asset becomes an alias (see MeshAsset::sameAs) once
+	// the main thread calls publishCopy(). Doesn't touch OpenGL, so it can run on any thread.
+	void loadMesh(const std::shared_ptr<MeshAsset>& asset);
+
+	// Parses an asset's file again into MeshAsset::reloaded, after the file has changed.
+	// The result is never an alias, even if the asset was one. Can run on any thread.
+	void reloadMesh(const std::shared_ptr<MeshAsset>& asset);
+
+	size_t liveMeshCount();
+	std::vector<std::shared_ptr<MeshAsset>> liveMeshes(); // Aliases included
+
+	GeometryPool& geometry() { return mGeometry; }
+
+private:
+	void pruneExpired();
+
+	GeometryPool mGeometry; // Only touched by MeshAsset::upload and the destructor, on the main thread
+
+	std::mutex mMutex;
+	std::map<std::string, std::weak_ptr<MeshAsset>> mByName;
+	std::map<std::pair<uint64_t, uint64_t>, std::weak_ptr<MeshAsset>> mByContent;
+};
+
+// Working space for GameObject::renderSubmesh. Game keeps one and passes it to every draw,
+// so once the vectors have grown to the most ranges a submesh needs, drawing allocates
+// nothing.
+struct DrawScratch {
+	std::vector<IndexRange> ranges;
+	std::vector<GLsizei> counts;
+	std::vector<const GLvoid*> offsets;
+	std::vector<GLint> baseVertices;
+};
+
 class GameObject {
 public:
 	GameObject(std::string name, std::string meshSource)
-		: mName(name), mMeshSource(meshSource), mIsVisible(true) {};
+		: mName(name), mMeshSource(meshSource), mIsVisible(true), mHasMaterial(false), mMaterial(), mLod(0) {};
 
 	void setMeshSource(std::string meshSource) { mMeshSource = meshSource; }
-	void loadObject();
-	void render();
-	bool isVisible() { return mIsVisible; }
-
+	std::string getMeshSource() { return mMeshSource; }
+	void setMeshOptions(MeshOptions options) { mMeshOptions = options; }
+	MeshOptions getMeshOptions() { return mMeshOptions; }
+
+	// The mesh is shared with other objects using the same file, see AssetManager. Game
+	// hands the asset to its AssetStreamer, and the object stays invisible until the asset
+	// has been uploaded.
+	void setMeshAsset(std::shared_ptr<MeshAsset> asset) { mMeshAsset = asset; }
+	MeshAsset* getMeshAsset() { return mMeshAsset ? mMeshAsset->resolve() : nullptr; }
+	const Mesh& getMesh() { return getMeshAsset()->mesh; }
+	// With a culler, the full detail level only draws the meshlets it passes. scratch is
+	// reused from draw to draw, see DrawScratch.
+	void renderSubmesh(size_t submesh, size_t lod, const MeshletCuller* culler, DrawScratch& scratch);
+	// The ranges of the mesh's elements renderSubmesh draws, appended to ranges
+	void submeshRanges(size_t submesh, size_t lod, const MeshletCuller* culler, std::vector<IndexRange>& ranges);
+
+	// Choose the level of detail to draw this frame from how big the object is on screen
+	size_t selectLod(const glm::mat4& view, const glm::mat4& projection, int screenHeight);
+
+	// Objects are not drawn until their buffers have been uploaded
+	bool isVisible() { return mIsVisible && mMeshAsset && getMeshAsset()->isUploaded; }
+
+	// A material set on the object replaces all of its mesh's materials, so objects sharing
+	// a mesh can look different. Until one is set the object uses the materials from the
+	// mesh's MTL file, and the getters below report the first of them.
 	void setMaterial(glm::vec4 ambient, glm::vec4 diffuse, glm::vec4 specular, float shininess)
 	{
-		mMesh.material.ambientReflectivity = ambient;
-		mMesh.material.diffuseReflectivity = diffuse;
-		mMesh.material.specularRelectivity = specular;
-		mMesh.material.shininess = shininess;
+		mHasMaterial = true;
+		mMaterial.ambientReflectivity = ambient;
+		mMaterial.diffuseReflectivity = diffuse;
+		mMaterial.specularRelectivity = specular;
+		mMaterial.shininess = shininess;
 	}
 
-	void setAmbientReflectivity(glm::vec4 ambientReflectivity) { mMesh.material.ambientReflectivity = ambientReflectivity; }
-	glm::vec4 getAmbientReflectivity() { return mMesh.material.ambientReflectivity; }
-	void setdiffusiveReflectivity(glm::vec4 diffusiveReflectivity) { mMesh.material.diffuseReflectivity = diffusiveReflectivity; }
-	glm::vec4 getDiffusiveReflectivity() { return mMesh.material.diffuseReflectivity; }
-	void setspecularReflectivity(glm::vec4 specularReflectivity) { mMesh.material.specularRelectivity = specularReflectivity; }
-	glm::vec4 getSpecularReflectivity() { return mMesh.material.specularRelectivity; }
-	void setShininess(float shininess) { mMesh.material.shininess = shininess; }
-	float getShininess() { return mMesh.material.shininess; }
+	void setAmbientReflectivity(glm::vec4 ambientReflectivity) { editMaterial().ambientReflectivity = ambientReflectivity; }
+	glm::vec4 getAmbientReflectivity() { return getMaterial().ambientReflectivity; }
+	void setdiffusiveReflectivity(glm::vec4 diffusiveReflectivity) { editMaterial().diffuseReflectivity = diffusiveReflectivity; }
+	glm::vec4 getDiffusiveReflectivity() { return getMaterial().diffuseReflectivity; }
+	void setspecularReflectivity(glm::vec4 specularReflectivity) { editMaterial().specularRelectivity = specularReflectivity; }
+	glm::vec4 getSpecularReflectivity() { return getMaterial().specularRelectivity; }
+	void setShininess(float shininess) { editMaterial().shininess = shininess; }
+	float getShininess() { return getMaterial().shininess; }
 
-	void setBuffers(GLuint vertexBufferID, GLuint normalBufferID, GLuint elementBufferID)
+	const Material& getMaterial(size_t submesh = 0)
 	{
-		mVertexBufferID = vertexBufferID; mNormalBufferID = normalBufferID; mElementBufferID = elementBufferID;
+		bool meshMaterial = !mHasMaterial && mMeshAsset && getMeshAsset()->isUploaded && submesh < getMesh().submeshes.size();
+		return meshMaterial ? getMesh().submeshes[submesh].material : mMaterial;
 	}
 
 	glm::mat4 getModelTransform() { return mModelTransform; }
 	void setModelTransform(glm::mat4 tm) { mModelTransform = tm; }
 
-	GLuint getVertexBufferID() { return mVertexBufferID; }
-	GLuint getNormalBufferID() { return mNormalBufferID; }
-	GLuint getElementBufferID() { return mElementBufferID; }
+	const GeometrySlice& getGeometry() { return getMeshAsset()->geometry; }
 
 	void move(glm::vec3 d);
 private:
+	// Start from whatever material the object currently shows
+	Material& editMaterial()
+	{
+		mMaterial = getMaterial();
+		mHasMaterial = true;
+		return mMaterial;
+	}
+
 	std::string mName;
 	bool mIsVisible;
+	bool mHasMaterial;
 	std::string mMeshSource;
+	MeshOptions mMeshOptions;
 
 	glm::mat4 mModelTransform;
 
-	Mesh mMesh;
-	GLuint mVertexBufferID, mNormalBufferID, mElementBufferID;
+	std::shared_ptr<MeshAsset> mMeshAsset;
+	Material mMaterial;
+	size_t mLod; // Level of detail drawn last frame
+};
+
+// Loads meshes on background threads. Requests are served in order by a small pool of
+// worker threads, and finished assets wait in a queue until the main thread collects them
+// with poll() and uploads them. Implemented in AssetStreamer.cpp.
+class AssetStreamer {
+public:
+	// 0 threads picks a count from the core count
+	explicit AssetStreamer(AssetManager& assets, unsigned threadCount = 0);
+	~AssetStreamer(); // Waits for any mesh being loaded, and drops the rest of the queue
+
+	void request(std::shared_ptr<MeshAsset> asset);
+	void requestReload(std::shared_ptr<MeshAsset> asset); // Loaded with AssetManager::reloadMesh
+	bool poll(std::shared_ptr<MeshAsset>& asset); // Takes a loaded asset if there is one, never blocks
+	bool idle(); // True once every request has been collected by poll()
+
+private:
+	void worker();
+
+	struct Request {
+		std::shared_ptr<MeshAsset> asset;
+		bool isReload;
+	};
+
+	AssetManager& mAssets;
+	std::vector<std::thread> mWorkers;
+	std::mutex mMutex;
+	std::condition_variable mWakeWorkers;
+	std::deque<Request> mRequests;
+	std::deque<std::shared_ptr<MeshAsset>> mResults;
+	size_t mLoading;
+	bool mStopping;
 };
 
 class KeyHandler {
@@ -121,6 +422,13 @@ protected:
 
 	virtual void update(SDL_Keycode aKey);
 	virtual void render();
+	virtual void renderIndirect(); // The rest of render() when mUseIndirect is set
+	DrawScratch mDrawScratch; // Shared by every draw of render() and renderIndirect()
+
+	// Upload meshes finished by mAssetStreamer, up to mUploadBudget bytes per frame
+	virtual void uploadStreamedAssets();
+	// Start reloading any asset or shader whose file mFileWatcher saw change
+	virtual void reloadChangedAssets();
 
 	virtual void setCurrentTarget(GameObject obj) {
 		mCurrentTarget = &obj;
@@ -135,8 +443,8 @@ protected:
 
 	int screenWidth, screenHeight;
 
-	// Model, view and projection matrix uniform locations
-	GLuint ModelTransformLoc, ViewTransformLoc, ProjectionTransformLoc;
+	// defaultShader's uniforms are all in blocks, filled from here
+	UniformBuffer * mUniformBuffer;
 
 	glm::mat4 view;
 	glm::mat4 projection;
@@ -145,6 +453,22 @@ protected:
 
 	//GLuint shaderProgram;
 	ShaderProgram * defaultShader;
+	virtual void initDefaultShader(ShaderProgram& shader); // Throws runtime_error if the shaders don't build
+
+	// Multi-draw indirect submission, see IndirectRenderer.cpp. Null if the GL doesn't
+	// support it or its shader didn't build, in which case objects are always drawn one by
+	// one; otherwise mUseIndirect switches between the two (the toggleIndirect command).
+	IndirectRenderer * mIndirectRenderer;
+	ShaderProgram * indirectShader;
+	Uniform<GLint> mFirstDraw;
+	bool mUseIndirect;
+	virtual void initIndirectShader(ShaderProgram& shader, Uniform<GLint>& firstDraw); // Throws like initDefaultShader
+
+	AssetManager * mAssetManager;
+	AssetStreamer * mAssetStreamer;
+	size_t mUploadBudget;
+	FileWatcher * mFileWatcher;
+	std::vector<std::string> mDeferredChanges;
 
 
 private:
@@ -0,0 +1,138 @@
+#include "Header.hpp"
+
+using namespace std;
+
+// *********** Indirect renderer ***********
+
+// Drawing object by object costs a draw call, a uniform block bind and the driver's
+// validation for every submesh. Here the CPU only appends records to arrays, and the whole
+// scene goes to the GPU as four buffers and a handful of calls:
+//
+// - the DrawElementsIndirectCommand records glMultiDrawElementsIndirect reads,
+// - one ObjectBlock per object and one MaterialBlock per material, as storage buffers in the
+//   same layouts the uniform blocks use (std430 places these structs as std140 does),
+// - and one record per draw naming its object and material, which the vertex shader reads
+//   at firstDraw + gl_DrawIDARB.
+//
+// A call can only use one vertex array and one index type, so draws are batched by both;
+// with the geometry pool (GeometryPool.cpp) a scene whose meshes share a vertex format and
+// index type is one call whatever the number of objects.
+//
+// The buffers are orphaned and refilled every frame with glBufferData, so writing them
+// never waits for the GPU to finish with last frame's contents.
+
+bool IndirectRenderer::isSupported()
+{
+	return GLEW_VERSION_4_3 && GLEW_ARB_shader_draw_parameters;
+}
+
+IndirectRenderer::IndirectRenderer()
+	: mDrawCount(0), mCallCount(0)
+{
+	glGenBuffers(1, &mCommandBuffer);
+	glGenBuffers(1, &mObjectBuffer);
+	glGenBuffers(1, &mMaterialBuffer);
+	glGenBuffers(1, &mDrawBuffer);
+}
+
+IndirectRenderer::~IndirectRenderer()
+{
+	glDeleteBuffers(1, &mCommandBuffer);
+	glDeleteBuffers(1, &mObjectBuffer);
+	glDeleteBuffers(1, &mMaterialBuffer);
+	glDeleteBuffers(1, &mDrawBuffer);
+}
+
+void IndirectRenderer::clear()
+{
+	mObjects.clear();
+	mMaterials.clear();
+	// Batches keep their vectors' storage, so a steady scene stops allocating after a frame
+	for (auto& batch : mBatches)
+	{
+		batch.second.commands.clear();
+		batch.second.records.clear();
+	}
+	mDrawCount = 0;
+}
+
+GLuint IndirectRenderer::addObject(const ObjectBlock& object)
+{
+	mObjects.push_back(object);
+	return static_cast<GLuint>(mObjects.size() - 1);
+}
+
+GLuint IndirectRenderer::addMaterial(const MaterialBlock& material)
+{
+	mMaterials.push_back(material);
+	return static_cast<GLuint>(mMaterials.size() - 1);
+}
+
+void IndirectRenderer::addDraw(const GeometrySlice& geometry, GLenum indexType, const IndexRange& range, GLuint object, GLuint material)
+{
+	// firstIndex counts indices from the start of the element buffer. Slices start on a
+	// multiple of 4 bytes, so the division is exact for every index type.
+	size_t indexSize = indexType == GL_UNSIGNED_BYTE ? 1 : (indexType == GL_UNSIGNED_SHORT ? 2 : 4);
+	DrawElementsIndirectCommand command;
+	command.count = static_cast<GLuint>(range.indexCount);
+	command.instanceCount = 1;
+	command.firstIndex = static_cast<GLuint>(geometry.indexOffset / indexSize + range.firstIndex);
+	command.baseVertex = geometry.baseVertex;
+	command.baseInstance = 0;
+
+	Batch& batch = mBatches[make_pair(geometry.vertexArrayID, indexType)];
+	batch.commands.push_back(command);
+	batch.records.push_back(DrawRecord{ object, material });
+	++mDrawCount;
+}
+
+// Replace a buffer's contents, orphaning the old storage
+template <typename T>
+static void refill(GLenum target, GLuint buffer, const vector<T>& data)
+{
+	glBindBuffer(target, buffer);
+	glBufferData(target, data.size() * sizeof(T), data.empty() ? nullptr : data.data(), GL_STREAM_DRAW);
+}
+
+void IndirectRenderer::submit(const Uniform<GLint>& firstDraw)
+{
+	// Batches are kept from frame to frame, and there are only as many as the pool has vertex
+	// formats times the index types, so ones with nothing to draw this frame are just skipped
+	mCallCount = 0;
+	if (mDrawCount == 0)
+	{
+		return;
+	}
+
+	mCommands.clear();
+	mRecords.clear();
+	for (auto& batch : mBatches)
+	{
+		mCommands.insert(mCommands.end(), batch.second.commands.begin(), batch.second.commands.end());
+		mRecords.insert(mRecords.end(), batch.second.records.begin(), batch.second.records.end());
+	}
+
+	refill(GL_DRAW_INDIRECT_BUFFER, mCommandBuffer, mCommands);
+	refill(GL_SHADER_STORAGE_BUFFER, mObjectBuffer, mObjects);
+	refill(GL_SHADER_STORAGE_BUFFER, mMaterialBuffer, mMaterials);
+	refill(GL_SHADER_STORAGE_BUFFER, mDrawBuffer, mRecords);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, ObjectStorageBinding, mObjectBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MaterialStorageBinding, mMaterialBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DrawStorageBinding, mDrawBuffer);
+
+	size_t first = 0;
+	for (auto& batch : mBatches)
+	{
+		size_t count = batch.second.commands.size();
+		if (count == 0)
+		{
+			continue;
+		}
+		glBindVertexArray(batch.first.first);
+		firstDraw.set(static_cast<GLint>(first));
+		const GLvoid* offset = reinterpret_cast<const GLvoid*>(first * sizeof(DrawElementsIndirectCommand));
+		glMultiDrawElementsIndirect(GL_TRIANGLES, batch.first.second, offset, static_cast<GLsizei>(count), 0);
+		first += count;
+		++mCallCount;
+	}
+}
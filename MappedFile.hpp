@@ -0,0 +1,156 @@
+#pragma once
+/***
+description: Read-only memory mapping of a whole file. The file contents are exposed
+as a contiguous block of chars via data() and size() so that loaders can tokenize
+them in place without copying the file into std::string / stringstream buffers.
+
+Note that the mapped block is NOT null terminated - anything walking over it must
+use data() + size() as its end marker.
+***/
+
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <Windows.h>
+
+#include <string>
+#include <utility>
+#include <cstdint>
+
+class MappedFile
+{
+public:
+	MappedFile()
+		: mFile(INVALID_HANDLE_VALUE), mMapping(NULL), mData(nullptr), mSize(0) {}
+
+	explicit MappedFile(const std::string& filename)
+		: MappedFile()
+	{
+		open(filename);
+	}
+
+	~MappedFile() { close(); }
+
+	// A mapping owns OS handles so it can be moved but not copied.
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	MappedFile(MappedFile&& other)
+		: MappedFile()
+	{
+		swap(other);
+	}
+
+	MappedFile& operator=(MappedFile&& other)
+	{
+		if (this != &other)
+		{
+			close();
+			swap(other);
+		}
+		return *this;
+	}
+
+	// Map the named file, returns false if the file could not be opened or mapped.
+	// An empty file opens successfully with data() == nullptr and size() == 0.
+	bool open(const std::string& filename)
+	{
+		close();
+
+		// FILE_FLAG_SEQUENTIAL_SCAN lets the OS read ahead aggressively, which is what
+		// every loader in the game does with the mapping.
+		mFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (mFile == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(mFile, &fileSize))
+		{
+			close();
+			return false;
+		}
+		mSize = static_cast<size_t>(fileSize.QuadPart);
+
+		// CreateFileMapping refuses to map a zero length file
+		if (mSize == 0)
+		{
+			return true;
+		}
+
+		mMapping = CreateFileMappingA(mFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mMapping == NULL)
+		{
+			close();
+			return false;
+		}
+
+		mData = static_cast<const char*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+		if (mData == nullptr)
+		{
+			close();
+			return false;
+		}
+
+		return true;
+	}
+
+	void close()
+	{
+		if (mData != nullptr)
+		{
+			UnmapViewOfFile(mData);
+		}
+		if (mMapping != NULL)
+		{
+			CloseHandle(mMapping);
+		}
+		if (mFile != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(mFile);
+		}
+		mFile = INVALID_HANDLE_VALUE;
+		mMapping = NULL;
+		mData = nullptr;
+		mSize = 0;
+	}
+
+	bool isOpen() const { return mFile != INVALID_HANDLE_VALUE; }
+
+	const char* data() const { return mData; }
+	const char* end() const { return mData + mSize; }
+	size_t size() const { return mSize; }
+
+private:
+	void swap(MappedFile& other)
+	{
+		std::swap(mFile, other.mFile);
+		std::swap(mMapping, other.mMapping);
+		std::swap(mData, other.mData);
+		std::swap(mSize, other.mSize);
+	}
+
+	HANDLE mFile;
+	HANDLE mMapping;
+	const char* mData;
+	size_t mSize;
+};
+
+// Size and last write time of a file, both zero if it does not exist. Loaders that cache
+// what they read compare these to tell whether the file has changed since.
+inline void getFileStamp(const std::string& fileName, uint64_t& size, uint64_t& writeTime)
+{
+	size = 0;
+	writeTime = 0;
+
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (fileName != "" && GetFileAttributesExA(fileName.c_str(), GetFileExInfoStandard, &attributes))
+	{
+		size = (static_cast<uint64_t>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+		writeTime = (static_cast<uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+	}
+}
+
+#endif // MAPPED_FILE_HPP
@@ -0,0 +1,376 @@
+#include "Mesh.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+#include "AssetPack.hpp"
+#include "ObjParser.hpp"
+
+using namespace std;
+
+// *********** Mesh ***********
+
+// Seconds since start, restarting the clock from now
+static double lap(chrono::steady_clock::time_point& start)
+{
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	double seconds = chrono::duration<double>(now - start).count();
+	start = now;
+	return seconds;
+}
+
+// Binary glTF files are read by loadGlb, anything else is taken to be OBJ
+static bool isGlbFile(const string& meshSource)
+{
+	string extension = meshSource.substr(min(meshSource.size(), meshSource.find_last_of('.')));
+	transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return static_cast<char>(tolower(c)); });
+	return extension == ".glb";
+}
+
+void Mesh::load(string meshSource, MeshOptions options, uint64_t knownHash)
+{
+	loadTimings = MeshLoadTimings();
+	sourceHash = 0;
+	chrono::steady_clock::time_point loadStart = chrono::steady_clock::now();
+	chrono::steady_clock::time_point phaseStart = loadStart;
+
+	// Vertex formats only affect what is uploaded, so they are not part of the cache
+	positionFormat = options.positionFormat;
+	normalFormat = options.normalFormat;
+
+	// A valid cache holds the finished mesh, normals and materials included
+	if (options.useCache && loadCache(meshSource, options))
+	{
+		elementCount = elements.size();
+		chooseIndexType();
+		computeBounds();
+		loadTimings.cache = lap(phaseStart);
+		loadTimings.total = lap(loadStart);
+		return;
+	}
+	phaseStart = chrono::steady_clock::now();
+
+	// An OBJ file will typically have a MTL (for materials file) associated with it.
+	// If we find one we will store it's location in the following variable then process the MTL file
+	// after the OBJ file.
+	mtlFile = "";
+	vector<ObjUseMtl> useMtl;
+	MaterialLibrary glbMaterials;
+	bool isGlb = isGlbFile(meshSource);
+
+	if (isGlb)
+	{
+		// Times its own read, tokenize and index phases
+		loadGlb(meshSource, useMtl, glbMaterials);
+		phaseStart = chrono::steady_clock::now();
+	}
+	else if (options.parser == MeshParser::Stream)
+	{
+		loadStream(meshSource, mtlFile, useMtl);
+		loadTimings.tokenize = lap(phaseStart);
+	}
+	else
+	{
+		// Times its own read, tokenize and index phases
+		loadMapped(meshSource, mtlFile, useMtl, options.parser == MeshParser::Parallel);
+		phaseStart = chrono::steady_clock::now();
+	}
+
+	// One submesh per material, with the faces of each material made contiguous
+	groupByMaterial(useMtl);
+	loadTimings.index += lap(phaseStart);
+
+	// Only generate normals if the file did not provide them for every vertex
+	if (normals.size() != vertices.size())
+	{
+		computeNormals(options.normalWeighting, options.creaseAngle);
+		loadTimings.normals = lap(phaseStart);
+	}
+	if (isGlb)
+	{
+		applyMaterials(glbMaterials, meshSource);
+	}
+	else
+	{
+		loadMaterials(mtlFile);
+	}
+	loadTimings.materials = lap(phaseStart);
+	buildLods(options.lodCount);
+	loadTimings.lods = lap(phaseStart);
+	if (options.optimise)
+	{
+		optimise();
+		loadTimings.optimise = lap(phaseStart);
+	}
+	// After optimise(), so meshlets follow the cache ordered triangles
+	if (options.buildMeshlets)
+	{
+		buildMeshlets();
+		loadTimings.meshlets = lap(phaseStart);
+	}
+	elementCount = elements.size();
+	chooseIndexType();
+	computeBounds();
+
+	if (options.useCache)
+	{
+		sourceHash = knownHash != 0 ? knownHash : hashAsset(meshSource);
+		saveCache(meshSource, mtlFile, options);
+	}
+	loadTimings.total = lap(loadStart);
+}
+
+void Mesh::releaseCpuData(MeshRetention retention)
+{
+	if (retention == MeshRetention::KeepAll)
+	{
+		return;
+	}
+
+	collision = CollisionMesh();
+	if (retention == MeshRetention::CollisionCopy && !lods.empty())
+	{
+		// The coarsest level, with only the vertices it uses, renumbered in order of first use
+		const GLuint unused = 0xFFFFFFFF;
+		vector<GLuint> remap(vertices.size(), unused);
+		for (const IndexRange& range : lods.back().ranges)
+		{
+			for (size_t i = range.firstIndex; i < range.firstIndex + range.indexCount; ++i)
+			{
+				GLuint& index = remap[elements[i]];
+				if (index == unused)
+				{
+					index = static_cast<GLuint>(collision.positions.size());
+					collision.positions.push_back(glm::vec3(vertices[elements[i]]));
+				}
+				collision.triangles.push_back(index);
+			}
+		}
+		collision.positions.shrink_to_fit();
+		collision.triangles.shrink_to_fit();
+	}
+
+	// Swapping with empty vectors frees the memory, which clear() would keep
+	vector<glm::vec4>().swap(vertices);
+	vector<glm::vec3>().swap(normals);
+	vector<glm::vec2>().swap(texcoords);
+	vector<GLuint>().swap(elements);
+}
+
+void Mesh::chooseIndexType()
+{
+	// Only go as wide as the vertex count needs -- every index is read by the GPU for every
+	// draw, so small meshes save index bandwidth by staying at 8 or 16 bits.
+	if (vertices.size() <= 0x100)
+	{
+		indexType = GL_UNSIGNED_BYTE;
+	}
+	else if (vertices.size() <= 0x10000)
+	{
+		indexType = GL_UNSIGNED_SHORT;
+	}
+	else
+	{
+		indexType = GL_UNSIGNED_INT;
+	}
+}
+
+size_t Mesh::indexSize() const
+{
+	switch (indexType)
+	{
+	case GL_UNSIGNED_BYTE:
+		return sizeof(GLubyte);
+	case GL_UNSIGNED_SHORT:
+		return sizeof(GLushort);
+	default:
+		return sizeof(GLuint);
+	}
+}
+
+// Narrow each element to T, writing them to out
+template <typename T>
+static void narrowElements(const vector<GLuint>& elements, GLubyte* out)
+{
+	T* narrowed = reinterpret_cast<T*>(out);
+	for (size_t i = 0; i < elements.size(); ++i)
+	{
+		narrowed[i] = static_cast<T>(elements[i]);
+	}
+}
+
+void Mesh::packElements(GLubyte* out) const
+{
+	switch (indexType)
+	{
+	case GL_UNSIGNED_BYTE:
+		narrowElements<GLubyte>(elements, out);
+		break;
+	case GL_UNSIGNED_SHORT:
+		narrowElements<GLushort>(elements, out);
+		break;
+	default:
+		memcpy(out, elements.data(), elements.size() * sizeof(GLuint));
+		break;
+	}
+}
+
+void Mesh::loadMapped(string meshSource, string& mtlFile, vector<ObjUseMtl>& useMtl, bool parallel)
+{
+	// The whole file is mapped into memory and tokenized in place by parseObj, which avoids
+	// the per-line string and stringstream allocations made by loadStream. This is the
+	// parser to use for anything bigger than a toy model.
+	chrono::steady_clock::time_point phaseStart = chrono::steady_clock::now();
+	AssetFile in;
+	if (!in.open(meshSource))
+	{
+		cerr << "Cannot open " << meshSource << endl; exit(1);
+	}
+	loadTimings.read = lap(phaseStart);
+
+	ObjData obj;
+	if (parallel)
+	{
+		parseObjParallel(in.data(), in.end(), obj);
+	}
+	else
+	{
+		parseObj(in.data(), in.end(), obj);
+	}
+	loadTimings.tokenize = lap(phaseStart);
+
+	// Build one vertex per distinct position/texcoord/normal combination used by the faces
+	weld(obj);
+	loadTimings.index = lap(phaseStart);
+
+	if (obj.mtlLib != "")
+	{
+		mtlFile = "assets/" + obj.mtlLib;
+		cout << "Found mtllib: " << mtlFile << endl;
+	}
+	useMtl.swap(obj.useMtl);
+}
+
+void Mesh::loadStream(string meshSource, string& mtlFile, vector<ObjUseMtl>& useMtl)
+{
+	AssetStream in(meshSource);
+	if (!in)
+	{
+		cerr << "Cannot open " << meshSource << endl; exit(1);
+	}
+
+	// The processing of the OBJ file given here is not very efficient but for smallish models
+	// it's not too bad, and gets the job done in a easily understandable way.
+	// Also note that there is no error handling -- it is assumed that the OBJ file is well formed
+	// and that all vertex lines contain only three numbers (ie the mesh as been triangulated).
+
+	string line;
+	while (getline(in, line))
+	{   // See: http://www.cplusplus.com/reference/string/string/substr/
+		if (line.substr(0, 2) == "v ") // process vertex lines
+		{
+			istringstream s(line.substr(2));
+			glm::vec4 v;
+			s >> v.x;
+			s >> v.y;
+			s >> v.z;
+			v.w = 1.0f;  // Complete the vec4.
+			vertices.push_back(v);
+		}
+		else if (line.substr(0, 2) == "f ") // process face lines
+		{
+			// The original of this clause assumed that face lines were of the form
+			// f 1 4 9
+			// ie an 'f' followed by 3 integers.
+			// We want to be able to process face lines of the form
+			// f 1//3 4//2 9//3
+			// (which includes normal indices) or
+			// f 1/2/3 4/7/2 9/4/6
+			// (which include texture indices).
+
+			// Approach is to read each group into a separate string and then extract the indices.
+
+			istringstream s(line.substr(2));
+			string s1, s2, s3;
+			s >> s1 >> s2 >> s3;
+
+			// For each of the substrings s1,s2,s3 we need to split '10/2/3' into '10', '2', '3', or '1//37' into '1', '','37' etc
+
+			GLuint a, b, c;
+
+			// The std::string method find returns the position of the first occurence of the string it is searching for (or
+			// the length of the searched string if it cannot find any occurrences).
+			// See: http://www.cplusplus.com/reference/string/string/find/
+			// We can use the find method to split up the strings as follows
+
+			// This code assumes that entries on face lines will be like 1/2/3 or 2//4 -- what happens if entries are not one of these types?
+			int sl1pos = s1.find('/', 0);
+			string i1 = s1.substr(0, sl1pos);
+			int sl2pos = s1.find('/', sl1pos + 1); // Start searching for next slash one position beyond first.
+			string i2 = s1.substr(sl1pos + 1, sl2pos - (sl1pos + 1));
+			string i3 = s1.substr(sl2pos + 1); // Everything from second slash to end of string (this is assumed to be an integer)
+
+											   // Currently we will only make use of the first index found 
+			a = stoi(i1); // See: http://www.cplusplus.com/reference/string/stoi/
+
+						  // The splitting code now needs to be repeated for s2 and s3.
+						  // There is an obvious refactoring to make here -- move this splitting code to a separate function!
+
+			sl1pos = s2.find('/', 0);
+			i1 = s2.substr(0, sl1pos);
+			sl2pos = s2.find('/', sl1pos + 1); // Start searching for next slash one position beyond first.
+			i2 = s2.substr(sl1pos + 1, sl2pos - (sl1pos + 1));
+			i3 = s2.substr(sl2pos + 1); // Everything from second slash to end of string (this is assumed to be an integer)
+
+			b = stoi(i1);
+
+
+			sl1pos = s3.find('/', 0);
+			i1 = s3.substr(0, sl1pos);
+			sl2pos = s3.find('/', sl1pos + 1); // Start searching for next slash one position beyond first.
+			i2 = s3.substr(sl1pos + 1, sl2pos - (sl1pos + 1));
+			i3 = s3.substr(sl2pos + 1); // Everything from second slash to end of string (this is assumed to be an integer)
+
+			c = stoi(i1);
+
+			a--;  // Indices in OBJ files are 1-based, whilst C++ arrays are 0-based.
+			b--;
+			c--;
+			elements.push_back(a);
+			elements.push_back(b);
+			elements.push_back(c);
+		}
+		else if (line[0] == '#') // this is a comment line
+		{
+			/* ignoring this line */
+		}
+		else if (line.substr(0, 3) == "vn ") // will want to process normal lines (those beginning "vn ") at sometime
+		{
+			/* ignoring this line */
+		}
+		else if (line.substr(0, 7) == "mtllib ")
+		{
+			istringstream s(line.substr(7));
+			s >> mtlFile;
+			mtlFile = "assets/" + mtlFile;
+			cout << "Found mtllib: " << mtlFile << endl;
+		}
+		else if (line.substr(0, 7) == "usemtl ")
+		{
+			// Faces from here on use this material, see Mesh::groupByMaterial
+			ObjUseMtl material;
+			istringstream s(line.substr(7));
+			s >> material.name;
+			material.firstCorner = elements.size();
+			useMtl.push_back(material);
+		}
+		else
+		{
+			/* ignoring this line */
+		}
+	}
+}
@@ -0,0 +1,273 @@
+#pragma once
+/***
+description: Meshes as loaded from OBJ and glTF files, with their materials, levels of
+detail and meshlets, and the options controlling how they are built. Nothing here calls
+GL or SDL (GLEW only supplies the types and enum values), so the asset cooker and the
+benchmark build the Mesh code without linking either. Header.hpp adds the GL side:
+uploading meshes, drawing them and streaming them in.
+***/
+
+#ifndef MESH_HPP
+#define MESH_HPP
+
+#include "Libs\glew-2.0.0-win32\glew-2.0.0\include\GL\glew.h"
+#include "Libs\glm-0.9.8.4\glm\glm\glm.hpp"
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <cstdint>
+
+struct ObjData;
+struct ObjUseMtl;
+
+struct Material {
+	glm::vec4 ambientReflectivity;
+	glm::vec4 diffuseReflectivity;
+	glm::vec4 specularRelectivity;
+	float shininess;
+};
+
+// A run of Mesh::elements
+struct IndexRange {
+	size_t firstIndex;
+	size_t indexCount;
+};
+
+// One level of detail of a Mesh: one IndexRange per submesh. The ranges of simplified
+// levels are appended to Mesh::elements after the full mesh, so all levels share one
+// vertex and one index buffer.
+struct MeshLod {
+	float error; // Largest distance any surface moved, in model units
+	std::vector<IndexRange> ranges;
+};
+
+// Materials of a MTL file by name. Parsed MTL files are cached and shared between every
+// mesh using them, see MeshMaterials.cpp.
+typedef std::map<std::string, Material> MaterialLibrary;
+std::shared_ptr<const MaterialLibrary> loadMaterialLibrary(std::string mtlFile);
+Material defaultMaterial(); // Used by faces with no material, or one missing from the library
+
+// A range of Mesh::elements drawn with one material. Faces are grouped by their "usemtl"
+// material when a mesh is loaded, so each material is one contiguous range.
+struct Submesh {
+	std::string materialName; // Empty for faces before any usemtl
+	Material material;
+	size_t firstIndex;
+	size_t indexCount;
+	size_t firstMeshlet = 0; // This submesh's run of Mesh::meshlets
+	size_t meshletCount = 0;
+};
+
+// A cluster of at most meshletMaxVertices vertices and meshletMaxTriangles triangles of
+// the full detail mesh, with bounds for culling it before it is drawn, see MeshMeshlets.cpp.
+// Everything is in model space.
+const size_t meshletMaxVertices = 64;
+const size_t meshletMaxTriangles = 124;
+struct Meshlet {
+	size_t firstIndex;
+	size_t indexCount;
+	glm::vec3 center;
+	float radius;
+	glm::vec3 coneAxis; // Average face normal
+	float coneCutoff;   // Sine of the widest angle between coneAxis and a face normal, 1 if the faces are too spread out to cull
+};
+
+// Split a range of elements into meshlets, appended to meshlets in the order of the triangles
+void buildMeshlets(const std::vector<glm::vec4>& vertices, const std::vector<GLuint>& elements, IndexRange range, std::vector<Meshlet>& meshlets);
+
+// Tests meshlets against the view frustum and their normal cones
+class MeshletCuller {
+public:
+	MeshletCuller(const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection);
+	bool isVisible(const Meshlet& meshlet) const;
+
+private:
+	glm::vec4 mPlanes[6]; // In model space, normalised
+	glm::vec3 mEye;       // Camera position in model space
+};
+
+// OBJ parser used by Mesh::load(). Stream is the original getline/istringstream parser,
+// Mapped memory maps the file and tokenizes it in place, and Parallel does the same
+// on every core for large files (small ones are parsed as for Mapped).
+enum class MeshParser { Stream, Mapped, Parallel };
+
+// How generated normals weight the faces around a vertex, see MeshNormals.cpp
+enum class NormalWeighting { Area, Angle };
+
+// Formats vertex attributes are uploaded in, see MeshQuantise.cpp. Float is 16 bytes per
+// position and 12 per normal; Half and Snorm16 positions are 8 bytes, Int2_10_10_10 and
+// Octahedral normals 4.
+enum class PositionFormat { Float, Half, Snorm16 };
+enum class NormalFormat { Float, Int2_10_10_10, Octahedral };
+
+// What a mesh keeps in CPU memory once its GL buffers are filled, see Mesh::releaseCpuData.
+// KeepAll keeps everything. MetadataOnly keeps just what drawing needs: counts, submesh and
+// LOD ranges, meshlets, bounds and formats. CollisionCopy keeps the metadata and a copy of
+// the coarsest level of detail as positions and triangles.
+enum class MeshRetention { KeepAll, MetadataOnly, CollisionCopy };
+
+// Triangles for collision tests, kept by MeshRetention::CollisionCopy
+struct CollisionMesh {
+	std::vector<glm::vec3> positions;
+	std::vector<GLuint> triangles; // Three indices into positions per triangle
+};
+
+// Arguments for glVertexAttribPointer describing how an attribute is stored in the
+// interleaved vertex buffer: stride is the size of a whole vertex, and offset where the
+// attribute starts within it
+struct VertexAttribute {
+	GLint size;
+	GLenum type;
+	GLboolean normalized;
+	GLsizei stride;
+	GLsizei offset;
+};
+
+// Attribute locations a mesh's vertex array feeds, matching the layout qualifiers of the
+// inputs in assets/default.vert
+const GLuint PositionAttributeLocation = 0;
+const GLuint NormalAttributeLocation = 1;
+const GLuint TexcoordAttributeLocation = 2;
+
+// Seconds spent in each phase of the last Mesh::load(), for the benchmark (Benchmark.cpp).
+// Phases that didn't run are left at 0. The Mapped and Parallel parsers map the file
+// lazily, so read only covers opening it and most of the reading happens as page faults
+// during tokenize; the Stream parser reads as it goes and counts it all as tokenize.
+struct MeshLoadTimings {
+	double cache = 0.0;     // Loading the binary cache, if it was used
+	double read = 0.0;
+	double tokenize = 0.0;
+	double index = 0.0;     // Welding corners into vertices and grouping faces by material
+	double normals = 0.0;
+	double materials = 0.0; // Reading the MTL library
+	double lods = 0.0;
+	double optimise = 0.0;
+	double meshlets = 0.0;
+	double total = 0.0;
+};
+
+// Settings for Mesh::load()
+struct MeshOptions {
+	MeshParser parser = MeshParser::Parallel;
+	// Read the mesh from, and write it to, a binary sidecar next to the OBJ file
+	// (see MeshCache.cpp) so that later runs can skip parsing altogether.
+	bool useCache = true;
+
+	// Used when the OBJ file has no normals of its own. Faces meeting at more than
+	// creaseAngle degrees keep separate normals along their shared edge; at 180 every
+	// vertex is smoothed.
+	NormalWeighting normalWeighting = NormalWeighting::Area;
+	float creaseAngle = 180.0f;
+
+	// Reorder triangles and vertices for the vertex cache, overdraw and vertex fetch
+	// (see MeshOptimise.cpp). Doesn't change how the mesh looks.
+	bool optimise = true;
+
+	// Number of levels of detail, including the full mesh, see MeshLod.cpp. 1 turns LODs off.
+	// Fewer levels may be built if the mesh can't be simplified that far.
+	int lodCount = 4;
+
+	// Split the full detail mesh into meshlets so parts of it facing away from the camera or
+	// off screen can be skipped, see MeshMeshlets.cpp
+	bool buildMeshlets = true;
+
+	// Compact vertex formats for the GPU copy of the mesh. The CPU copy stays in floats.
+	PositionFormat positionFormat = PositionFormat::Float;
+	NormalFormat normalFormat = NormalFormat::Float;
+
+	// What MeshAsset::upload() leaves in memory after filling the GL buffers. Anything but
+	// KeepAll frees the vertices and elements, so it is for meshes nothing else reads.
+	MeshRetention retention = MeshRetention::KeepAll;
+};
+
+struct Mesh {
+	// knownHash is hashAsset(meshSource) if the caller has already worked it out, which saves
+	// hashing the file again when the cache is written
+	void load(std::string meshSource, MeshOptions options = MeshOptions(), uint64_t knownHash = 0);
+	void optimise(); // Implemented in MeshOptimise.cpp, run by load() if MeshOptions::optimise is set
+	std::vector<glm::vec4> vertices;
+	std::vector<glm::vec3> normals;
+	std::vector<glm::vec2> texcoords;
+	std::vector<GLuint> elements;
+	size_t elementCount = 0; // elements.size(), every level of detail included, still set after releaseCpuData
+	std::vector<Submesh> submeshes; // In order of first use in the file, covering the start of elements
+	std::string mtlFile; // MTL library named by the OBJ file, empty if none
+	MeshLoadTimings loadTimings;
+	// hashAsset() of the source file, kept in the cache (see MeshCache.cpp). Set by load()
+	// when it reads or writes the cache, 0 otherwise.
+	uint64_t sourceHash = 0;
+
+	// Simplified versions of the mesh, implemented in MeshLod.cpp. lods[0] is the full mesh
+	// and each level after it has roughly half the triangles of the one before.
+	std::vector<MeshLod> lods;
+	// Level to draw at pixelsPerUnit pixels per model unit, given the level drawn last frame
+	size_t chooseLod(float pixelsPerUnit, size_t current) const;
+
+	// Meshlets of the full detail level, implemented in MeshMeshlets.cpp. Each submesh owns
+	// a run of them, see Submesh::firstMeshlet. Empty if MeshOptions::buildMeshlets is off.
+	std::vector<Meshlet> meshlets;
+
+	// Narrowest index type able to address every vertex (GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT
+	// or GL_UNSIGNED_INT), chosen by load(). The CPU copy of elements is always GLuint, and is
+	// narrowed to this width by packElements() when it is uploaded, which writes
+	// elements.size() * indexSize() bytes to out.
+	GLenum indexType = GL_UNSIGNED_SHORT;
+	size_t indexSize() const;
+	void packElements(GLubyte* out) const;
+
+	// Vertex formats chosen from MeshOptions, implemented in MeshQuantise.cpp. Quantised positions
+	// are stored relative to the bounding box, and the vertex shader recovers model space
+	// positions as position * positionScale + positionOffset.
+	PositionFormat positionFormat = PositionFormat::Float;
+	NormalFormat normalFormat = NormalFormat::Float;
+	glm::vec3 boundsMin, boundsMax;
+	glm::vec3 positionScale, positionOffset;
+	// The GPU copy is one interleaved buffer: per vertex a position, a normal and, if the mesh
+	// has them, texture coordinates, each in its chosen format. These depend on whether
+	// texcoords is empty, so like packVertices they are only right before releaseCpuData.
+	GLsizei vertexStride() const;
+	VertexAttribute positionAttribute() const;
+	VertexAttribute normalAttribute() const;
+	VertexAttribute texcoordAttribute() const; // size 0 if the mesh has no texture coordinates
+	// Write the vertices in their GPU formats to out, normally a mapped GL buffer, which must
+	// have room for vertices.size() * vertexStride() bytes
+	void packVertices(GLubyte* out) const;
+
+	// Frees the vertices, normals, texcoords and elements once they are in GL buffers, keeping
+	// what retention asks for. Only the metadata is left for drawing, so the mesh can't be
+	// uploaded again after this.
+	void releaseCpuData(MeshRetention retention);
+	CollisionMesh collision; // Filled by releaseCpuData for MeshRetention::CollisionCopy
+
+	// Implemented in MeshCache.cpp. restampCache, for the asset cooker (Cooker.cpp), updates
+	// the source file stamps recorded in a cache built with these options, for sources that
+	// were rewritten without changing. It returns false if there is no such cache.
+	static bool restampCache(std::string meshSource, const MeshOptions& options);
+	// The source hash recorded in meshSource's cache, or 0 if there is no cache or the
+	// source has changed since it was written
+	static uint64_t cachedSourceHash(std::string meshSource);
+	static void removeCache(std::string meshSource);
+
+private:
+	void loadStream(std::string meshSource, std::string& mtlFile, std::vector<ObjUseMtl>& useMtl);
+	void loadMapped(std::string meshSource, std::string& mtlFile, std::vector<ObjUseMtl>& useMtl, bool parallel);
+	void weld(const ObjData& obj); // Implemented in MeshWeld.cpp
+	void computeNormals(NormalWeighting weighting, float creaseAngle); // Implemented in MeshNormals.cpp
+	void computeCreasedNormals(NormalWeighting weighting, float creaseAngle);
+	void groupByMaterial(const std::vector<ObjUseMtl>& useMtl);
+	void loadGlb(std::string meshSource, std::vector<ObjUseMtl>& useMtl, MaterialLibrary& materials); // Implemented in MeshGltf.cpp
+	void loadMaterials(std::string mtlFile);
+	void applyMaterials(const MaterialLibrary& library, const std::string& libraryName);
+	void buildLods(int lodCount);
+	void buildMeshlets();
+	void chooseIndexType();
+	void computeBounds();
+
+	// Binary cache, implemented in MeshCache.cpp
+	bool loadCache(std::string meshSource, const MeshOptions& options);
+	void saveCache(std::string meshSource, std::string mtlFile, const MeshOptions& options);
+};
+
+#endif // MESH_HPP
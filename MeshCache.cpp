@@ -0,0 +1,413 @@
+#include "Mesh.hpp"
+
+#include "AssetPack.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+
+using namespace std;
+
+// *********** Mesh cache ***********
+
+// The first time an OBJ file is loaded the finished Mesh (after normal generation and MTL
+// processing) is written to "<obj file>.meshcache". On later loads the cache is memory mapped
+// and copied straight into the Mesh vectors, provided the OBJ and MTL files still have the
+// size and modification time recorded in the header. Otherwise the OBJ is parsed again and
+// the cache rewritten. Caches can also be shipped in the asset pack, where the stamps
+// compared are those the pack recorded for the OBJ and MTL files (see getAssetStamp).
+//
+// The header also records hashAsset() of the OBJ file, which AssetManager uses to spot
+// copies of a file under other names. While the stamps match, cachedSourceHash() hands it
+// back without reading the OBJ file at all.
+//
+// File layout: MeshCacheHeader, then the vertex, normal, texcoord, element, submesh, LOD
+// and meshlet arrays, each starting on a 16 byte boundary. The LODs are stored as one
+// MeshCacheLod per level followed by the level's ranges, one MeshCacheRange per submesh.
+
+// Bump this whenever the layout of the header or of the Mesh arrays changes
+static const uint32_t meshCacheVersion = 8;
+static const char meshCacheMagic[4] = { 'M', 'E', 'S', 'H' };
+
+struct MeshCacheHeader {
+	char magic[4];
+	uint32_t version;
+
+	// Source files the cache was built from
+	uint64_t objSize;
+	uint64_t objWriteTime;
+	uint64_t objHash; // hashAsset of the OBJ file, 0 if it couldn't be read
+	uint64_t mtlSize;
+	uint64_t mtlWriteTime;
+	char mtlFile[260];
+
+	// Fingerprint of the MeshOptions that change the cached data
+	uint64_t optionsKey;
+
+	uint64_t vertexCount;
+	uint64_t normalCount;
+	uint64_t texcoordCount;
+	uint64_t elementCount;
+	uint64_t submeshCount;
+	uint64_t lodCount;
+	uint64_t meshletCount;
+};
+
+struct MeshCacheSubmesh {
+	char materialName[64];
+	Material material;
+	uint64_t firstIndex;
+	uint64_t indexCount;
+	uint64_t firstMeshlet;
+	uint64_t meshletCount;
+};
+
+struct MeshCacheLod {
+	float error;
+	uint32_t padding;
+};
+
+struct MeshCacheRange {
+	uint64_t firstIndex;
+	uint64_t indexCount;
+};
+
+struct MeshCacheMeshlet {
+	uint64_t firstIndex;
+	uint64_t indexCount;
+	glm::vec3 center;
+	float radius;
+	glm::vec3 coneAxis;
+	float coneCutoff;
+};
+
+static string cacheFileName(const string& meshSource)
+{
+	return meshSource + ".meshcache";
+}
+
+// Mixes together every MeshOptions setting that affects the finished mesh, so that loading
+// with different settings rebuilds the cache rather than returning the wrong data.
+static uint64_t optionsKey(const MeshOptions& options)
+{
+	uint64_t key = 14695981039346656037ull; // FNV-1a
+	auto mix = [&key](uint64_t value) {
+		key = (key ^ value) * 1099511628211ull;
+	};
+
+	mix(options.parser == MeshParser::Stream); // The stream parser does not weld vertices
+	mix(static_cast<uint64_t>(options.normalWeighting));
+	uint32_t creaseBits;
+	memcpy(&creaseBits, &options.creaseAngle, sizeof(creaseBits));
+	mix(creaseBits);
+	mix(options.optimise);
+	mix(static_cast<uint64_t>(options.lodCount));
+	mix(options.buildMeshlets);
+	return key;
+}
+
+static uint64_t alignTo16(uint64_t offset)
+{
+	return (offset + 15) & ~static_cast<uint64_t>(15);
+}
+
+// Offsets of the arrays following the header, plus the offset of the end of the file
+struct MeshCacheLayout {
+	uint64_t vertices, normals, texcoords, elements, submeshes, lods, meshlets, end;
+
+	explicit MeshCacheLayout(const MeshCacheHeader& header)
+	{
+		vertices = alignTo16(sizeof(MeshCacheHeader));
+		normals = alignTo16(vertices + header.vertexCount * sizeof(glm::vec4));
+		texcoords = alignTo16(normals + header.normalCount * sizeof(glm::vec3));
+		elements = alignTo16(texcoords + header.texcoordCount * sizeof(glm::vec2));
+		submeshes = alignTo16(elements + header.elementCount * sizeof(GLuint));
+		lods = alignTo16(submeshes + header.submeshCount * sizeof(MeshCacheSubmesh));
+		meshlets = alignTo16(lods + header.lodCount * (sizeof(MeshCacheLod) + header.submeshCount * sizeof(MeshCacheRange)));
+		end = meshlets + header.meshletCount * sizeof(MeshCacheMeshlet);
+	}
+};
+
+bool Mesh::loadCache(string meshSource, const MeshOptions& options)
+{
+	AssetFile cache;
+	if (!cache.open(cacheFileName(meshSource)) || cache.size() < sizeof(MeshCacheHeader))
+	{
+		return false;
+	}
+
+	MeshCacheHeader header;
+	memcpy(&header, cache.data(), sizeof(header));
+	if (memcmp(header.magic, meshCacheMagic, sizeof(header.magic)) != 0 || header.version != meshCacheVersion
+		|| header.optionsKey != optionsKey(options))
+	{
+		return false;
+	}
+
+	// Stale if either source file has changed since the cache was written
+	header.mtlFile[sizeof(header.mtlFile) - 1] = '\0';
+	uint64_t size, writeTime;
+	getAssetStamp(meshSource, size, writeTime);
+	if (size != header.objSize || writeTime != header.objWriteTime)
+	{
+		return false;
+	}
+	getAssetStamp(header.mtlFile, size, writeTime);
+	if (size != header.mtlSize || writeTime != header.mtlWriteTime)
+	{
+		return false;
+	}
+
+	MeshCacheLayout layout(header);
+	if (cache.size() < layout.end)
+	{
+		return false; // Truncated
+	}
+
+	const glm::vec4* cachedVertices = reinterpret_cast<const glm::vec4*>(cache.data() + layout.vertices);
+	const glm::vec3* cachedNormals = reinterpret_cast<const glm::vec3*>(cache.data() + layout.normals);
+	const glm::vec2* cachedTexcoords = reinterpret_cast<const glm::vec2*>(cache.data() + layout.texcoords);
+	const GLuint* cachedElements = reinterpret_cast<const GLuint*>(cache.data() + layout.elements);
+
+	// Check the submeshes before touching the Mesh, so a bad cache leaves it empty for the parser
+	const MeshCacheSubmesh* cachedSubmeshes = reinterpret_cast<const MeshCacheSubmesh*>(cache.data() + layout.submeshes);
+	vector<Submesh> ranges(header.submeshCount);
+	for (size_t i = 0; i < ranges.size(); ++i)
+	{
+		MeshCacheSubmesh cached;
+		memcpy(&cached, &cachedSubmeshes[i], sizeof(cached));
+		if (cached.firstIndex > header.elementCount || cached.indexCount > header.elementCount - cached.firstIndex
+			|| cached.firstMeshlet > header.meshletCount || cached.meshletCount > header.meshletCount - cached.firstMeshlet)
+		{
+			return false; // Corrupt
+		}
+		cached.materialName[sizeof(cached.materialName) - 1] = '\0';
+		ranges[i].materialName = cached.materialName;
+		ranges[i].material = cached.material;
+		ranges[i].firstIndex = static_cast<size_t>(cached.firstIndex);
+		ranges[i].indexCount = static_cast<size_t>(cached.indexCount);
+		ranges[i].firstMeshlet = static_cast<size_t>(cached.firstMeshlet);
+		ranges[i].meshletCount = static_cast<size_t>(cached.meshletCount);
+	}
+
+	const char* cachedLods = cache.data() + layout.lods;
+	vector<MeshLod> levels(header.lodCount);
+	for (MeshLod& lod : levels)
+	{
+		MeshCacheLod cachedLod;
+		memcpy(&cachedLod, cachedLods, sizeof(cachedLod));
+		cachedLods += sizeof(cachedLod);
+		lod.error = cachedLod.error;
+		lod.ranges.resize(header.submeshCount);
+		for (IndexRange& range : lod.ranges)
+		{
+			MeshCacheRange cachedRange;
+			memcpy(&cachedRange, cachedLods, sizeof(cachedRange));
+			cachedLods += sizeof(cachedRange);
+			if (cachedRange.firstIndex > header.elementCount || cachedRange.indexCount > header.elementCount - cachedRange.firstIndex)
+			{
+				return false; // Corrupt
+			}
+			range.firstIndex = static_cast<size_t>(cachedRange.firstIndex);
+			range.indexCount = static_cast<size_t>(cachedRange.indexCount);
+		}
+	}
+
+	const MeshCacheMeshlet* cachedMeshlets = reinterpret_cast<const MeshCacheMeshlet*>(cache.data() + layout.meshlets);
+	vector<Meshlet> clusters(header.meshletCount);
+	for (size_t i = 0; i < clusters.size(); ++i)
+	{
+		MeshCacheMeshlet cached;
+		memcpy(&cached, &cachedMeshlets[i], sizeof(cached));
+		if (cached.firstIndex > header.elementCount || cached.indexCount > header.elementCount - cached.firstIndex)
+		{
+			return false; // Corrupt
+		}
+		clusters[i].firstIndex = static_cast<size_t>(cached.firstIndex);
+		clusters[i].indexCount = static_cast<size_t>(cached.indexCount);
+		clusters[i].center = cached.center;
+		clusters[i].radius = cached.radius;
+		clusters[i].coneAxis = cached.coneAxis;
+		clusters[i].coneCutoff = cached.coneCutoff;
+	}
+
+	vertices.assign(cachedVertices, cachedVertices + header.vertexCount);
+	normals.assign(cachedNormals, cachedNormals + header.normalCount);
+	texcoords.assign(cachedTexcoords, cachedTexcoords + header.texcoordCount);
+	elements.assign(cachedElements, cachedElements + header.elementCount);
+	submeshes.swap(ranges);
+	lods.swap(levels);
+	meshlets.swap(clusters);
+	mtlFile = header.mtlFile;
+	sourceHash = header.objHash;
+
+	cout << "Loaded " << meshSource << " from cache" << endl;
+	return true;
+}
+
+uint64_t Mesh::cachedSourceHash(string meshSource)
+{
+	// Only the header is read, so this costs a page of the cache whatever the mesh's size
+	AssetFile cache;
+	if (!cache.open(cacheFileName(meshSource)) || cache.size() < sizeof(MeshCacheHeader))
+	{
+		return 0;
+	}
+
+	MeshCacheHeader header;
+	memcpy(&header, cache.data(), sizeof(header));
+	if (memcmp(header.magic, meshCacheMagic, sizeof(header.magic)) != 0 || header.version != meshCacheVersion)
+	{
+		return 0;
+	}
+
+	uint64_t size, writeTime;
+	getAssetStamp(meshSource, size, writeTime);
+	return size == header.objSize && writeTime == header.objWriteTime ? header.objHash : 0;
+}
+
+bool Mesh::restampCache(string meshSource, const MeshOptions& options)
+{
+	fstream cache(cacheFileName(meshSource), ios::in | ios::out | ios::binary);
+	MeshCacheHeader header;
+	if (!cache.read(reinterpret_cast<char*>(&header), sizeof(header))
+		|| memcmp(header.magic, meshCacheMagic, sizeof(header.magic)) != 0 || header.version != meshCacheVersion
+		|| header.optionsKey != optionsKey(options))
+	{
+		return false;
+	}
+
+	header.mtlFile[sizeof(header.mtlFile) - 1] = '\0';
+	uint64_t objSize, objWriteTime, mtlSize, mtlWriteTime;
+	getAssetStamp(meshSource, objSize, objWriteTime);
+	getAssetStamp(header.mtlFile, mtlSize, mtlWriteTime);
+	if (objSize == header.objSize && objWriteTime == header.objWriteTime && mtlSize == header.mtlSize && mtlWriteTime == header.mtlWriteTime)
+	{
+		return true;
+	}
+	header.objSize = objSize;
+	header.objWriteTime = objWriteTime;
+	header.mtlSize = mtlSize;
+	header.mtlWriteTime = mtlWriteTime;
+	cache.seekp(0);
+	cache.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	return static_cast<bool>(cache);
+}
+
+void Mesh::removeCache(string meshSource)
+{
+	DeleteFileA(cacheFileName(meshSource).c_str());
+}
+
+void Mesh::saveCache(string meshSource, string mtlFile, const MeshOptions& options)
+{
+	MeshCacheHeader header = MeshCacheHeader();
+	memcpy(header.magic, meshCacheMagic, sizeof(header.magic));
+	header.version = meshCacheVersion;
+	header.optionsKey = optionsKey(options);
+
+	getAssetStamp(meshSource, header.objSize, header.objWriteTime);
+	header.objHash = sourceHash;
+	getAssetStamp(mtlFile, header.mtlSize, header.mtlWriteTime);
+	if (mtlFile.size() >= sizeof(header.mtlFile))
+	{
+		return; // Can't record the dependency, so don't cache
+	}
+	memcpy(header.mtlFile, mtlFile.data(), mtlFile.size()); // Zero filled, so terminated
+
+	header.vertexCount = vertices.size();
+	header.normalCount = normals.size();
+	header.texcoordCount = texcoords.size();
+	header.elementCount = elements.size();
+	header.submeshCount = submeshes.size();
+	header.lodCount = lods.size();
+	header.meshletCount = meshlets.size();
+
+	vector<MeshCacheSubmesh> cacheSubmeshes(submeshes.size(), MeshCacheSubmesh());
+	for (size_t i = 0; i < submeshes.size(); ++i)
+	{
+		if (submeshes[i].materialName.size() >= sizeof(cacheSubmeshes[i].materialName))
+		{
+			return; // Name doesn't fit, so don't cache
+		}
+		memcpy(cacheSubmeshes[i].materialName, submeshes[i].materialName.data(), submeshes[i].materialName.size());
+		cacheSubmeshes[i].material = submeshes[i].material;
+		cacheSubmeshes[i].firstIndex = submeshes[i].firstIndex;
+		cacheSubmeshes[i].indexCount = submeshes[i].indexCount;
+		cacheSubmeshes[i].firstMeshlet = submeshes[i].firstMeshlet;
+		cacheSubmeshes[i].meshletCount = submeshes[i].meshletCount;
+	}
+
+	vector<MeshCacheMeshlet> cacheMeshlets(meshlets.size());
+	for (size_t i = 0; i < meshlets.size(); ++i)
+	{
+		cacheMeshlets[i].firstIndex = meshlets[i].firstIndex;
+		cacheMeshlets[i].indexCount = meshlets[i].indexCount;
+		cacheMeshlets[i].center = meshlets[i].center;
+		cacheMeshlets[i].radius = meshlets[i].radius;
+		cacheMeshlets[i].coneAxis = meshlets[i].coneAxis;
+		cacheMeshlets[i].coneCutoff = meshlets[i].coneCutoff;
+	}
+
+	MeshCacheLayout layout(header);
+
+	// Write to a temporary file and rename it over the old cache, so a crash half way
+	// through never leaves a truncated cache with a valid looking header. The thread id keeps
+	// two AssetStreamer workers loading the same file from writing into each other's file.
+	string fileName = cacheFileName(meshSource);
+	string tempFileName = fileName + "." + to_string(GetCurrentThreadId()) + ".tmp";
+	{
+		ofstream out(tempFileName, ios::out | ios::binary | ios::trunc);
+		if (!out)
+		{
+			cerr << "Cannot write " << tempFileName << endl;
+			return;
+		}
+
+		auto writeAt = [&out](uint64_t offset, const void* data, size_t size) {
+			static const char padding[16] = {};
+			uint64_t position = static_cast<uint64_t>(out.tellp());
+			out.write(padding, offset - position);
+			out.write(static_cast<const char*>(data), size);
+		};
+
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		writeAt(layout.vertices, vertices.data(), vertices.size() * sizeof(glm::vec4));
+		writeAt(layout.normals, normals.data(), normals.size() * sizeof(glm::vec3));
+		writeAt(layout.texcoords, texcoords.data(), texcoords.size() * sizeof(glm::vec2));
+		writeAt(layout.elements, elements.data(), elements.size() * sizeof(GLuint));
+		writeAt(layout.submeshes, cacheSubmeshes.data(), cacheSubmeshes.size() * sizeof(MeshCacheSubmesh));
+
+		vector<char> cacheLods;
+		for (const MeshLod& lod : lods)
+		{
+			MeshCacheLod cachedLod = { lod.error, 0 };
+			cacheLods.insert(cacheLods.end(), reinterpret_cast<const char*>(&cachedLod), reinterpret_cast<const char*>(&cachedLod + 1));
+			for (const IndexRange& range : lod.ranges)
+			{
+				MeshCacheRange cachedRange = { range.firstIndex, range.indexCount };
+				cacheLods.insert(cacheLods.end(), reinterpret_cast<const char*>(&cachedRange), reinterpret_cast<const char*>(&cachedRange + 1));
+			}
+		}
+		writeAt(layout.lods, cacheLods.data(), cacheLods.size());
+		writeAt(layout.meshlets, cacheMeshlets.data(), cacheMeshlets.size() * sizeof(MeshCacheMeshlet));
+
+		if (!out)
+		{
+			cerr << "Failed writing " << tempFileName << endl;
+			out.close();
+			DeleteFileA(tempFileName.c_str());
+			return;
+		}
+	}
+
+	if (!MoveFileExA(tempFileName.c_str(), fileName.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		cerr << "Cannot replace " << fileName << endl;
+		DeleteFileA(tempFileName.c_str());
+		return;
+	}
+	// The new cache is written loose, so it has to win over any copy of the old one in the pack
+	preferLooseAsset(fileName);
+}
@@ -0,0 +1,687 @@
+#include "Mesh.hpp"
+
+#include "AssetPack.hpp"
+#include "ObjParser.hpp"
+
+#include "Libs\glm-0.9.8.4\glm\glm\gtc\matrix_transform.hpp"
+#include "Libs\glm-0.9.8.4\glm\glm\gtc\quaternion.hpp"
+#include "Libs\glm-0.9.8.4\glm\glm\gtc\matrix_inverse.hpp"
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <utility>
+
+using namespace std;
+
+// *********** glTF ***********
+
+// Binary glTF (.glb) files hold a JSON chunk describing the model and a binary chunk with
+// the vertex and index data, already laid out the way GPUs read it. Mesh::load reads them
+// with loadGlb instead of the OBJ parser: the file is mapped, the JSON is parsed (it is
+// small next to the binary chunk), and each primitive's accessors are copied out of the
+// binary chunk in bulk. Tightly packed float normals and 32 bit indices are a single
+// memcpy; other layouts, interleaved ones included, are read with the accessor's stride.
+// Positions are widened to the vec4s Mesh keeps, so they always take a pass.
+//
+// Every triangle primitive of every mesh reachable from the default scene is added, moved
+// by the transforms of the nodes above it. Each glTF material becomes a submesh material,
+// approximated from its base colour, metallic and roughness factors. Textures, skins,
+// morph targets, sparse accessors and external buffers are not supported.
+//
+// See https://registry.khronos.org/glTF/specs/2.0/glTF-2.0.html
+
+// *********** JSON ***********
+
+// A parsed JSON value. Objects keep their members in file order, with the name of each
+// item in names.
+struct JsonValue {
+	enum Type { Null, Boolean, Number, String, Array, Object };
+	Type type = Null;
+	double number = 0.0; // For Boolean, 1 for true
+	string text;
+	vector<JsonValue> items;
+	vector<string> names;
+
+	// Lookups on a missing member, a missing index or the wrong type give a Null value, so
+	// a chain of them never fails part way
+	const JsonValue& operator[](const char* name) const
+	{
+		for (size_t i = 0; type == Object && i < names.size(); ++i)
+		{
+			if (names[i] == name)
+			{
+				return items[i];
+			}
+		}
+		return null();
+	}
+	const JsonValue& item(size_t index) const
+	{
+		return type == Array && index < items.size() ? items[index] : null();
+	}
+	size_t size() const { return type == Array ? items.size() : 0; }
+	bool exists() const { return type != Null; }
+	double asNumber(double fallback) const { return type == Number ? number : fallback; }
+	size_t asIndex(size_t fallback) const { return type == Number && number >= 0.0 ? static_cast<size_t>(number) : fallback; }
+
+	static const JsonValue& null()
+	{
+		static const JsonValue value;
+		return value;
+	}
+};
+
+// Recursive descent parser for the JSON chunk. Returns false on malformed input.
+class JsonParser {
+public:
+	JsonParser(const char* first, const char* last) : mP(first), mLast(last) {}
+
+	bool parse(JsonValue& value)
+	{
+		return parseValue(value, 0) && (skipSpace(), mP == mLast);
+	}
+
+private:
+	// Far deeper than any real glTF file, and shallow enough not to overflow the stack
+	static const int maxDepth = 64;
+
+	void skipSpace()
+	{
+		while (mP < mLast && (*mP == ' ' || *mP == '\t' || *mP == '\r' || *mP == '\n'))
+		{
+			++mP;
+		}
+	}
+
+	bool consume(const char* literal)
+	{
+		size_t length = strlen(literal);
+		if (static_cast<size_t>(mLast - mP) < length || memcmp(mP, literal, length) != 0)
+		{
+			return false;
+		}
+		mP += length;
+		return true;
+	}
+
+	bool parseValue(JsonValue& value, int depth)
+	{
+		skipSpace();
+		if (mP == mLast || depth > maxDepth)
+		{
+			return false;
+		}
+
+		switch (*mP)
+		{
+		case '{':
+			value.type = JsonValue::Object;
+			return parseContainer(value, depth, '}');
+		case '[':
+			value.type = JsonValue::Array;
+			return parseContainer(value, depth, ']');
+		case '"':
+			value.type = JsonValue::String;
+			return parseString(value.text);
+		case 't':
+			value.type = JsonValue::Boolean;
+			value.number = 1.0;
+			return consume("true");
+		case 'f':
+			value.type = JsonValue::Boolean;
+			return consume("false");
+		case 'n':
+			return consume("null");
+		default:
+			return parseNumber(value);
+		}
+	}
+
+	// The members of an object or the items of an array, after the opening bracket
+	bool parseContainer(JsonValue& value, int depth, char close)
+	{
+		++mP;
+		skipSpace();
+		if (mP < mLast && *mP == close)
+		{
+			++mP;
+			return true;
+		}
+		for (;;)
+		{
+			if (close == '}')
+			{
+				string name;
+				skipSpace();
+				if (!parseString(name) || (skipSpace(), !consume(":")))
+				{
+					return false;
+				}
+				value.names.push_back(name);
+			}
+			value.items.push_back(JsonValue());
+			if (!parseValue(value.items.back(), depth + 1))
+			{
+				return false;
+			}
+
+			skipSpace();
+			if (mP == mLast)
+			{
+				return false;
+			}
+			if (*mP++ == close)
+			{
+				return true;
+			}
+			if (mP[-1] != ',')
+			{
+				return false;
+			}
+		}
+	}
+
+	bool parseString(string& text)
+	{
+		if (!consume("\""))
+		{
+			return false;
+		}
+		while (mP < mLast && *mP != '"')
+		{
+			if (*mP != '\\')
+			{
+				text += *mP++;
+				continue;
+			}
+			if (++mP == mLast)
+			{
+				return false;
+			}
+			char escaped = *mP++;
+			switch (escaped)
+			{
+			case 'b': text += '\b'; break;
+			case 'f': text += '\f'; break;
+			case 'n': text += '\n'; break;
+			case 'r': text += '\r'; break;
+			case 't': text += '\t'; break;
+			case 'u':
+			{
+				// Encoded as UTF-8. Surrogate pairs come out as two three byte sequences,
+				// which is fine for the names this is used for.
+				if (mLast - mP < 4)
+				{
+					return false;
+				}
+				char digits[5] = { mP[0], mP[1], mP[2], mP[3], '\0' };
+				char* end;
+				unsigned long code = strtoul(digits, &end, 16);
+				if (end != digits + 4)
+				{
+					return false;
+				}
+				mP += 4;
+				if (code < 0x80)
+				{
+					text += static_cast<char>(code);
+				}
+				else if (code < 0x800)
+				{
+					text += static_cast<char>(0xC0 | (code >> 6));
+					text += static_cast<char>(0x80 | (code & 0x3F));
+				}
+				else
+				{
+					text += static_cast<char>(0xE0 | (code >> 12));
+					text += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+					text += static_cast<char>(0x80 | (code & 0x3F));
+				}
+				break;
+			}
+			default:
+				text += escaped; // '"', '\\' and '/'
+				break;
+			}
+		}
+		return consume("\"");
+	}
+
+	bool parseNumber(JsonValue& value)
+	{
+		// The JSON chunk is held in a string, so strtod always finds the terminating null
+		char* end;
+		value.type = JsonValue::Number;
+		value.number = strtod(mP, &end);
+		if (end == mP || end > mLast)
+		{
+			return false;
+		}
+		mP = end;
+		return true;
+	}
+
+	const char* mP;
+	const char* mLast;
+};
+
+// *********** Accessors ***********
+
+// An accessor resolved to where its elements are in the binary chunk
+struct GlbAccessor {
+	const GLubyte* data = nullptr;
+	size_t count = 0;
+	size_t stride = 0;        // Bytes from one element to the next
+	GLenum componentType = 0;
+	size_t components = 0;    // 1 for SCALAR, 3 for VEC3 and so on
+	bool normalized = false;
+};
+
+static size_t componentSize(GLenum componentType)
+{
+	switch (componentType)
+	{
+	case GL_BYTE:
+	case GL_UNSIGNED_BYTE:
+		return 1;
+	case GL_SHORT:
+	case GL_UNSIGNED_SHORT:
+		return 2;
+	case GL_UNSIGNED_INT:
+	case GL_FLOAT:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static size_t componentCount(const string& type)
+{
+	if (type == "SCALAR") return 1;
+	if (type == "VEC2") return 2;
+	if (type == "VEC3") return 3;
+	if (type == "VEC4") return 4;
+	if (type == "MAT4") return 16;
+	return 0;
+}
+
+// Look up accessor index and check that all of its elements lie inside the binary chunk
+static bool resolveAccessor(const JsonValue& gltf, const JsonValue& index, const GLubyte* bin, size_t binSize, GlbAccessor& out)
+{
+	const JsonValue& accessor = gltf["accessors"].item(index.asIndex(SIZE_MAX));
+	const JsonValue& view = gltf["bufferViews"].item(accessor["bufferView"].asIndex(SIZE_MAX));
+	if (!accessor.exists() || !view.exists() || accessor["sparse"].exists() || view["buffer"].asIndex(0) != 0)
+	{
+		return false;
+	}
+
+	out.componentType = static_cast<GLenum>(accessor["componentType"].asNumber(0));
+	out.components = componentCount(accessor["type"].text);
+	out.count = accessor["count"].asIndex(0);
+	out.normalized = accessor["normalized"].number != 0.0;
+	size_t elementSize = componentSize(out.componentType) * out.components;
+	out.stride = view["byteStride"].asIndex(elementSize);
+
+	size_t viewOffset = view["byteOffset"].asIndex(0);
+	size_t viewLength = view["byteLength"].asIndex(0);
+	size_t offset = accessor["byteOffset"].asIndex(0);
+	if (elementSize == 0 || out.stride < elementSize || viewOffset > binSize || viewLength > binSize - viewOffset)
+	{
+		return false;
+	}
+	if (out.count > 0 && (offset > viewLength || viewLength - offset < elementSize
+		|| (out.count - 1) > (viewLength - offset - elementSize) / out.stride))
+	{
+		return false;
+	}
+	out.data = bin + viewOffset + offset;
+	return true;
+}
+
+// Component c of element i as a float, applying the normalisation rules of the spec
+static float readFloat(const GlbAccessor& accessor, size_t i, size_t c)
+{
+	const GLubyte* p = accessor.data + i * accessor.stride + c * componentSize(accessor.componentType);
+	switch (accessor.componentType)
+	{
+	case GL_FLOAT:
+	{
+		float value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+	case GL_UNSIGNED_BYTE:
+		return accessor.normalized ? *p / 255.0f : *p;
+	case GL_BYTE:
+	{
+		float value = static_cast<GLbyte>(*p);
+		return accessor.normalized ? max(value / 127.0f, -1.0f) : value;
+	}
+	case GL_UNSIGNED_SHORT:
+	{
+		GLushort value;
+		memcpy(&value, p, sizeof(value));
+		return accessor.normalized ? value / 65535.0f : value;
+	}
+	case GL_SHORT:
+	{
+		GLshort value;
+		memcpy(&value, p, sizeof(value));
+		return accessor.normalized ? max(value / 32767.0f, -1.0f) : value;
+	}
+	default:
+		return 0.0f;
+	}
+}
+
+static GLuint readIndex(const GlbAccessor& accessor, size_t i)
+{
+	const GLubyte* p = accessor.data + i * accessor.stride;
+	switch (accessor.componentType)
+	{
+	case GL_UNSIGNED_BYTE:
+		return *p;
+	case GL_UNSIGNED_SHORT:
+	{
+		GLushort index;
+		memcpy(&index, p, sizeof(index));
+		return index;
+	}
+	default:
+	{
+		GLuint index;
+		memcpy(&index, p, sizeof(index));
+		return index;
+	}
+	}
+}
+
+// *********** Scene ***********
+
+static glm::mat4 nodeTransform(const JsonValue& node)
+{
+	const JsonValue& matrix = node["matrix"];
+	if (matrix.size() == 16)
+	{
+		// Column major, as glm
+		glm::mat4 m;
+		for (int i = 0; i < 16; ++i)
+		{
+			m[i / 4][i % 4] = static_cast<float>(matrix.item(i).asNumber(0.0));
+		}
+		return m;
+	}
+
+	const JsonValue& t = node["translation"];
+	const JsonValue& r = node["rotation"];
+	const JsonValue& s = node["scale"];
+	glm::vec3 translation(t.item(0).asNumber(0.0), t.item(1).asNumber(0.0), t.item(2).asNumber(0.0));
+	glm::quat rotation(static_cast<float>(r.item(3).asNumber(1.0)), static_cast<float>(r.item(0).asNumber(0.0)),
+		static_cast<float>(r.item(1).asNumber(0.0)), static_cast<float>(r.item(2).asNumber(0.0)));
+	glm::vec3 scale(s.item(0).asNumber(1.0), s.item(1).asNumber(1.0), s.item(2).asNumber(1.0));
+	return glm::translate(glm::mat4(), translation) * glm::mat4_cast(rotation) * glm::scale(glm::mat4(), scale);
+}
+
+// Collect every (mesh, transform) below node
+static void collectMeshes(const JsonValue& gltf, size_t node, const glm::mat4& parent, int depth, vector<pair<size_t, glm::mat4>>& meshes)
+{
+	// Node graphs must be trees; the depth limit stops a malformed file looping forever
+	const JsonValue& n = gltf["nodes"].item(node);
+	if (!n.exists() || depth > 64)
+	{
+		return;
+	}
+	glm::mat4 transform = parent * nodeTransform(n);
+	if (n["mesh"].exists())
+	{
+		meshes.push_back(make_pair(n["mesh"].asIndex(SIZE_MAX), transform));
+	}
+	for (const JsonValue& child : n["children"].items)
+	{
+		collectMeshes(gltf, child.asIndex(SIZE_MAX), transform, depth + 1, meshes);
+	}
+}
+
+// A glTF metallic-roughness material in the terms of the Phong shader
+static Material convertMaterial(const JsonValue& material)
+{
+	const JsonValue& pbr = material["pbrMetallicRoughness"];
+	const JsonValue& colour = pbr["baseColorFactor"];
+	glm::vec4 base(colour.item(0).asNumber(1.0), colour.item(1).asNumber(1.0), colour.item(2).asNumber(1.0), colour.item(3).asNumber(1.0));
+	float metallic = static_cast<float>(pbr["metallicFactor"].asNumber(1.0));
+	float roughness = static_cast<float>(pbr["roughnessFactor"].asNumber(1.0));
+
+	// Metals tint their highlights with the base colour, other materials reflect about 4%
+	Material converted;
+	converted.ambientReflectivity = glm::vec4(glm::vec3(base) * 0.2f, base.a);
+	converted.diffuseReflectivity = glm::vec4(glm::vec3(base) * (1.0f - metallic), base.a);
+	converted.specularRelectivity = glm::vec4(glm::mix(glm::vec3(0.04f), glm::vec3(base), metallic), base.a);
+	converted.shininess = max(1.0f, (1.0f - roughness) * (1.0f - roughness) * 256.0f);
+	return converted;
+}
+
+// Seconds since start, restarting the clock from now
+static double lap(chrono::steady_clock::time_point& start)
+{
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	double seconds = chrono::duration<double>(now - start).count();
+	start = now;
+	return seconds;
+}
+
+void Mesh::loadGlb(string meshSource, vector<ObjUseMtl>& useMtl, MaterialLibrary& materials)
+{
+	chrono::steady_clock::time_point phaseStart = chrono::steady_clock::now();
+	AssetFile in;
+	if (!in.open(meshSource))
+	{
+		cerr << "Cannot open " << meshSource << endl; exit(1);
+	}
+
+	// A 12 byte header ("glTF", version 2, length), then chunks of a length, a type and
+	// the data. The JSON chunk comes first and the binary chunk, if any, second.
+	const GLubyte* file = reinterpret_cast<const GLubyte*>(in.data());
+	size_t fileSize = in.size();
+	uint32_t header[3] = { 0, 0, 0 };
+	memcpy(header, file, min(fileSize, sizeof(header)));
+	if (header[0] != 0x46546C67 || header[1] != 2)
+	{
+		cerr << meshSource << " is not a glTF 2.0 binary file" << endl;
+		return;
+	}
+
+	string json;
+	const GLubyte* bin = nullptr;
+	size_t binSize = 0;
+	for (size_t offset = 12; offset + 8 <= fileSize;)
+	{
+		uint32_t chunk[2];
+		memcpy(chunk, file + offset, sizeof(chunk));
+		offset += 8;
+		if (chunk[0] > fileSize - offset)
+		{
+			break;
+		}
+		if (chunk[1] == 0x4E4F534A && json.empty()) // "JSON"
+		{
+			json.assign(reinterpret_cast<const char*>(file + offset), chunk[0]);
+		}
+		else if (chunk[1] == 0x004E4942 && bin == nullptr) // "BIN\0"
+		{
+			bin = file + offset;
+			binSize = chunk[0];
+		}
+		offset += (chunk[0] + 3) & ~size_t(3);
+	}
+	loadTimings.read = lap(phaseStart);
+
+	JsonValue gltf;
+	if (!JsonParser(json.data(), json.data() + json.size()).parse(gltf))
+	{
+		cerr << "Cannot parse the JSON in " << meshSource << endl;
+		return;
+	}
+	loadTimings.tokenize = lap(phaseStart);
+
+	// Materials, by name. Unnamed and repeated names are made unique with the index.
+	vector<string> materialNames;
+	for (size_t i = 0; i < gltf["materials"].size(); ++i)
+	{
+		const JsonValue& material = gltf["materials"].item(i);
+		string name = material["name"].text;
+		if (name == "")
+		{
+			name = "material" + to_string(i);
+		}
+		else if (materials.count(name) != 0)
+		{
+			name += " " + to_string(i);
+		}
+		materialNames.push_back(name);
+		materials[name] = convertMaterial(material);
+	}
+
+	// The meshes placed by the default scene, or every mesh as it is if there is no scene
+	vector<pair<size_t, glm::mat4>> placed;
+	const JsonValue& scene = gltf["scenes"].item(gltf["scene"].asIndex(0));
+	for (const JsonValue& root : scene["nodes"].items)
+	{
+		collectMeshes(gltf, root.asIndex(SIZE_MAX), glm::mat4(), 0, placed);
+	}
+	if (!scene.exists())
+	{
+		for (size_t m = 0; m < gltf["meshes"].size(); ++m)
+		{
+			placed.push_back(make_pair(m, glm::mat4()));
+		}
+	}
+
+	// Normals and texcoords are kept only if every primitive has them, as for OBJ files
+	bool allNormals = true;
+	bool anyTexcoords = false;
+	vertices.clear();
+	normals.clear();
+	texcoords.clear();
+	elements.clear();
+	for (auto& instance : placed)
+	{
+		const glm::mat4& transform = instance.second;
+		bool isIdentity = transform == glm::mat4();
+		glm::mat3 normalTransform = glm::inverseTranspose(glm::mat3(transform));
+		// A mirroring transform turns triangles inside out, so their winding is reversed to
+		// keep them front facing, as the glTF spec asks
+		bool isMirrored = glm::determinant(glm::mat3(transform)) < 0.0f;
+
+		for (const JsonValue& primitive : gltf["meshes"].item(instance.first)["primitives"].items)
+		{
+			const JsonValue& attributes = primitive["attributes"];
+			GlbAccessor positions, normalData, texcoordData, indices;
+			if (primitive["mode"].asNumber(GL_TRIANGLES) != GL_TRIANGLES
+				|| !resolveAccessor(gltf, attributes["POSITION"], bin, binSize, positions) || positions.components != 3)
+			{
+				cerr << "Skipping a primitive of " << meshSource << " that isn't a list of triangles" << endl;
+				continue;
+			}
+			bool hasNormals = resolveAccessor(gltf, attributes["NORMAL"], bin, binSize, normalData)
+				&& normalData.components == 3 && normalData.count == positions.count;
+			bool hasTexcoords = resolveAccessor(gltf, attributes["TEXCOORD_0"], bin, binSize, texcoordData)
+				&& texcoordData.components == 2 && texcoordData.count == positions.count;
+			bool hasIndices = primitive["indices"].exists();
+			if (hasIndices && (!resolveAccessor(gltf, primitive["indices"], bin, binSize, indices) || indices.components != 1
+				|| indices.componentType == GL_FLOAT || indices.componentType == GL_BYTE || indices.componentType == GL_SHORT))
+			{
+				cerr << "Skipping a primitive of " << meshSource << " with unreadable indices" << endl;
+				continue;
+			}
+
+			// A primitive without a whole triangle adds nothing, and its vertices nothing could use
+			size_t vertexCount = positions.count;
+			size_t indexCount = hasIndices ? indices.count - indices.count % 3 : vertexCount - vertexCount % 3;
+			if (vertexCount == 0 || indexCount == 0)
+			{
+				continue;
+			}
+
+			size_t baseVertex = vertices.size();
+			allNormals = allNormals && hasNormals;
+			anyTexcoords = anyTexcoords || hasTexcoords;
+
+			vertices.resize(baseVertex + vertexCount);
+			for (size_t i = 0; i < vertexCount; ++i)
+			{
+				glm::vec4 p(readFloat(positions, i, 0), readFloat(positions, i, 1), readFloat(positions, i, 2), 1.0f);
+				vertices[baseVertex + i] = isIdentity ? p : transform * p;
+			}
+
+			normals.resize(baseVertex + vertexCount, glm::vec3(0.0f));
+			if (hasNormals && isIdentity && normalData.componentType == GL_FLOAT && normalData.stride == sizeof(glm::vec3))
+			{
+				memcpy(&normals[baseVertex], normalData.data, vertexCount * sizeof(glm::vec3));
+			}
+			else if (hasNormals)
+			{
+				for (size_t i = 0; i < vertexCount; ++i)
+				{
+					glm::vec3 n(readFloat(normalData, i, 0), readFloat(normalData, i, 1), readFloat(normalData, i, 2));
+					normals[baseVertex + i] = isIdentity ? n : glm::normalize(normalTransform * n);
+				}
+			}
+
+			// glTF puts the texture origin at the top left, OBJ at the bottom left
+			texcoords.resize(baseVertex + vertexCount, glm::vec2(0.0f));
+			for (size_t i = 0; hasTexcoords && i < vertexCount; ++i)
+			{
+				texcoords[baseVertex + i] = glm::vec2(readFloat(texcoordData, i, 0), 1.0f - readFloat(texcoordData, i, 1));
+			}
+
+			// Faces of the primitive use its material, see Mesh::groupByMaterial
+			size_t material = primitive["material"].asIndex(SIZE_MAX);
+			useMtl.push_back(ObjUseMtl{ material < materialNames.size() ? materialNames[material] : "", elements.size() });
+
+			// Indices pointing past the primitive's vertices (a malformed file) are drawn
+			// as its first vertex rather than reading out of bounds
+			size_t firstElement = elements.size();
+			elements.resize(firstElement + indexCount);
+			GLuint* out = elements.data() + firstElement;
+			if (!hasIndices)
+			{
+				for (size_t i = 0; i < indexCount; ++i)
+				{
+					out[i] = static_cast<GLuint>(baseVertex + i);
+				}
+			}
+			else if (indices.componentType == GL_UNSIGNED_INT && indices.stride == sizeof(GLuint))
+			{
+				memcpy(out, indices.data, indexCount * sizeof(GLuint));
+				for (size_t i = 0; i < indexCount; ++i)
+				{
+					out[i] = static_cast<GLuint>(baseVertex + (out[i] < vertexCount ? out[i] : 0));
+				}
+			}
+			else
+			{
+				for (size_t i = 0; i < indexCount; ++i)
+				{
+					GLuint index = readIndex(indices, i);
+					out[i] = static_cast<GLuint>(baseVertex + (index < vertexCount ? index : 0));
+				}
+			}
+			for (size_t i = 0; isMirrored && i < indexCount; i += 3)
+			{
+				swap(out[i + 1], out[i + 2]);
+			}
+		}
+	}
+
+	if (!allNormals)
+	{
+		normals.clear();
+	}
+	if (!anyTexcoords)
+	{
+		texcoords.clear();
+	}
+	loadTimings.index = lap(phaseStart);
+}
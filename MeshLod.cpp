@@ -0,0 +1,427 @@
+#include "Mesh.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+
+using namespace std;
+
+// *********** Levels of detail ***********
+
+// Each level is a simplified copy of the index buffer, built with quadric error metrics
+// (Garland & Heckbert, "Surface Simplification Using Quadric Error Metrics", 1997) using
+// half-edge collapses: a vertex is merged into one of its neighbours and disappears, which
+// only ever removes vertices, so every level draws from the same vertex buffer and a level
+// is nothing more than another range of Mesh::elements.
+//
+// Vertices that can't move without the mesh visibly changing shape are locked:
+//  - vertices on an open border, including the edge of a submesh, so materials don't tear
+//  - vertices sharing their position with another vertex (a normal or texcoord seam), since
+//    collapsing one side of a seam and not the other would open a crack
+// A flat shaded mesh is all seams, so it doesn't simplify at all.
+//
+// Every level records the worst error it introduced, in model units. At draw time the
+// error is projected onto the screen, and the coarsest level whose error stays under a
+// pixel is used (Mesh::chooseLod).
+
+// Symmetric 4x4 matrix summing the squared distances to a set of planes, each weighted
+// by the area of its triangle. Dividing by the total weight gives the mean squared distance.
+struct Quadric {
+	double xx, xy, xz, xw, yy, yz, yw, zz, zw, ww;
+	double weight;
+};
+
+static void addPlane(Quadric& q, const glm::dvec3& n, double d, double w)
+{
+	q.xx += w * n.x * n.x; q.xy += w * n.x * n.y; q.xz += w * n.x * n.z; q.xw += w * n.x * d;
+	q.yy += w * n.y * n.y; q.yz += w * n.y * n.z; q.yw += w * n.y * d;
+	q.zz += w * n.z * n.z; q.zw += w * n.z * d;
+	q.ww += w * d * d;
+	q.weight += w;
+}
+
+static void addQuadric(Quadric& q, const Quadric& r)
+{
+	q.xx += r.xx; q.xy += r.xy; q.xz += r.xz; q.xw += r.xw;
+	q.yy += r.yy; q.yz += r.yz; q.yw += r.yw;
+	q.zz += r.zz; q.zw += r.zw;
+	q.ww += r.ww;
+	q.weight += r.weight;
+}
+
+static double quadricError(const Quadric& q, const glm::vec4& p)
+{
+	double x = p.x, y = p.y, z = p.z;
+	double error = q.xx * x * x + 2 * q.xy * x * y + 2 * q.xz * x * z + 2 * q.xw * x
+		+ q.yy * y * y + 2 * q.yz * y * z + 2 * q.yw * y
+		+ q.zz * z * z + 2 * q.zw * z
+		+ q.ww;
+	return max(error, 0.0);
+}
+
+static glm::vec3 triangleNormal(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c)
+{
+	return glm::cross(glm::vec3(b - a), glm::vec3(c - a));
+}
+
+// Plane of every triangle, summed into the quadrics of its corners
+static vector<Quadric> triangleQuadrics(const vector<GLuint>& indices, const vector<glm::vec4>& vertices)
+{
+	vector<Quadric> quadrics(vertices.size(), Quadric());
+	for (size_t t = 0; t + 2 < indices.size(); t += 3)
+	{
+		glm::dvec3 n(triangleNormal(vertices[indices[t]], vertices[indices[t + 1]], vertices[indices[t + 2]]));
+		double length = glm::length(n);
+		if (length == 0.0)
+		{
+			continue;
+		}
+		n /= length;
+		double d = -glm::dot(n, glm::dvec3(vertices[indices[t]]));
+		for (int c = 0; c < 3; ++c)
+		{
+			addPlane(quadrics[indices[t + c]], n, d, length * 0.5);
+		}
+	}
+	return quadrics;
+}
+
+// Lock the vertices that are on a seam (sharing a position with another vertex) anywhere
+// in the mesh. positionIds gives every vertex the index of the first vertex at its position.
+static vector<char> lockSeams(const vector<glm::vec4>& vertices, vector<GLuint>& positionIds)
+{
+	vector<GLuint> order(vertices.size());
+	iota(order.begin(), order.end(), 0);
+	auto less = [&vertices](GLuint a, GLuint b) {
+		const glm::vec4& p = vertices[a];
+		const glm::vec4& q = vertices[b];
+		return p.x != q.x ? p.x < q.x : p.y != q.y ? p.y < q.y : p.z != q.z ? p.z < q.z : a < b;
+	};
+	sort(order.begin(), order.end(), less);
+
+	vector<char> locked(vertices.size(), 0);
+	positionIds.resize(vertices.size());
+	for (size_t i = 0; i < order.size();)
+	{
+		size_t j = i + 1;
+		while (j < order.size() && glm::vec3(vertices[order[j]]) == glm::vec3(vertices[order[i]]))
+		{
+			++j;
+		}
+		for (size_t k = i; k < j; ++k)
+		{
+			positionIds[order[k]] = order[i];
+			locked[order[k]] = (j - i > 1);
+		}
+		i = j;
+	}
+	return locked;
+}
+
+// Also lock the vertices on an edge that only one triangle of indices uses. Edges are
+// compared by position, so edges along a seam count as shared.
+static void lockBorders(const vector<GLuint>& indices, const vector<GLuint>& positionIds, vector<char>& locked)
+{
+	vector<uint64_t> edges;
+	edges.reserve(indices.size());
+	for (size_t t = 0; t + 2 < indices.size(); t += 3)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			uint64_t a = positionIds[indices[t + c]];
+			uint64_t b = positionIds[indices[t + (c + 1) % 3]];
+			edges.push_back(a < b ? (a << 32 | b) : (b << 32 | a));
+		}
+	}
+	sort(edges.begin(), edges.end());
+
+	vector<char> borderPositions(positionIds.size(), 0);
+	for (size_t i = 0; i < edges.size();)
+	{
+		size_t j = i + 1;
+		while (j < edges.size() && edges[j] == edges[i])
+		{
+			++j;
+		}
+		if (j - i == 1)
+		{
+			borderPositions[edges[i] >> 32] = 1;
+			borderPositions[edges[i] & 0xFFFFFFFF] = 1;
+		}
+		i = j;
+	}
+	for (size_t v = 0; v < positionIds.size(); ++v)
+	{
+		locked[v] = locked[v] || borderPositions[positionIds[v]];
+	}
+}
+
+static const GLuint noVertex = 0xFFFFFFFF;
+
+struct Collapse {
+	GLuint from;
+	GLuint to;
+	double cost;  // Area weighted squared distance, which orders the collapses
+	double error; // Root mean square distance, which is what gets reported
+};
+
+// Collapse edges of indices, cheapest first, until it has at most targetTriangles
+// triangles or nothing more can be collapsed. quadrics are merged as vertices are, and
+// maxError grows to the largest error of any collapse made.
+static void simplify(vector<GLuint>& indices, const vector<glm::vec4>& vertices, const vector<char>& locked,
+	vector<Quadric>& quadrics, size_t targetTriangles, double& maxError)
+{
+	vector<GLuint> remap(vertices.size());
+	vector<char> touched(vertices.size());
+	vector<GLuint> adjacencyStart(vertices.size() + 1);
+	vector<GLuint> adjacency;
+	vector<Collapse> collapses;
+	vector<Collapse> best(vertices.size());
+
+	// Collapses are made in passes. Each pass sorts every possible collapse by cost and
+	// makes as many as it can, leaving alone any vertex next to one already collapsed in
+	// this pass so that the flip test below always sees the current triangles.
+	while (indices.size() / 3 > targetTriangles)
+	{
+		// The cheapest collapse out of each vertex. Considering only that one per vertex keeps
+		// the sort small, and the others would mostly be blocked by it anyway.
+		fill(best.begin(), best.end(), Collapse{ noVertex, noVertex, 0.0, 0.0 });
+		for (size_t t = 0; t < indices.size(); t += 3)
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				GLuint a = indices[t + c];
+				GLuint b = indices[t + (c + 1) % 3];
+				for (int direction = 0; direction < 2; ++direction)
+				{
+					if (!locked[a])
+					{
+						Quadric q = quadrics[a];
+						addQuadric(q, quadrics[b]);
+						double cost = quadricError(q, vertices[b]);
+						if (best[a].from == noVertex || cost < best[a].cost)
+						{
+							double error = q.weight > 0.0 ? sqrt(cost / q.weight) : 0.0;
+							best[a] = Collapse{ a, b, cost, error };
+						}
+					}
+					swap(a, b);
+				}
+			}
+		}
+		collapses.clear();
+		for (const Collapse& collapse : best)
+		{
+			if (collapse.from != noVertex)
+			{
+				collapses.push_back(collapse);
+			}
+		}
+		sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+		// Triangles around each vertex, in compressed row form
+		fill(adjacencyStart.begin(), adjacencyStart.end(), 0);
+		for (GLuint e : indices)
+		{
+			++adjacencyStart[e + 1];
+		}
+		partial_sum(adjacencyStart.begin(), adjacencyStart.end(), adjacencyStart.begin());
+		adjacency.resize(indices.size());
+		vector<GLuint> cursor(adjacencyStart.begin(), adjacencyStart.end() - 1);
+		for (size_t i = 0; i < indices.size(); ++i)
+		{
+			adjacency[cursor[indices[i]]++] = static_cast<GLuint>(i / 3);
+		}
+
+		iota(remap.begin(), remap.end(), 0);
+		fill(touched.begin(), touched.end(), 0);
+		size_t excess = indices.size() / 3 - targetTriangles;
+		size_t removed = 0;
+		for (const Collapse& collapse : collapses)
+		{
+			if (removed >= excess)
+			{
+				break;
+			}
+			if (touched[collapse.from] || touched[collapse.to])
+			{
+				continue;
+			}
+
+			// Reject collapses that fold a triangle over (or close to it)
+			bool flips = false;
+			size_t dying = 0;
+			for (GLuint k = adjacencyStart[collapse.from]; k < adjacencyStart[collapse.from + 1] && !flips; ++k)
+			{
+				const GLuint* tri = &indices[adjacency[k] * 3];
+				if (tri[0] == collapse.to || tri[1] == collapse.to || tri[2] == collapse.to)
+				{
+					++dying;
+					continue;
+				}
+				glm::vec4 corners[3] = { vertices[tri[0]], vertices[tri[1]], vertices[tri[2]] };
+				glm::vec3 before = triangleNormal(corners[0], corners[1], corners[2]);
+				for (int c = 0; c < 3; ++c)
+				{
+					if (tri[c] == collapse.from)
+					{
+						corners[c] = vertices[collapse.to];
+					}
+				}
+				glm::vec3 after = triangleNormal(corners[0], corners[1], corners[2]);
+				flips = glm::dot(before, after) <= 0.25f * glm::length(before) * glm::length(after);
+			}
+			if (flips)
+			{
+				continue;
+			}
+
+			remap[collapse.from] = collapse.to;
+			addQuadric(quadrics[collapse.to], quadrics[collapse.from]);
+			maxError = max(maxError, collapse.error);
+			removed += dying;
+			for (GLuint k = adjacencyStart[collapse.from]; k < adjacencyStart[collapse.from + 1]; ++k)
+			{
+				const GLuint* tri = &indices[adjacency[k] * 3];
+				touched[tri[0]] = touched[tri[1]] = touched[tri[2]] = 1;
+			}
+		}
+
+		if (removed == 0)
+		{
+			break;
+		}
+
+		// Rewrite the triangles, dropping the ones that collapsed to a line
+		size_t kept = 0;
+		for (size_t t = 0; t < indices.size(); t += 3)
+		{
+			GLuint a = remap[indices[t]], b = remap[indices[t + 1]], c = remap[indices[t + 2]];
+			if (a != b && b != c && c != a)
+			{
+				indices[kept++] = a;
+				indices[kept++] = b;
+				indices[kept++] = c;
+			}
+		}
+		indices.resize(kept);
+	}
+}
+
+void Mesh::buildLods(int lodCount)
+{
+	// Level 0 is the mesh as loaded
+	lods.clear();
+	MeshLod full;
+	full.error = 0.0f;
+	for (const Submesh& submesh : submeshes)
+	{
+		full.ranges.push_back(IndexRange{ submesh.firstIndex, submesh.indexCount });
+	}
+	lods.push_back(full);
+	if (lodCount <= 1 || elements.empty())
+	{
+		return;
+	}
+
+	vector<GLuint> positionIds;
+	vector<char> seams = lockSeams(vertices, positionIds);
+
+	// Simplify each submesh on its own, halving the triangle count per level
+	size_t levels = lodCount - 1;
+	vector<vector<vector<GLuint>>> simplified(levels, vector<vector<GLuint>>(submeshes.size()));
+	vector<double> errors(levels, 0.0);
+	for (size_t s = 0; s < submeshes.size(); ++s)
+	{
+		vector<GLuint> indices(elements.begin() + submeshes[s].firstIndex,
+			elements.begin() + submeshes[s].firstIndex + submeshes[s].indexCount);
+		vector<char> locked = seams;
+		lockBorders(indices, positionIds, locked);
+		vector<Quadric> quadrics = triangleQuadrics(indices, vertices);
+
+		// A submesh is never simplified away: every range of every level keeps at least one
+		// triangle, and one that collapses to nothing keeps its last triangles instead
+		double error = 0.0;
+		for (size_t level = 0; level < levels; ++level)
+		{
+			if (indices.size() > 3)
+			{
+				simplify(indices, vertices, locked, quadrics, max<size_t>(1, indices.size() / 3 / 2), error);
+				if (indices.empty())
+				{
+					indices = level > 0 ? simplified[level - 1][s] : vector<GLuint>(elements.begin() + submeshes[s].firstIndex,
+						elements.begin() + submeshes[s].firstIndex + submeshes[s].indexCount);
+				}
+			}
+			simplified[level][s] = indices;
+			errors[level] = max(errors[level], error);
+		}
+	}
+
+	// Keep levels while they are worth having: each should draw clearly fewer triangles
+	// than the one before
+	size_t previousTriangles = elements.size() / 3;
+	for (size_t level = 0; level < levels; ++level)
+	{
+		size_t triangles = 0;
+		for (const vector<GLuint>& indices : simplified[level])
+		{
+			triangles += indices.size() / 3;
+		}
+		if (triangles == 0 || triangles * 5 > previousTriangles * 4)
+		{
+			break;
+		}
+
+		MeshLod lod;
+		lod.error = static_cast<float>(errors[level]);
+		for (const vector<GLuint>& indices : simplified[level])
+		{
+			lod.ranges.push_back(IndexRange{ elements.size(), indices.size() });
+			elements.insert(elements.end(), indices.begin(), indices.end());
+		}
+		lods.push_back(lod);
+		previousTriangles = triangles;
+	}
+
+	cout << "Built " << lods.size() - 1 << " LODs:";
+	for (const MeshLod& lod : lods)
+	{
+		size_t triangles = 0;
+		for (const IndexRange& range : lod.ranges)
+		{
+			triangles += range.indexCount / 3;
+		}
+		cout << " " << triangles;
+	}
+	cout << " triangles" << endl;
+}
+
+size_t Mesh::chooseLod(float pixelsPerUnit, size_t current) const
+{
+	// Coarsest level whose error is under a pixel on screen. Moving to a coarser level needs
+	// its error to be well under the threshold, so an object sitting right on the boundary
+	// doesn't flicker between two levels from frame to frame. Moving to a finer level
+	// happens as soon as the current one is too coarse.
+	const float pixelThreshold = 1.0f;
+	const float hysteresis = 0.5f;
+
+	size_t wanted = 0;
+	for (size_t l = 1; l < lods.size(); ++l)
+	{
+		if (lods[l].error * pixelsPerUnit <= pixelThreshold)
+		{
+			wanted = l;
+		}
+	}
+
+	if (wanted > current && current < lods.size())
+	{
+		while (wanted > current && lods[wanted].error * pixelsPerUnit > pixelThreshold * hysteresis)
+		{
+			--wanted;
+		}
+	}
+	return wanted;
+}
@@ -0,0 +1,247 @@
+#include "Mesh.hpp"
+
+#include "AssetPack.hpp"
+#include "ObjParser.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <mutex>
+
+using namespace std;
+
+// *********** Materials ***********
+
+// Every "usemtl" in an OBJ file starts a run of faces using the named material from the
+// file's MTL library. Mesh::load groups the faces by material, so however often a material
+// is switched to in the file it ends up as one Submesh -- one draw -- over a contiguous
+// range of the index buffer.
+//
+// MTL files are parsed once and kept in a cache shared by every mesh, so models that share
+// a library (or a library with dozens of materials) don't parse it again per mesh. A cached
+// library is reparsed if the file's size or modification time changes.
+
+Material defaultMaterial()
+{
+	Material material;
+	material.ambientReflectivity = glm::vec4(0.329412f, 0.223529f, 0.027451f, 1.0f);
+	material.diffuseReflectivity = glm::vec4(0.780392f, 0.568627f, 0.113725f, 1.0f);
+	material.specularRelectivity = glm::vec4(0.992157f, 0.941176f, 0.807843f, 1.0f);
+	material.shininess = 27.8f;
+	return material;
+}
+
+// Read a colour ("Ka 0.1 0.2 0.3") into the rgb of colour
+static void readColour(const string& values, glm::vec4& colour)
+{
+	istringstream s(values);
+	s >> colour.r;
+	s >> colour.g;
+	s >> colour.b;
+}
+
+static shared_ptr<const MaterialLibrary> parseMaterialLibrary(const string& mtlFile)
+{
+	shared_ptr<MaterialLibrary> library = make_shared<MaterialLibrary>();
+
+	AssetStream mtlIn(mtlFile);
+	if (!mtlIn)
+	{
+		cerr << "Cannot open " << mtlFile << endl;
+		return library;
+	}
+
+	// Each material starts with "newmtl name". Anything a material doesn't set keeps its
+	// value from defaultMaterial(). The transparency ("d") ends up in the alpha of all
+	// three colours.
+	Material* material = nullptr;
+	float alpha = 1.0f;
+	auto finishMaterial = [&material, &alpha]() {
+		if (material != nullptr)
+		{
+			material->ambientReflectivity.a = alpha;
+			material->diffuseReflectivity.a = alpha;
+			material->specularRelectivity.a = alpha;
+		}
+	};
+
+	string mtlLine;
+	while (getline(mtlIn, mtlLine))
+	{
+		// Allow for indented lines and Windows line endings
+		size_t start = mtlLine.find_first_not_of(" \t");
+		mtlLine.erase(0, start == string::npos ? mtlLine.size() : start);
+		if (!mtlLine.empty() && mtlLine.back() == '\r')
+		{
+			mtlLine.pop_back();
+		}
+
+		if (mtlLine.substr(0, 7) == "newmtl ")
+		{
+			finishMaterial();
+			string name = mtlLine.substr(7);
+			name.erase(name.find_last_not_of(" \t") + 1);
+			material = &(*library)[name];
+			*material = defaultMaterial();
+			alpha = 1.0f;
+		}
+		else if (material == nullptr)
+		{
+			// Nothing before the first newmtl belongs to a material
+		}
+		else if (mtlLine.substr(0, 3) == "Ka ")
+		{
+			// Process ambient reflectivity settings
+			readColour(mtlLine.substr(3), material->ambientReflectivity);
+		}
+		else if (mtlLine.substr(0, 3) == "Kd ")
+		{
+			// Process diffusive reflectivity settings
+			readColour(mtlLine.substr(3), material->diffuseReflectivity);
+		}
+		else if (mtlLine.substr(0, 3) == "Ks ")
+		{
+			// Process specular reflectivity settings
+			readColour(mtlLine.substr(3), material->specularRelectivity);
+		}
+		else if (mtlLine.substr(0, 3) == "Ns ")
+		{
+			// Process shininess setting
+			istringstream s(mtlLine.substr(3));
+			s >> material->shininess;
+		}
+		else if (mtlLine.substr(0, 2) == "d ")
+		{
+			// Process transparency setting
+			istringstream s(mtlLine.substr(2));
+			s >> alpha;
+		}
+		else
+		{
+			// Ignore this line at the moment
+		}
+	}
+	finishMaterial();
+
+	cout << "Loaded " << library->size() << " materials from " << mtlFile << endl;
+	return library;
+}
+
+shared_ptr<const MaterialLibrary> loadMaterialLibrary(string mtlFile)
+{
+	struct CachedLibrary {
+		shared_ptr<const MaterialLibrary> library;
+		uint64_t size;
+		uint64_t writeTime;
+	};
+	static mutex cacheMutex;
+	static map<string, CachedLibrary> cache;
+
+	uint64_t size, writeTime;
+	getAssetStamp(mtlFile, size, writeTime);
+
+	// Parsing happens under the lock, so two threads asking for the same library at once
+	// parse it once between them
+	lock_guard<mutex> lock(cacheMutex);
+	auto cached = cache.find(mtlFile);
+	if (cached != cache.end() && cached->second.size == size && cached->second.writeTime == writeTime)
+	{
+		return cached->second.library;
+	}
+
+	CachedLibrary& entry = cache[mtlFile];
+	entry.library = parseMaterialLibrary(mtlFile);
+	entry.size = size;
+	entry.writeTime = writeTime;
+	return entry.library;
+}
+
+void Mesh::groupByMaterial(const vector<ObjUseMtl>& useMtl)
+{
+	// Material of each triangle, numbered in order of first use. Triangles before the
+	// first usemtl are given the unnamed material.
+	size_t triangleCount = elements.size() / 3;
+	vector<string> names;
+	vector<GLuint> triangleMaterials(triangleCount, 0);
+	if (useMtl.empty() || useMtl[0].firstCorner > 0)
+	{
+		names.push_back("");
+	}
+
+	for (size_t i = 0; i < useMtl.size(); ++i)
+	{
+		size_t slot = find(names.begin(), names.end(), useMtl[i].name) - names.begin();
+		if (slot == names.size())
+		{
+			names.push_back(useMtl[i].name);
+		}
+
+		size_t first = min(useMtl[i].firstCorner / 3, triangleCount);
+		size_t last = (i + 1 < useMtl.size()) ? min(useMtl[i + 1].firstCorner / 3, triangleCount) : triangleCount;
+		fill(triangleMaterials.begin() + first, triangleMaterials.begin() + last, static_cast<GLuint>(slot));
+	}
+
+	// Stable counting sort of the triangles by material, keeping file order within each
+	vector<size_t> starts(names.size() + 1, 0);
+	for (GLuint material : triangleMaterials)
+	{
+		++starts[material + 1];
+	}
+	for (size_t m = 0; m < names.size(); ++m)
+	{
+		starts[m + 1] += starts[m];
+	}
+
+	submeshes.clear();
+	for (size_t m = 0; m < names.size(); ++m)
+	{
+		if (starts[m + 1] > starts[m])
+		{
+			Submesh submesh;
+			submesh.materialName = names[m];
+			submesh.material = defaultMaterial();
+			submesh.firstIndex = starts[m] * 3;
+			submesh.indexCount = (starts[m + 1] - starts[m]) * 3;
+			submeshes.push_back(submesh);
+		}
+	}
+
+	if (names.size() > 1)
+	{
+		vector<GLuint> grouped(elements.size());
+		vector<size_t> cursor(starts.begin(), starts.end() - 1);
+		for (size_t t = 0; t < triangleCount; ++t)
+		{
+			size_t to = cursor[triangleMaterials[t]]++;
+			copy(elements.begin() + t * 3, elements.begin() + t * 3 + 3, grouped.begin() + to * 3);
+		}
+		elements.swap(grouped);
+	}
+}
+
+void Mesh::loadMaterials(string mtlFile)
+{
+	if (mtlFile == "")
+	{
+		return; // Every submesh keeps the default material
+	}
+
+	applyMaterials(*loadMaterialLibrary(mtlFile), mtlFile);
+}
+
+void Mesh::applyMaterials(const MaterialLibrary& library, const string& libraryName)
+{
+	for (Submesh& submesh : submeshes)
+	{
+		auto found = library.find(submesh.materialName);
+		if (found != library.end())
+		{
+			submesh.material = found->second;
+		}
+		else if (submesh.materialName != "")
+		{
+			cerr << "Material " << submesh.materialName << " not found in " << libraryName << endl;
+		}
+	}
+}
@@ -0,0 +1,157 @@
+#include "Mesh.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// *********** Meshlets ***********
+
+// A meshlet is a small cluster of triangles, meshletMaxVertices vertices and
+// meshletMaxTriangles triangles at most, with a bounding sphere and a normal cone. Before
+// a mesh is drawn each of its meshlets is tested against the view frustum and the cone, and
+// only the meshlets that can be seen are drawn, so most of the vertex work for the back and
+// the off screen parts of a dense mesh is never done.
+//
+// buildMeshlets cuts a range of elements into meshlets in the order the triangles are
+// already in, which after Mesh::optimise is cache order and so keeps neighbouring
+// triangles together. Each meshlet is therefore a contiguous run of elements and is drawn
+// with no extra index data.
+
+void buildMeshlets(const vector<glm::vec4>& vertices, const vector<GLuint>& elements, IndexRange range, vector<Meshlet>& meshlets)
+{
+	vector<GLuint> meshletVertices;
+	meshletVertices.reserve(meshletMaxVertices);
+
+	auto finish = [&](size_t first, size_t last) {
+		Meshlet meshlet;
+		meshlet.firstIndex = first;
+		meshlet.indexCount = last - first;
+
+		// Bounding sphere around the centre of the bounding box
+		glm::vec3 low(vertices[meshletVertices[0]]), high = low;
+		for (GLuint v : meshletVertices)
+		{
+			low = glm::min(low, glm::vec3(vertices[v]));
+			high = glm::max(high, glm::vec3(vertices[v]));
+		}
+		meshlet.center = (low + high) * 0.5f;
+		meshlet.radius = 0.0f;
+		for (GLuint v : meshletVertices)
+		{
+			meshlet.radius = max(meshlet.radius, glm::length(glm::vec3(vertices[v]) - meshlet.center));
+		}
+
+		// The cone axis is the average face normal, and the cutoff is the sine of the widest
+		// angle between it and any face normal. A spread of 90 degrees or more can't be
+		// culled, which a cutoff of 1 ensures (see MeshletCuller::isVisible).
+		glm::vec3 axis(0.0f);
+		vector<glm::vec3> faceNormals;
+		for (size_t t = first; t < last; t += 3)
+		{
+			glm::vec3 a(vertices[elements[t]]), b(vertices[elements[t + 1]]), c(vertices[elements[t + 2]]);
+			glm::vec3 n = glm::cross(b - a, c - a);
+			float length = glm::length(n);
+			if (length > 0.0f)
+			{
+				faceNormals.push_back(n / length);
+				axis += n / length;
+			}
+		}
+		float axisLength = glm::length(axis);
+		meshlet.coneAxis = axisLength > 0.0f ? axis / axisLength : glm::vec3(0.0f, 0.0f, 1.0f);
+		float minDot = faceNormals.empty() ? -1.0f : 1.0f;
+		for (const glm::vec3& n : faceNormals)
+		{
+			minDot = min(minDot, glm::dot(n, meshlet.coneAxis));
+		}
+		meshlet.coneCutoff = minDot <= 0.0f ? 1.0f : sqrt(1.0f - minDot * minDot);
+
+		meshlets.push_back(meshlet);
+	};
+
+	size_t first = range.firstIndex;
+	size_t last = range.firstIndex + range.indexCount;
+	size_t meshletFirst = first;
+	for (size_t t = first; t + 2 < last; t += 3)
+	{
+		// Vertices this triangle would add to the current meshlet
+		size_t added = 0;
+		for (int c = 0; c < 3; ++c)
+		{
+			GLuint v = elements[t + c];
+			bool seen = find(meshletVertices.begin(), meshletVertices.end(), v) != meshletVertices.end();
+			bool repeated = (c > 0 && elements[t] == v) || (c > 1 && elements[t + 1] == v);
+			added += (!seen && !repeated);
+		}
+
+		size_t triangles = (t - meshletFirst) / 3;
+		if (triangles > 0 && (meshletVertices.size() + added > meshletMaxVertices || triangles >= meshletMaxTriangles))
+		{
+			finish(meshletFirst, t);
+			meshletFirst = t;
+			meshletVertices.clear();
+		}
+
+		for (int c = 0; c < 3; ++c)
+		{
+			GLuint v = elements[t + c];
+			if (find(meshletVertices.begin(), meshletVertices.end(), v) == meshletVertices.end())
+			{
+				meshletVertices.push_back(v);
+			}
+		}
+	}
+	if (!meshletVertices.empty())
+	{
+		finish(meshletFirst, last - (last - first) % 3);
+	}
+}
+
+void Mesh::buildMeshlets()
+{
+	// Only the full detail level is split up; the simplified levels are small by design
+	meshlets.clear();
+	for (Submesh& submesh : submeshes)
+	{
+		submesh.firstMeshlet = meshlets.size();
+		::buildMeshlets(vertices, elements, IndexRange{ submesh.firstIndex, submesh.indexCount }, meshlets);
+		submesh.meshletCount = meshlets.size() - submesh.firstMeshlet;
+	}
+}
+
+MeshletCuller::MeshletCuller(const glm::mat4& model, const glm::mat4& view, const glm::mat4& projection)
+{
+	// Frustum planes straight out of the combined matrix (Gribb & Hartmann, "Fast
+	// Extraction of Viewing Frustum Planes from the World-View-Projection Matrix"). Using
+	// the model matrix too puts them in model space, where the meshlet bounds are.
+	glm::mat4 m = glm::transpose(projection * view * model);
+	mPlanes[0] = m[3] + m[0]; // left
+	mPlanes[1] = m[3] - m[0]; // right
+	mPlanes[2] = m[3] + m[1]; // bottom
+	mPlanes[3] = m[3] - m[1]; // top
+	mPlanes[4] = m[3] + m[2]; // near
+	mPlanes[5] = m[3] - m[2]; // far
+	for (glm::vec4& plane : mPlanes)
+	{
+		plane /= glm::length(glm::vec3(plane));
+	}
+
+	mEye = glm::vec3(glm::inverse(view * model) * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+}
+
+bool MeshletCuller::isVisible(const Meshlet& meshlet) const
+{
+	for (const glm::vec4& plane : mPlanes)
+	{
+		if (glm::dot(glm::vec3(plane), meshlet.center) + plane.w < -meshlet.radius)
+		{
+			return false;
+		}
+	}
+
+	// Every face is turned away from the eye if the eye is inside the cone opposite the
+	// normal cone, widened to allow for the size of the meshlet
+	glm::vec3 toCenter = meshlet.center - mEye;
+	return glm::dot(toCenter, meshlet.coneAxis) < meshlet.coneCutoff * glm::length(toCenter) + meshlet.radius;
+}
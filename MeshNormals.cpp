@@ -0,0 +1,381 @@
+#include "Mesh.hpp"
+
+#include <emmintrin.h>
+
+#include <thread>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// *********** Normal generation ***********
+
+// Smooth vertex normals are the weighted sum of the normals of the faces around each vertex.
+// The unnormalised cross product of two triangle edges has a length of twice the triangle's
+// area, so summing raw cross products gives area weighting for free. Angle weighting scales
+// the unit face normal by the angle of the triangle at the vertex instead, which stops a fan
+// of thin triangles from outvoting one big one.
+//
+// Triangles are worked on four at a time, one SSE register per coordinate with a triangle in
+// each lane, so the cross products, lengths and angles all run four wide. Each corner's
+// contribution is written out on its own, then summed per vertex through a list of the
+// corners around each vertex. Threads never write to the same place in either pass, and the
+// memory used grows with the mesh rather than with the number of threads.
+
+// Don't bother starting a thread for fewer triangles than this
+static const size_t trianglesPerThread = 1 << 16;
+
+// Dot product of the xyz lanes, broadcast to every lane
+static inline __m128 dot3(__m128 a, __m128 b)
+{
+	__m128 m = _mm_mul_ps(a, b);
+	m = _mm_and_ps(m, _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1)));
+	m = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+}
+
+// Arc cosine of each lane, by Abramowitz and Stegun's 4.4.46, which is good to 2e-8
+// radians (so as exact as a float gets); SSE has no acos of its own
+static inline __m128 acos4(__m128 x)
+{
+	static const float coefficients[] = { -0.0012624911f, 0.0066700901f, -0.0170881256f, 0.0308918810f,
+		-0.0501743046f, 0.0889789874f, -0.2145988016f, 1.5707963050f };
+
+	__m128 one = _mm_set1_ps(1.0f);
+	x = _mm_max_ps(_mm_set1_ps(-1.0f), _mm_min_ps(one, x));
+	__m128 negative = _mm_cmplt_ps(x, _mm_setzero_ps());
+	__m128 a = _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+
+	__m128 p = _mm_set1_ps(coefficients[0]);
+	for (int i = 1; i < 8; ++i)
+	{
+		p = _mm_add_ps(_mm_mul_ps(p, a), _mm_set1_ps(coefficients[i]));
+	}
+	__m128 r = _mm_mul_ps(p, _mm_sqrt_ps(_mm_sub_ps(one, a)));
+
+	// acos(-x) = pi - acos(x)
+	__m128 reflected = _mm_sub_ps(_mm_set1_ps(3.14159265f), r);
+	return _mm_or_ps(_mm_and_ps(negative, reflected), _mm_andnot_ps(negative, r));
+}
+
+// Three coordinates of four points, one register each
+struct Points4
+{
+	__m128 x, y, z;
+};
+
+static inline Points4 operator-(const Points4& a, const Points4& b)
+{
+	return Points4{ _mm_sub_ps(a.x, b.x), _mm_sub_ps(a.y, b.y), _mm_sub_ps(a.z, b.z) };
+}
+
+static inline __m128 dot(const Points4& a, const Points4& b)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a.x, b.x), _mm_mul_ps(a.y, b.y)), _mm_mul_ps(a.z, b.z));
+}
+
+static inline Points4 cross(const Points4& a, const Points4& b)
+{
+	return Points4{
+		_mm_sub_ps(_mm_mul_ps(a.y, b.z), _mm_mul_ps(a.z, b.y)),
+		_mm_sub_ps(_mm_mul_ps(a.z, b.x), _mm_mul_ps(a.x, b.z)),
+		_mm_sub_ps(_mm_mul_ps(a.x, b.y), _mm_mul_ps(a.y, b.x)) };
+}
+
+static inline Points4 scale(const Points4& a, __m128 s)
+{
+	return Points4{ _mm_mul_ps(a.x, s), _mm_mul_ps(a.y, s), _mm_mul_ps(a.z, s) };
+}
+
+// Gather four vertices and turn them from one register per vertex into one per coordinate
+static inline Points4 loadPoints(const vector<glm::vec4>& vertices, const GLuint index[4])
+{
+	__m128 p0 = _mm_loadu_ps(&vertices[index[0]].x);
+	__m128 p1 = _mm_loadu_ps(&vertices[index[1]].x);
+	__m128 p2 = _mm_loadu_ps(&vertices[index[2]].x);
+	__m128 p3 = _mm_loadu_ps(&vertices[index[3]].x);
+	_MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+	return Points4{ p0, p1, p2 };
+}
+
+// Angle between two edge vectors leaving the same corner, 0 where either has no length
+static inline __m128 cornerAngles(const Points4& e1, const Points4& e2)
+{
+	__m128 lengths = _mm_sqrt_ps(_mm_mul_ps(dot(e1, e1), dot(e2, e2)));
+	__m128 nonZero = _mm_cmpgt_ps(lengths, _mm_setzero_ps());
+	return _mm_and_ps(acos4(_mm_div_ps(dot(e1, e2), lengths)), nonZero);
+}
+
+// Write the weighted normal contributions of the corners of triangles [first, last) to
+// contributions[t * 3 + corner], with w = 0
+static void cornerContributions(const vector<glm::vec4>& vertices, const vector<GLuint>& elements,
+	size_t first, size_t last, NormalWeighting weighting, vector<glm::vec4>& contributions)
+{
+	for (size_t t = first; t < last; t += 4)
+	{
+		// A short batch at the end repeats its last triangle in the spare lanes
+		size_t count = min<size_t>(4, last - t);
+		GLuint index[3][4];
+		for (size_t lane = 0; lane < 4; ++lane)
+		{
+			size_t triangle = t + min(lane, count - 1);
+			for (int k = 0; k < 3; ++k)
+			{
+				index[k][lane] = elements[triangle * 3 + k];
+			}
+		}
+		Points4 a = loadPoints(vertices, index[0]);
+		Points4 b = loadPoints(vertices, index[1]);
+		Points4 c = loadPoints(vertices, index[2]);
+		Points4 ab = b - a;
+		Points4 ac = c - a;
+
+		// Twice each triangle's area times its unit normal
+		Points4 n = cross(ab, ac);
+		Points4 weighted[3];
+		if (weighting == NormalWeighting::Area)
+		{
+			weighted[0] = weighted[1] = weighted[2] = n;
+		}
+		else
+		{
+			// Degenerate triangles have no direction to contribute
+			__m128 length = _mm_sqrt_ps(dot(n, n));
+			__m128 nonZero = _mm_cmpgt_ps(length, _mm_setzero_ps());
+			__m128 inverse = _mm_and_ps(_mm_div_ps(_mm_set1_ps(1.0f), length), nonZero);
+			n = scale(n, inverse);
+
+			__m128 angleA = cornerAngles(ab, ac);
+			__m128 angleB = cornerAngles(a - b, c - b);
+			__m128 angleC = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(3.14159265f), angleA), angleB);
+			weighted[0] = scale(n, angleA);
+			weighted[1] = scale(n, angleB);
+			weighted[2] = scale(n, angleC);
+		}
+
+		for (int k = 0; k < 3; ++k)
+		{
+			__m128 x = weighted[k].x, y = weighted[k].y, z = weighted[k].z, w = _mm_setzero_ps();
+			_MM_TRANSPOSE4_PS(x, y, z, w);
+			__m128 lanes[4] = { x, y, z, w };
+			for (size_t lane = 0; lane < count; ++lane)
+			{
+				_mm_storeu_ps(&contributions[(t + lane) * 3 + k].x, lanes[lane]);
+			}
+		}
+	}
+}
+
+// Sum the contributions of the corners around vertices [first, last) and write unit normals.
+// Vertices with nothing accumulated (unreferenced, or only degenerate triangles) get a zero normal.
+static void gatherNormals(const vector<glm::vec4>& contributions, const vector<GLuint>& cornerStart,
+	const vector<GLuint>& cornersAt, size_t first, size_t last, vector<glm::vec3>& normals)
+{
+	for (size_t v = first; v < last; ++v)
+	{
+		__m128 sum = _mm_setzero_ps();
+		for (GLuint k = cornerStart[v]; k < cornerStart[v + 1]; ++k)
+		{
+			sum = _mm_add_ps(sum, _mm_loadu_ps(&contributions[cornersAt[k]].x));
+		}
+
+		__m128 lengthSquared = dot3(sum, sum);
+		__m128 nonZero = _mm_cmpgt_ps(lengthSquared, _mm_setzero_ps());
+		__m128 unit = _mm_and_ps(_mm_div_ps(sum, _mm_sqrt_ps(lengthSquared)), nonZero);
+
+		float result[4];
+		_mm_storeu_ps(result, unit);
+		normals[v] = glm::vec3(result[0], result[1], result[2]);
+	}
+}
+
+// Run work(i, first, last) for each thread i, where [first, last) is its share of [0, count)
+template <typename Work>
+static void parallelFor(size_t count, unsigned threadCount, Work work)
+{
+	if (threadCount <= 1)
+	{
+		work(0, 0, count);
+		return;
+	}
+
+	vector<thread> workers;
+	for (unsigned i = 0; i < threadCount; ++i)
+	{
+		size_t first = count * i / threadCount;
+		size_t last = count * (i + 1) / threadCount;
+		workers.emplace_back([=]() { work(i, first, last); });
+	}
+	for (thread& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+void Mesh::computeNormals(NormalWeighting weighting, float creaseAngle)
+{
+	if (creaseAngle < 180.0f)
+	{
+		computeCreasedNormals(weighting, creaseAngle);
+		return;
+	}
+
+	if (vertices.empty())
+	{
+		normals.clear();
+		return;
+	}
+
+	size_t triangleCount = elements.size() / 3;
+	size_t cornerCount = triangleCount * 3;
+	unsigned threadCount = static_cast<unsigned>(min<size_t>(max(1u, thread::hardware_concurrency()),
+		max<size_t>(1, triangleCount / trianglesPerThread)));
+
+	vector<glm::vec4> contributions(cornerCount);
+	parallelFor(triangleCount, threadCount, [&](unsigned, size_t first, size_t last) {
+		cornerContributions(vertices, elements, first, last, weighting, contributions);
+	});
+
+	// Corners around each vertex, in compressed row form
+	vector<GLuint> cornerStart(vertices.size() + 1, 0);
+	for (size_t i = 0; i < cornerCount; ++i)
+	{
+		++cornerStart[elements[i] + 1];
+	}
+	for (size_t v = 0; v < vertices.size(); ++v)
+	{
+		cornerStart[v + 1] += cornerStart[v];
+	}
+	vector<GLuint> cornersAt(cornerCount);
+	vector<GLuint> fill(cornerStart.begin(), cornerStart.end() - 1);
+	for (size_t i = 0; i < cornerCount; ++i)
+	{
+		cornersAt[fill[elements[i]]++] = static_cast<GLuint>(i);
+	}
+
+	normals.resize(vertices.size());
+	parallelFor(vertices.size(), threadCount, [&](unsigned, size_t first, size_t last) {
+		gatherNormals(contributions, cornerStart, cornersAt, first, last, normals);
+	});
+}
+
+// With a crease angle a vertex can need several normals, one per smooth region of the faces
+// around it, so vertices are split where faces meet at a sharper angle than creaseAngle.
+// Faces are matched by position rather than by vertex index so that vertices already split
+// for texture seams still shade smoothly across the seam.
+void Mesh::computeCreasedNormals(NormalWeighting weighting, float creaseAngle)
+{
+	size_t triangleCount = elements.size() / 3;
+	float cosCrease = cosf(creaseAngle * 3.14159265f / 180.0f);
+
+	// Per-corner weighted contributions, plus the unit face normal used for the crease test
+	vector<glm::vec4> contributions(elements.size());
+	cornerContributions(vertices, elements, 0, triangleCount, weighting, contributions);
+	vector<glm::vec3> faceNormals(triangleCount);
+	for (size_t t = 0; t < triangleCount; ++t)
+	{
+		const glm::vec4& a = vertices[elements[t * 3]];
+		const glm::vec4& b = vertices[elements[t * 3 + 1]];
+		const glm::vec4& c = vertices[elements[t * 3 + 2]];
+		glm::vec3 faceNormal = glm::cross(glm::vec3(b - a), glm::vec3(c - a));
+		float length = glm::length(faceNormal);
+		faceNormals[t] = length > 0.0f ? faceNormal / length : glm::vec3(0.0f);
+	}
+
+	// Give every vertex the id of its position, so coincident vertices share an id
+	vector<GLuint> byPosition(vertices.size());
+	for (size_t i = 0; i < byPosition.size(); ++i)
+	{
+		byPosition[i] = static_cast<GLuint>(i);
+	}
+	sort(byPosition.begin(), byPosition.end(), [this](GLuint a, GLuint b) {
+		const glm::vec4& p = vertices[a];
+		const glm::vec4& q = vertices[b];
+		return p.x < q.x || (p.x == q.x && (p.y < q.y || (p.y == q.y && p.z < q.z)));
+	});
+	vector<GLuint> positionId(vertices.size());
+	GLuint positionCount = 0;
+	for (size_t i = 0; i < byPosition.size(); ++i)
+	{
+		if (i > 0 && glm::vec3(vertices[byPosition[i]]) != glm::vec3(vertices[byPosition[i - 1]]))
+		{
+			++positionCount;
+		}
+		positionId[byPosition[i]] = positionCount;
+	}
+	++positionCount;
+
+	// Corners around each position, in compressed row form
+	vector<GLuint> cornerStart(positionCount + 1, 0);
+	for (GLuint e : elements)
+	{
+		++cornerStart[positionId[e] + 1];
+	}
+	for (size_t p = 0; p < positionCount; ++p)
+	{
+		cornerStart[p + 1] += cornerStart[p];
+	}
+	vector<GLuint> cornersAt(elements.size());
+	vector<GLuint> fill(cornerStart.begin(), cornerStart.end() - 1);
+	for (size_t i = 0; i < elements.size(); ++i)
+	{
+		cornersAt[fill[positionId[elements[i]]]++] = static_cast<GLuint>(i);
+	}
+
+	// Normal for each corner from the faces at its position lying within the crease angle.
+	// Corners of the same vertex that come out with identical normals share one vertex,
+	// any others get a copy of the vertex.
+	vector<glm::vec3> cornerNormals(elements.size());
+	for (size_t i = 0; i < elements.size(); ++i)
+	{
+		const glm::vec3& faceNormal = faceNormals[i / 3];
+		GLuint p = positionId[elements[i]];
+
+		glm::vec3 sum(0.0f);
+		for (GLuint k = cornerStart[p]; k < cornerStart[p + 1]; ++k)
+		{
+			GLuint other = cornersAt[k];
+			if (glm::dot(faceNormal, faceNormals[other / 3]) >= cosCrease)
+			{
+				sum += glm::vec3(contributions[other]);
+			}
+		}
+		float length = glm::length(sum);
+		cornerNormals[i] = length > 0.0f ? sum / length : glm::vec3(0.0f);
+	}
+
+	// Rebuild the vertex list. variants[v] lists the vertices made so far from original vertex v.
+	vector<glm::vec4> newVertices;
+	vector<glm::vec2> newTexcoords;
+	normals.clear();
+	vector<vector<GLuint>> variants(vertices.size());
+	for (size_t i = 0; i < elements.size(); ++i)
+	{
+		GLuint v = elements[i];
+		GLuint index = 0xFFFFFFFF;
+		for (GLuint candidate : variants[v])
+		{
+			if (normals[candidate] == cornerNormals[i])
+			{
+				index = candidate;
+				break;
+			}
+		}
+
+		if (index == 0xFFFFFFFF)
+		{
+			index = static_cast<GLuint>(newVertices.size());
+			newVertices.push_back(vertices[v]);
+			normals.push_back(cornerNormals[i]);
+			if (!texcoords.empty())
+			{
+				newTexcoords.push_back(texcoords[v]);
+			}
+			variants[v].push_back(index);
+		}
+		elements[i] = index;
+	}
+
+	vertices.swap(newVertices);
+	texcoords.swap(newTexcoords);
+}
@@ -0,0 +1,355 @@
+#include "Mesh.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+
+using namespace std;
+
+// *********** Mesh optimisation ***********
+
+// Reorders a mesh for the GPU without changing what it looks like:
+//  1. Triangles are reordered for the post-transform vertex cache using Tipsify
+//     (Sander, Nehab & Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced
+//     Overdraw", 2007), which fans around recently used vertices.
+//  2. Tipsify's output is cut into clusters wherever it had to jump to an unconnected part of
+//     the mesh, and the clusters are sorted so that those facing out from the middle of the
+//     mesh are drawn first. Outward facing clusters tend to occlude the rest, so this cuts overdraw
+//     while leaving the cache order inside each cluster alone.
+//  3. Vertices are renumbered in the order the new index buffer first uses them, so vertex
+//     fetch walks through memory mostly sequentially.
+// Steps 1 and 2 run on each submesh of each level of detail separately, so triangles never
+// move between materials or levels.
+
+// Cache size Tipsify optimises for. Also the size of the FIFO cache used for the statistics,
+// as a typical figure for current hardware.
+static const int vertexCacheSize = 16;
+
+static const GLuint noVertex = 0xFFFFFFFF;
+
+// Vertex cache statistics from simulating a FIFO cache over elements.
+// ACMR is cache misses per triangle (0.5 is ideal for large grids, 3 is the worst case) and
+// ATVR is cache misses per vertex (1.0 means each vertex is transformed exactly once).
+struct VertexCacheStats {
+	float acmr;
+	float atvr;
+};
+
+static VertexCacheStats vertexCacheStats(const vector<GLuint>& elements, size_t vertexCount)
+{
+	vector<GLuint> fifo(vertexCacheSize, noVertex);
+	size_t head = 0;
+	size_t misses = 0;
+	for (GLuint e : elements)
+	{
+		if (find(fifo.begin(), fifo.end(), e) == fifo.end())
+		{
+			fifo[head] = e;
+			head = (head + 1) % fifo.size();
+			++misses;
+		}
+	}
+
+	VertexCacheStats stats;
+	stats.acmr = elements.empty() ? 0.0f : float(misses) / (elements.size() / 3);
+	stats.atvr = vertexCount == 0 ? 0.0f : float(misses) / vertexCount;
+	return stats;
+}
+
+// Tipsify. Returns the reordered triangles, and in clusterStarts the first triangle of each
+// run that Tipsify had to start from a vertex outside the cache.
+static vector<GLuint> tipsify(const vector<GLuint>& elements, size_t vertexCount, vector<size_t>& clusterStarts)
+{
+	size_t triangleCount = elements.size() / 3;
+	if (triangleCount == 0)
+	{
+		return vector<GLuint>();
+	}
+
+	// Triangles using each vertex, in compressed row form
+	vector<GLuint> adjacencyStart(vertexCount + 1, 0);
+	for (GLuint e : elements)
+	{
+		++adjacencyStart[e + 1];
+	}
+	partial_sum(adjacencyStart.begin(), adjacencyStart.end(), adjacencyStart.begin());
+	vector<GLuint> adjacency(elements.size());
+	vector<GLuint> fill(adjacencyStart.begin(), adjacencyStart.end() - 1);
+	for (size_t i = 0; i < elements.size(); ++i)
+	{
+		adjacency[fill[elements[i]]++] = static_cast<GLuint>(i / 3);
+	}
+
+	// Triangles not yet emitted that use each vertex
+	vector<int> liveTriangles(vertexCount);
+	for (size_t v = 0; v < vertexCount; ++v)
+	{
+		liveTriangles[v] = adjacencyStart[v + 1] - adjacencyStart[v];
+	}
+
+	vector<int> cacheTime(vertexCount, 0);
+	vector<bool> emitted(triangleCount, false);
+	vector<GLuint> deadEnd;
+	vector<GLuint> candidates;
+	vector<GLuint> output;
+	output.reserve(elements.size());
+
+	int timeStamp = vertexCacheSize + 1;
+	size_t cursor = 0;
+	GLuint fanning = 0;
+	clusterStarts.push_back(0);
+
+	while (fanning != noVertex)
+	{
+		// Emit every remaining triangle around the fanning vertex
+		candidates.clear();
+		for (GLuint k = adjacencyStart[fanning]; k < adjacencyStart[fanning + 1]; ++k)
+		{
+			GLuint t = adjacency[k];
+			if (emitted[t])
+			{
+				continue;
+			}
+			for (int c = 0; c < 3; ++c)
+			{
+				GLuint v = elements[t * 3 + c];
+				output.push_back(v);
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				--liveTriangles[v];
+				if (timeStamp - cacheTime[v] > vertexCacheSize)
+				{
+					cacheTime[v] = timeStamp++;
+				}
+			}
+			emitted[t] = true;
+		}
+
+		// Next fanning vertex: the candidate that is still in the cache and will stay in it
+		// while its remaining triangles are emitted, preferring the oldest such vertex.
+		GLuint next = noVertex;
+		int bestPriority = -1;
+		for (GLuint v : candidates)
+		{
+			if (liveTriangles[v] > 0)
+			{
+				int priority = 0;
+				if (timeStamp - cacheTime[v] + 2 * liveTriangles[v] <= vertexCacheSize)
+				{
+					priority = timeStamp - cacheTime[v];
+				}
+				if (priority > bestPriority)
+				{
+					bestPriority = priority;
+					next = v;
+				}
+			}
+		}
+
+		if (next == noVertex)
+		{
+			// Dead end. Back up through recently used vertices, and failing that take the
+			// next vertex in index order with triangles left -- a hard cluster boundary.
+			while (!deadEnd.empty() && next == noVertex)
+			{
+				GLuint v = deadEnd.back();
+				deadEnd.pop_back();
+				if (liveTriangles[v] > 0)
+				{
+					next = v;
+				}
+			}
+			while (next == noVertex && cursor < vertexCount)
+			{
+				if (liveTriangles[cursor] > 0)
+				{
+					next = static_cast<GLuint>(cursor);
+				}
+				++cursor;
+			}
+			bool cacheCold = next != noVertex && timeStamp - cacheTime[next] > vertexCacheSize;
+			if (cacheCold && output.size() / 3 != clusterStarts.back())
+			{
+				clusterStarts.push_back(output.size() / 3);
+			}
+		}
+		fanning = next;
+	}
+
+	return output;
+}
+
+// Sort the clusters of triangles so that clusters facing away from the centre of the mesh
+// are drawn first
+static vector<GLuint> sortClustersForOverdraw(const vector<GLuint>& elements, const vector<size_t>& clusterStarts,
+	const vector<glm::vec4>& vertices)
+{
+	size_t triangleCount = elements.size() / 3;
+	size_t clusterCount = clusterStarts.size();
+
+	// Area weighted centroid and summed normal of each cluster
+	vector<glm::vec3> centroids(clusterCount, glm::vec3(0.0f));
+	vector<glm::vec3> clusterNormals(clusterCount, glm::vec3(0.0f));
+	vector<float> areas(clusterCount, 0.0f);
+	glm::vec3 meshCentroid(0.0f);
+	float meshArea = 0.0f;
+
+	for (size_t c = 0; c < clusterCount; ++c)
+	{
+		size_t last = (c + 1 < clusterCount) ? clusterStarts[c + 1] : triangleCount;
+		for (size_t t = clusterStarts[c]; t < last; ++t)
+		{
+			glm::vec3 a(vertices[elements[t * 3]]);
+			glm::vec3 b(vertices[elements[t * 3 + 1]]);
+			glm::vec3 cc(vertices[elements[t * 3 + 2]]);
+			glm::vec3 n = glm::cross(b - a, cc - a);
+			float area = glm::length(n);
+			centroids[c] += (a + b + cc) * (area / 3.0f);
+			clusterNormals[c] += n;
+			areas[c] += area;
+		}
+		meshCentroid += centroids[c];
+		meshArea += areas[c];
+		if (areas[c] > 0.0f)
+		{
+			centroids[c] /= areas[c];
+		}
+	}
+	if (meshArea > 0.0f)
+	{
+		meshCentroid /= meshArea;
+	}
+
+	vector<float> keys(clusterCount, 0.0f);
+	for (size_t c = 0; c < clusterCount; ++c)
+	{
+		float length = glm::length(clusterNormals[c]);
+		if (length > 0.0f)
+		{
+			keys[c] = glm::dot(centroids[c] - meshCentroid, clusterNormals[c] / length);
+		}
+	}
+
+	vector<size_t> order(clusterCount);
+	iota(order.begin(), order.end(), 0);
+	stable_sort(order.begin(), order.end(), [&keys](size_t a, size_t b) { return keys[a] > keys[b]; });
+
+	vector<GLuint> sorted;
+	sorted.reserve(elements.size());
+	for (size_t c : order)
+	{
+		size_t last = (c + 1 < clusterCount) ? clusterStarts[c + 1] : triangleCount;
+		sorted.insert(sorted.end(), elements.begin() + clusterStarts[c] * 3, elements.begin() + last * 3);
+	}
+	return sorted;
+}
+
+// Renumber vertices in order of first use by elements. Vertices that no triangle uses are dropped.
+template <typename T>
+static void remapAttribute(vector<T>& attribute, const vector<GLuint>& remap, size_t newCount)
+{
+	if (attribute.empty())
+	{
+		return;
+	}
+	vector<T> remapped(newCount);
+	for (size_t v = 0; v < remap.size(); ++v)
+	{
+		if (remap[v] != noVertex)
+		{
+			remapped[remap[v]] = attribute[v];
+		}
+	}
+	attribute.swap(remapped);
+}
+
+void Mesh::optimise()
+{
+	if (elements.size() < 3)
+	{
+		return;
+	}
+
+	// Statistics are for the full mesh, which starts elements. The LODs follow it.
+	size_t fullCount = 0;
+	for (const Submesh& submesh : submeshes)
+	{
+		fullCount += submesh.indexCount;
+	}
+	fullCount = submeshes.empty() ? elements.size() : fullCount;
+	VertexCacheStats before = vertexCacheStats(vector<GLuint>(elements.begin(), elements.begin() + fullCount), vertices.size());
+
+	vector<IndexRange> ranges;
+	for (const MeshLod& lod : lods)
+	{
+		ranges.insert(ranges.end(), lod.ranges.begin(), lod.ranges.end());
+	}
+	if (lods.empty())
+	{
+		for (const Submesh& submesh : submeshes)
+		{
+			ranges.push_back(IndexRange{ submesh.firstIndex, submesh.indexCount });
+		}
+	}
+
+	// Tipsify's buffers are as big as the vertex numbers it is given, so each range's vertices
+	// are numbered from 0 first. Local numbers follow the global order, which Tipsify's
+	// fallback walks, and localIndex is reset only where a range set it.
+	vector<GLuint> localIndex(vertices.size(), noVertex);
+	vector<GLuint> used;
+	size_t clusterCount = 0;
+	for (const IndexRange& submesh : ranges)
+	{
+		auto first = elements.begin() + submesh.firstIndex;
+		auto last = first + submesh.indexCount;
+		used.assign(first, last);
+		sort(used.begin(), used.end());
+		used.erase(unique(used.begin(), used.end()), used.end());
+		if (used.empty())
+		{
+			continue; // A submesh simplified away at this level has nothing to reorder
+		}
+		for (size_t i = 0; i < used.size(); ++i)
+		{
+			localIndex[used[i]] = static_cast<GLuint>(i);
+		}
+
+		vector<GLuint> range(first, last);
+		for (GLuint& e : range)
+		{
+			e = localIndex[e];
+		}
+		vector<size_t> clusterStarts;
+		range = tipsify(range, used.size(), clusterStarts);
+		for (GLuint& e : range)
+		{
+			e = used[e];
+		}
+		for (GLuint v : used)
+		{
+			localIndex[v] = noVertex;
+		}
+
+		range = sortClustersForOverdraw(range, clusterStarts, vertices);
+		copy(range.begin(), range.end(), first);
+		clusterCount += clusterStarts.size();
+	}
+
+	vector<GLuint> remap(vertices.size(), noVertex);
+	GLuint newCount = 0;
+	for (GLuint& e : elements)
+	{
+		if (remap[e] == noVertex)
+		{
+			remap[e] = newCount++;
+		}
+		e = remap[e];
+	}
+	remapAttribute(vertices, remap, newCount);
+	remapAttribute(normals, remap, newCount);
+	remapAttribute(texcoords, remap, newCount);
+
+	VertexCacheStats after = vertexCacheStats(vector<GLuint>(elements.begin(), elements.begin() + fullCount), vertices.size());
+	cout << "Optimised mesh (" << clusterCount << " clusters): ACMR " << before.acmr << " -> " << after.acmr
+		<< ", ATVR " << before.atvr << " -> " << after.atvr << endl;
+}
@@ -0,0 +1,172 @@
+#include "Mesh.hpp"
+
+#include "Libs\glm-0.9.8.4\glm\glm\gtc\packing.hpp"
+
+#include <cstring>
+#include <cmath>
+
+using namespace std;
+
+// *********** Vertex formats ***********
+
+// Mesh keeps its vertices as floats on the CPU, and converts them to the chosen
+// PositionFormat / NormalFormat only when building the buffers for the GPU.
+//
+// Half and Snorm16 positions are stored relative to the mesh's bounding box, mapped onto
+// [-1, 1] on each axis, which is where both formats are most precise. The vertex shader
+// turns them back into model space with positionScale and positionOffset.
+//
+// Octahedral normals fold the unit sphere onto a square (Cigolle et al., "A Survey of
+// Efficient Representations for Independent Unit Vectors", 2014) and are decoded in the
+// vertex shader. 2_10_10_10 normals are decoded by the vertex fetch hardware.
+
+void Mesh::computeBounds()
+{
+	boundsMin = glm::vec3(0.0f);
+	boundsMax = glm::vec3(0.0f);
+	if (!vertices.empty())
+	{
+		boundsMin = boundsMax = glm::vec3(vertices[0]);
+		for (const glm::vec4& v : vertices)
+		{
+			boundsMin = glm::min(boundsMin, glm::vec3(v));
+			boundsMax = glm::max(boundsMax, glm::vec3(v));
+		}
+	}
+
+	if (positionFormat == PositionFormat::Float)
+	{
+		positionScale = glm::vec3(1.0f);
+		positionOffset = glm::vec3(0.0f);
+	}
+	else
+	{
+		// Avoid a zero scale for flat meshes, it would divide by zero in packPositions
+		positionOffset = (boundsMin + boundsMax) * 0.5f;
+		positionScale = glm::max((boundsMax - boundsMin) * 0.5f, glm::vec3(1e-6f));
+	}
+}
+
+// Write the raw bytes of value to out, returning where the next value goes
+template <typename T>
+static GLubyte* store(GLubyte* out, const T& value)
+{
+	memcpy(out, &value, sizeof(T));
+	return out + sizeof(T);
+}
+
+// Map a unit vector onto the [-1, 1] square
+static glm::vec2 octahedralEncode(glm::vec3 n)
+{
+	n /= (fabsf(n.x) + fabsf(n.y) + fabsf(n.z));
+	glm::vec2 p(n.x, n.y);
+	if (n.z < 0.0f)
+	{
+		p = glm::vec2((1.0f - fabsf(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f),
+			(1.0f - fabsf(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f));
+	}
+	return p;
+}
+
+void Mesh::packVertices(GLubyte* out) const
+{
+	GLsizei stride = vertexStride();
+	GLsizei normalOffset = normalAttribute().offset;
+	GLsizei texcoordOffset = texcoordAttribute().offset;
+	for (size_t i = 0; i < vertices.size(); ++i, out += stride)
+	{
+		const glm::vec4& v = vertices[i];
+		if (positionFormat == PositionFormat::Float)
+		{
+			store(out, v);
+		}
+		else
+		{
+			glm::vec4 q((glm::vec3(v) - positionOffset) / positionScale, 1.0f);
+			if (positionFormat == PositionFormat::Half)
+			{
+				store(out, glm::packHalf4x16(q));
+			}
+			else
+			{
+				store(out, glm::packSnorm4x16(q));
+			}
+		}
+
+		glm::vec3 n = i < normals.size() ? normals[i] : glm::vec3(0.0f);
+		switch (normalFormat)
+		{
+		case NormalFormat::Int2_10_10_10:
+			store(out + normalOffset, glm::packSnorm3x10_1x2(glm::vec4(n, 0.0f)));
+			break;
+		case NormalFormat::Octahedral:
+			store(out + normalOffset, glm::packSnorm2x16(n == glm::vec3(0.0f) ? glm::vec2(0.0f) : octahedralEncode(n)));
+			break;
+		default:
+			store(out + normalOffset, n);
+			break;
+		}
+
+		if (!texcoords.empty())
+		{
+			store(out + texcoordOffset, texcoords[i]);
+		}
+	}
+}
+
+// Bytes each format takes in a vertex
+static GLsizei positionSize(PositionFormat format)
+{
+	return format == PositionFormat::Float ? sizeof(glm::vec4) : 4 * sizeof(GLshort);
+}
+
+static GLsizei normalSize(NormalFormat format)
+{
+	switch (format)
+	{
+	case NormalFormat::Int2_10_10_10:
+		return sizeof(GLuint);
+	case NormalFormat::Octahedral:
+		return 2 * sizeof(GLshort);
+	default:
+		return sizeof(glm::vec3);
+	}
+}
+
+GLsizei Mesh::vertexStride() const
+{
+	return positionSize(positionFormat) + normalSize(normalFormat) + (texcoords.empty() ? 0 : sizeof(glm::vec2));
+}
+
+VertexAttribute Mesh::positionAttribute() const
+{
+	switch (positionFormat)
+	{
+	case PositionFormat::Half:
+		return VertexAttribute{ 4, GL_HALF_FLOAT, GL_FALSE, vertexStride(), 0 };
+	case PositionFormat::Snorm16:
+		return VertexAttribute{ 4, GL_SHORT, GL_TRUE, vertexStride(), 0 };
+	default:
+		return VertexAttribute{ 4, GL_FLOAT, GL_FALSE, vertexStride(), 0 };
+	}
+}
+
+VertexAttribute Mesh::normalAttribute() const
+{
+	GLsizei offset = positionSize(positionFormat);
+	switch (normalFormat)
+	{
+	case NormalFormat::Int2_10_10_10:
+		return VertexAttribute{ 4, GL_INT_2_10_10_10_REV, GL_TRUE, vertexStride(), offset };
+	case NormalFormat::Octahedral:
+		return VertexAttribute{ 2, GL_SHORT, GL_TRUE, vertexStride(), offset };
+	default:
+		return VertexAttribute{ 3, GL_FLOAT, GL_FALSE, vertexStride(), offset };
+	}
+}
+
+VertexAttribute Mesh::texcoordAttribute() const
+{
+	GLsizei offset = positionSize(positionFormat) + normalSize(normalFormat);
+	return VertexAttribute{ texcoords.empty() ? 0 : 2, GL_FLOAT, GL_FALSE, vertexStride(), offset };
+}
@@ -0,0 +1,161 @@
+#include "Mesh.hpp"
+
+#include "ObjParser.hpp"
+
+#include <cstdint>
+
+using namespace std;
+
+// *********** Vertex welding ***********
+
+// OBJ faces index positions, texcoords and normals separately, whereas OpenGL needs one
+// index per vertex. Every distinct (position, texcoord, normal) triple used by a face corner
+// becomes one vertex in the Mesh, and corners that repeat a triple share the vertex.
+
+static inline size_t hashCorner(const ObjCorner& corner)
+{
+	uint64_t h = corner.vertex;
+	h = h * 0x9E3779B97F4A7C15ull ^ corner.texcoord;
+	h = h * 0xC2B2AE3D27D4EB4Full ^ corner.normal;
+	h ^= h >> 32;
+	h *= 0x165667B19E3779F9ull;
+	h ^= h >> 29;
+	return static_cast<size_t>(h);
+}
+
+static inline bool operator==(const ObjCorner& a, const ObjCorner& b)
+{
+	return a.vertex == b.vertex && a.texcoord == b.texcoord && a.normal == b.normal;
+}
+
+static const GLuint emptySlot = 0xFFFFFFFF;
+
+// Open addressing (linear probing) hash table from corner to vertex index. Slots hold only
+// the vertex index, the corner itself is looked up in the list of unique corners, which
+// keeps the table at four bytes per slot.
+class CornerTable {
+public:
+	explicit CornerTable(size_t expectedCount)
+		: mCount(0)
+	{
+		resize(expectedCount * 2);
+	}
+
+	// Return the vertex index of a corner equal to key, adding key to uniqueCorners first if
+	// it has not been seen before.
+	GLuint findOrInsert(const ObjCorner& key, vector<ObjCorner>& uniqueCorners)
+	{
+		size_t slot = hashCorner(key) & mMask;
+		while (mSlots[slot] != emptySlot)
+		{
+			if (uniqueCorners[mSlots[slot]] == key)
+			{
+				return mSlots[slot];
+			}
+			slot = (slot + 1) & mMask;
+		}
+
+		GLuint index = static_cast<GLuint>(uniqueCorners.size());
+		uniqueCorners.push_back(key);
+		mSlots[slot] = index;
+
+		// Keep the load factor under a half so probe sequences stay short
+		if (++mCount * 2 > mSlots.size())
+		{
+			rehash(uniqueCorners);
+		}
+		return index;
+	}
+
+private:
+	void resize(size_t minimumSize)
+	{
+		size_t size = 64;
+		while (size < minimumSize)
+		{
+			size *= 2;
+		}
+		mSlots.assign(size, emptySlot);
+		mMask = size - 1;
+	}
+
+	void rehash(const vector<ObjCorner>& uniqueCorners)
+	{
+		resize(mSlots.size() * 2);
+		for (size_t i = 0; i < uniqueCorners.size(); ++i)
+		{
+			size_t slot = hashCorner(uniqueCorners[i]) & mMask;
+			while (mSlots[slot] != emptySlot)
+			{
+				slot = (slot + 1) & mMask;
+			}
+			mSlots[slot] = static_cast<GLuint>(i);
+		}
+	}
+
+	vector<GLuint> mSlots;
+	size_t mMask;
+	size_t mCount;
+};
+
+void Mesh::weld(const ObjData& obj)
+{
+	// Authored normals are only used if every corner has one. Otherwise computeNormals will
+	// generate normals for the whole mesh, so normal indices are left out of the key where
+	// they would only split vertices for nothing.
+	bool useNormals = !obj.corners.empty();
+	bool useTexcoords = false;
+	for (const ObjCorner& corner : obj.corners)
+	{
+		useNormals = useNormals && corner.normal < obj.normals.size();
+		useTexcoords = useTexcoords || corner.texcoord < obj.texcoords.size();
+	}
+
+	// Most meshes end up with roughly one vertex per position, so size the table for that
+	vector<ObjCorner> uniqueCorners;
+	uniqueCorners.reserve(obj.vertices.size());
+	CornerTable table(obj.vertices.size());
+
+	elements.clear();
+	elements.reserve(obj.corners.size());
+	for (ObjCorner key : obj.corners)
+	{
+		if (!useNormals)
+		{
+			key.normal = objNoIndex;
+		}
+		if (!useTexcoords)
+		{
+			key.texcoord = objNoIndex;
+		}
+		elements.push_back(table.findOrInsert(key, uniqueCorners));
+	}
+
+	// Gather the attributes of each unique corner. Indices that point outside the file's
+	// records (a malformed file) give a default value rather than reading out of bounds.
+	vertices.resize(uniqueCorners.size());
+	normals.clear();
+	texcoords.clear();
+	if (useNormals)
+	{
+		normals.resize(uniqueCorners.size());
+	}
+	if (useTexcoords)
+	{
+		texcoords.resize(uniqueCorners.size());
+	}
+
+	for (size_t i = 0; i < uniqueCorners.size(); ++i)
+	{
+		const ObjCorner& corner = uniqueCorners[i];
+		vertices[i] = corner.vertex < obj.vertices.size() ? obj.vertices[corner.vertex] : glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+		if (useNormals)
+		{
+			normals[i] = obj.normals[corner.normal];
+		}
+		if (useTexcoords)
+		{
+			texcoords[i] = corner.texcoord < obj.texcoords.size() ? obj.texcoords[corner.texcoord] : glm::vec2(0.0f, 0.0f);
+		}
+	}
+}
@@ -0,0 +1,506 @@
+#include "ObjParser.hpp"
+
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <thread>
+#include <algorithm>
+
+using namespace std;
+
+// *********** Number parsing ***********
+
+// Every power of ten up to 1e22 is exactly representable as a double, so scaling an
+// integer mantissa by one of these only rounds once.
+static const double powersOf10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static inline bool isSpace(char c)
+{
+	// '\r' is treated as white space so that files with Windows line endings work too
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char* skipSpace(const char* p, const char* last)
+{
+	while (p < last && isSpace(*p))
+	{
+		++p;
+	}
+	return p;
+}
+
+const char* parseFloat(const char* first, const char* last, float& value)
+{
+	const char* p = first;
+
+	bool negative = false;
+	if (p < last && (*p == '-' || *p == '+'))
+	{
+		negative = (*p == '-');
+		++p;
+	}
+
+	// Accumulate up to 19 significant digits into an integer mantissa (that is as many as
+	// fit in 64 bits) and track the decimal exponent separately.
+	uint64_t mantissa = 0;
+	int significantDigits = 0;
+	int exponent = 0;
+	bool sawDigit = false;
+
+	while (p < last && isDigit(*p))
+	{
+		if (significantDigits < 19)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa != 0)
+			{
+				++significantDigits;
+			}
+		}
+		else
+		{
+			++exponent; // Digit dropped from the integer part, scale up instead
+		}
+		sawDigit = true;
+		++p;
+	}
+
+	if (p < last && *p == '.')
+	{
+		++p;
+		while (p < last && isDigit(*p))
+		{
+			if (significantDigits < 19)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa != 0)
+				{
+					++significantDigits;
+				}
+				--exponent;
+			}
+			sawDigit = true;
+			++p;
+		}
+	}
+
+	if (!sawDigit)
+	{
+		return first;
+	}
+
+	// Optional exponent. Only consumed if it is well formed, so "1e" parses as 1 followed by "e".
+	if (p < last && (*p == 'e' || *p == 'E'))
+	{
+		const char* e = p + 1;
+		bool negativeExponent = false;
+		if (e < last && (*e == '-' || *e == '+'))
+		{
+			negativeExponent = (*e == '-');
+			++e;
+		}
+		if (e < last && isDigit(*e))
+		{
+			int explicitExponent = 0;
+			while (e < last && isDigit(*e))
+			{
+				if (explicitExponent < 10000)
+				{
+					explicitExponent = explicitExponent * 10 + (*e - '0');
+				}
+				++e;
+			}
+			exponent += negativeExponent ? -explicitExponent : explicitExponent;
+			p = e;
+		}
+	}
+
+	double result = static_cast<double>(mantissa);
+	if (exponent < 0 && exponent >= -22)
+	{
+		// Divide rather than multiply by 1e-n, as 1e-n is not exact in binary
+		result /= powersOf10[-exponent];
+	}
+	else if (exponent > 0 && exponent <= 22)
+	{
+		result *= powersOf10[exponent];
+	}
+	else if (exponent != 0)
+	{
+		result *= pow(10.0, exponent);
+	}
+
+	value = static_cast<float>(negative ? -result : result);
+	return p;
+}
+
+const char* parseInt(const char* first, const char* last, int& value)
+{
+	const char* p = first;
+
+	bool negative = false;
+	if (p < last && (*p == '-' || *p == '+'))
+	{
+		negative = (*p == '-');
+		++p;
+	}
+
+	if (p == last || !isDigit(*p))
+	{
+		return first;
+	}
+
+	int result = 0;
+	while (p < last && isDigit(*p))
+	{
+		result = result * 10 + (*p - '0');
+		++p;
+	}
+
+	value = negative ? -result : result;
+	return p;
+}
+
+// *********** OBJ records ***********
+
+// Turn an OBJ index into a 0-based array index. OBJ indices count from 1, negative values
+// count backwards from the most recent record of the same kind, and 0 means the index was
+// left out. Relative indices are noted in the given list (see ObjData).
+static inline GLuint resolveIndex(int index, size_t recordCount, vector<size_t>& relative, size_t corner)
+{
+	if (index < 0)
+	{
+		relative.push_back(corner);
+		return static_cast<GLuint>(static_cast<int>(recordCount) + index);
+	}
+	if (index == 0)
+	{
+		return objNoIndex;
+	}
+	return static_cast<GLuint>(index - 1);
+}
+
+// Face corner as written in the file, before resolveIndex
+struct RawCorner {
+	int vertex, texcoord, normal;
+};
+
+static void pushCorner(const RawCorner& raw, ObjData& out)
+{
+	size_t corner = out.corners.size();
+	ObjCorner resolved;
+	resolved.vertex = resolveIndex(raw.vertex, out.vertices.size(), out.relativeVertices, corner);
+	resolved.texcoord = resolveIndex(raw.texcoord, out.texcoords.size(), out.relativeTexcoords, corner);
+	resolved.normal = resolveIndex(raw.normal, out.normals.size(), out.relativeNormals, corner);
+	out.corners.push_back(resolved);
+}
+
+static void parseVertex(const char* p, const char* eol, ObjData& out)
+{
+	glm::vec4 v(0.0f, 0.0f, 0.0f, 1.0f);
+	p = parseFloat(skipSpace(p, eol), eol, v.x);
+	p = parseFloat(skipSpace(p, eol), eol, v.y);
+	parseFloat(skipSpace(p, eol), eol, v.z);
+	out.vertices.push_back(v);
+}
+
+static void parseNormal(const char* p, const char* eol, ObjData& out)
+{
+	glm::vec3 n(0.0f, 0.0f, 0.0f);
+	p = parseFloat(skipSpace(p, eol), eol, n.x);
+	p = parseFloat(skipSpace(p, eol), eol, n.y);
+	parseFloat(skipSpace(p, eol), eol, n.z);
+	out.normals.push_back(n);
+}
+
+static void parseTexcoord(const char* p, const char* eol, ObjData& out)
+{
+	glm::vec2 t(0.0f, 0.0f);
+	p = parseFloat(skipSpace(p, eol), eol, t.x);
+	parseFloat(skipSpace(p, eol), eol, t.y);
+	out.texcoords.push_back(t);
+}
+
+static void parseFace(const char* p, const char* eol, ObjData& out)
+{
+	// Each corner is one of "v", "v/vt", "v//vn" or "v/vt/vn". Missing parts are left as 0,
+	// which resolveIndex turns into objNoIndex.
+	RawCorner firstCorner = {}, previousCorner = {};
+	int corners = 0;
+
+	while (true)
+	{
+		p = skipSpace(p, eol);
+		if (p == eol)
+		{
+			break;
+		}
+
+		RawCorner corner = {};
+		const char* next = parseInt(p, eol, corner.vertex);
+		if (next == p)
+		{
+			break; // Not an index -- give up on the rest of the line
+		}
+
+		p = next;
+		if (p < eol && *p == '/')
+		{
+			p = parseInt(p + 1, eol, corner.texcoord); // Leaves p alone for "v//vn"
+			if (p < eol && *p == '/')
+			{
+				p = parseInt(p + 1, eol, corner.normal);
+			}
+		}
+		while (p < eol && !isSpace(*p))
+		{
+			++p;
+		}
+
+		// Relative indices are resolved against the records seen so far, so corners are
+		// resolved as they are pushed for the relative index bookkeeping to line up.
+		if (corners == 0)
+		{
+			firstCorner = corner;
+		}
+		else if (corners >= 2)
+		{
+			pushCorner(firstCorner, out);
+			pushCorner(previousCorner, out);
+			pushCorner(corner, out);
+		}
+		previousCorner = corner;
+		++corners;
+	}
+}
+
+static bool startsWith(const char* p, const char* eol, const char* keyword)
+{
+	size_t length = strlen(keyword);
+	return static_cast<size_t>(eol - p) > length && memcmp(p, keyword, length) == 0 && isSpace(p[length]);
+}
+
+// The argument of a keyword line such as "mtllib name.mtl", without surrounding spaces
+static string lineArgument(const char* p, const char* eol)
+{
+	const char* argument = skipSpace(p, eol);
+	while (eol > argument && isSpace(eol[-1]))
+	{
+		--eol;
+	}
+	return string(argument, eol);
+}
+
+static void parseLine(const char* p, const char* eol, ObjData& out)
+{
+	if (p == eol)
+	{
+		return;
+	}
+
+	switch (*p)
+	{
+	case 'v':
+		if (p + 1 < eol && isSpace(p[1]))
+		{
+			parseVertex(p + 1, eol, out);
+		}
+		else if (p + 2 < eol && p[1] == 'n' && isSpace(p[2]))
+		{
+			parseNormal(p + 2, eol, out);
+		}
+		else if (p + 2 < eol && p[1] == 't' && isSpace(p[2]))
+		{
+			parseTexcoord(p + 2, eol, out);
+		}
+		break;
+	case 'f':
+		if (p + 1 < eol && isSpace(p[1]))
+		{
+			parseFace(p + 1, eol, out);
+		}
+		break;
+	case 'm':
+		if (startsWith(p, eol, "mtllib"))
+		{
+			out.mtlLib = lineArgument(p + 6, eol);
+		}
+		break;
+	case 'u':
+		if (startsWith(p, eol, "usemtl"))
+		{
+			out.useMtl.push_back(ObjUseMtl{ lineArgument(p + 6, eol), out.corners.size() });
+		}
+		break;
+	default:
+		// Comments, groups, smoothing groups etc. are ignored
+		break;
+	}
+}
+
+// Size out's arrays for the records in [first, last) before parsing them, so they are
+// allocated once rather than grown (and copied) a push_back at a time. This only looks at
+// the first characters of each line, so it costs a small fraction of the parse. Faces are
+// counted as triangles; polygons with more corners just grow corners past the estimate.
+static void reserveRecords(const char* first, const char* last, ObjData& out)
+{
+	size_t vertices = 0, normals = 0, texcoords = 0, faces = 0;
+	const char* p = first;
+	while (p < last)
+	{
+		p = skipSpace(p, last);
+		if (last - p >= 3)
+		{
+			if (p[0] == 'v')
+			{
+				vertices += isSpace(p[1]);
+				normals += p[1] == 'n' && isSpace(p[2]);
+				texcoords += p[1] == 't' && isSpace(p[2]);
+			}
+			else if (p[0] == 'f')
+			{
+				faces += isSpace(p[1]);
+			}
+		}
+
+		const char* eol = static_cast<const char*>(memchr(p, '\n', last - p));
+		p = (eol == nullptr) ? last : eol + 1;
+	}
+
+	out.vertices.reserve(out.vertices.size() + vertices);
+	out.normals.reserve(out.normals.size() + normals);
+	out.texcoords.reserve(out.texcoords.size() + texcoords);
+	out.corners.reserve(out.corners.size() + faces * 3);
+}
+
+void parseObj(const char* first, const char* last, ObjData& out)
+{
+	reserveRecords(first, last, out);
+
+	const char* p = first;
+	while (p < last)
+	{
+		const char* eol = static_cast<const char*>(memchr(p, '\n', last - p));
+		if (eol == nullptr)
+		{
+			eol = last;
+		}
+
+		parseLine(skipSpace(p, eol), eol, out);
+		p = eol + 1;
+	}
+}
+
+// *********** Parallel parsing ***********
+
+// Copy one parsed chunk into its slot of the merged result. The offsets are the number of
+// records of each kind in all of the earlier chunks.
+static void mergeChunk(const ObjData& chunk, ObjData& out,
+	size_t vertexOffset, size_t normalOffset, size_t texcoordOffset, size_t cornerOffset)
+{
+	copy(chunk.vertices.begin(), chunk.vertices.end(), out.vertices.begin() + vertexOffset);
+	copy(chunk.normals.begin(), chunk.normals.end(), out.normals.begin() + normalOffset);
+	copy(chunk.texcoords.begin(), chunk.texcoords.end(), out.texcoords.begin() + texcoordOffset);
+	copy(chunk.corners.begin(), chunk.corners.end(), out.corners.begin() + cornerOffset);
+
+	// Relative indices were resolved against this chunk's records only. The arithmetic wraps
+	// in the same way as GLuint so indices that pointed back into an earlier chunk come out right.
+	for (size_t i : chunk.relativeVertices)
+	{
+		out.corners[cornerOffset + i].vertex += static_cast<GLuint>(vertexOffset);
+	}
+	for (size_t i : chunk.relativeTexcoords)
+	{
+		out.corners[cornerOffset + i].texcoord += static_cast<GLuint>(texcoordOffset);
+	}
+	for (size_t i : chunk.relativeNormals)
+	{
+		out.corners[cornerOffset + i].normal += static_cast<GLuint>(normalOffset);
+	}
+}
+
+void parseObjParallel(const char* first, const char* last, ObjData& out, unsigned threadCount)
+{
+	if (threadCount == 0)
+	{
+		threadCount = max(1u, thread::hardware_concurrency());
+	}
+
+	size_t size = last - first;
+	if (threadCount == 1 || size < parallelThreshold || !out.vertices.empty())
+	{
+		// Small files (and appending to data that already exists) take the serial path
+		parseObj(first, last, out);
+		return;
+	}
+
+	// Split into roughly equal chunks, moving each split point forward to the start of the
+	// next line so that no record is cut in half.
+	vector<const char*> bounds(threadCount + 1);
+	bounds[0] = first;
+	bounds[threadCount] = last;
+	for (unsigned i = 1; i < threadCount; ++i)
+	{
+		const char* p = max(bounds[i - 1], first + size / threadCount * i);
+		const char* eol = static_cast<const char*>(memchr(p, '\n', last - p));
+		bounds[i] = (eol == nullptr) ? last : eol + 1;
+	}
+
+	vector<ObjData> chunks(threadCount);
+	vector<thread> workers;
+	for (unsigned i = 0; i < threadCount; ++i)
+	{
+		workers.emplace_back([&, i]() { parseObj(bounds[i], bounds[i + 1], chunks[i]); });
+	}
+	for (thread& worker : workers)
+	{
+		worker.join();
+	}
+	workers.clear();
+
+	// Work out where each chunk lands in the merged arrays, then copy them all in parallel.
+	vector<size_t> vertexOffsets(threadCount + 1, 0), normalOffsets(threadCount + 1, 0);
+	vector<size_t> texcoordOffsets(threadCount + 1, 0), cornerOffsets(threadCount + 1, 0);
+	for (unsigned i = 0; i < threadCount; ++i)
+	{
+		vertexOffsets[i + 1] = vertexOffsets[i] + chunks[i].vertices.size();
+		normalOffsets[i + 1] = normalOffsets[i] + chunks[i].normals.size();
+		texcoordOffsets[i + 1] = texcoordOffsets[i] + chunks[i].texcoords.size();
+		cornerOffsets[i + 1] = cornerOffsets[i] + chunks[i].corners.size();
+
+		if (out.mtlLib.empty())
+		{
+			out.mtlLib = chunks[i].mtlLib;
+		}
+		for (const ObjUseMtl& useMtl : chunks[i].useMtl)
+		{
+			out.useMtl.push_back(ObjUseMtl{ useMtl.name, cornerOffsets[i] + useMtl.firstCorner });
+		}
+	}
+
+	out.vertices.resize(vertexOffsets[threadCount]);
+	out.normals.resize(normalOffsets[threadCount]);
+	out.texcoords.resize(texcoordOffsets[threadCount]);
+	out.corners.resize(cornerOffsets[threadCount]);
+
+	for (unsigned i = 0; i < threadCount; ++i)
+	{
+		workers.emplace_back([&, i]() {
+			mergeChunk(chunks[i], out, vertexOffsets[i], normalOffsets[i], texcoordOffsets[i], cornerOffsets[i]);
+			// Free each chunk as soon as it has been merged to keep peak memory down
+			chunks[i] = ObjData();
+		});
+	}
+	for (thread& worker : workers)
+	{
+		worker.join();
+	}
+}
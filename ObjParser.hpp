@@ -0,0 +1,69 @@
+#pragma once
+/***
+description: Allocation free OBJ tokenizer. Works directly on a block of chars (normally
+a MappedFile) rather than on lines pulled out with getline, and parses numbers in place
+in the style of std::from_chars instead of building an istringstream per line.
+***/
+
+#ifndef OBJ_PARSER_HPP
+#define OBJ_PARSER_HPP
+
+#include "Libs\glew-2.0.0-win32\glew-2.0.0\include\GL\glew.h"
+#include "Libs\glm-0.9.8.4\glm\glm\glm.hpp"
+
+#include <vector>
+#include <string>
+
+// Marks a component missing from a face corner, eg the texcoord in "f 1//3 4//2 9//3"
+const GLuint objNoIndex = 0xFFFFFFFF;
+
+// One corner of a face. Each index has already been converted from OBJ's 1-based numbering
+// to a 0-based index into ObjData's vertices, texcoords or normals.
+struct ObjCorner {
+	GLuint vertex;
+	GLuint texcoord;
+	GLuint normal;
+};
+
+// A "usemtl" line: the faces from firstCorner / 3 up to the next ObjUseMtl use material name
+struct ObjUseMtl {
+	std::string name;
+	size_t firstCorner;
+};
+
+// Everything Mesh needs out of an OBJ file
+struct ObjData {
+	std::vector<glm::vec4> vertices;
+	std::vector<glm::vec3> normals;   // "vn" records, in file order
+	std::vector<glm::vec2> texcoords; // "vt" records, in file order
+	std::vector<ObjCorner> corners;   // Three per triangle
+	std::string mtlLib; // Name following "mtllib", exactly as written in the file
+	std::vector<ObjUseMtl> useMtl; // In file order. Faces before the first one have no material.
+
+	// Positions in corners whose vertex, texcoord or normal came from a negative (relative)
+	// OBJ index. When a file is parsed in chunks these are resolved against the chunk's own
+	// records, so they need shifting by the record counts of the earlier chunks once the
+	// chunks are merged.
+	std::vector<size_t> relativeVertices;
+	std::vector<size_t> relativeTexcoords;
+	std::vector<size_t> relativeNormals;
+};
+
+// Parse a number from [first, last) and return a pointer to the first character that
+// was not consumed. If there is no number at first then first is returned and value is
+// left unchanged, so callers can compare the result with first to detect failure.
+const char* parseFloat(const char* first, const char* last, float& value);
+const char* parseInt(const char* first, const char* last, int& value);
+
+// Tokenize the OBJ text in [first, last), appending the results to out.
+// Faces with more than three corners are triangulated as a fan around the first corner.
+void parseObj(const char* first, const char* last, ObjData& out);
+
+// As parseObj, but splits the text into chunks at line boundaries and tokenizes each chunk
+// on its own thread before merging the results in file order. threadCount == 0 means use
+// every hardware thread. Input smaller than parallelThreshold is parsed serially since
+// starting the threads would cost more than the parse itself.
+const size_t parallelThreshold = 1 << 20;
+void parseObjParallel(const char* first, const char* last, ObjData& out, unsigned threadCount = 0);
+
+#endif // OBJ_PARSER_HPP
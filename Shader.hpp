@@ -11,18 +11,50 @@ Attributes and uniforms are stored in <string, int> maps and can be added
 via calls to addAttribute(<name-of-attribute>) and then the attribute
 index can be obtained via myProgram.attribute(<name-of-attribute>) - Uniforms
 work in the exact same way.
+
+Looking a name up walks a map and builds a string, so code setting uniforms
+every frame should look them up once, after the program is built, with
+myProgram.uniformHandle<type>(<name-of-uniform>), and set them through the
+Uniform handle it returns. Uniform blocks are connected to a binding point with
+bindUniformBlock(<name-of-block>, <binding-point>) and filled from a buffer, see
+UniformBuffer.hpp. Shaders loaded from files can share code with
+#include "<file>", resolved relative to the including file.
 ***/
 
 #ifndef SHADER_PROGRAM_HPP
 #define SHADER_PROGRAM_HPP
 
 #include "Libs\glew-2.0.0-win32\glew-2.0.0\include\GL\glew.h"
+#include "Libs\glm-0.9.8.4\glm\glm\glm.hpp"
+
+#include "AssetPack.hpp"
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <map>
 
+// Sets a uniform of the current program, choosing the glUniform call from the type
+inline void setUniform(GLint location, GLint value) { glUniform1i(location, value); }
+inline void setUniform(GLint location, GLfloat value) { glUniform1f(location, value); }
+inline void setUniform(GLint location, const glm::vec3& value) { glUniform3fv(location, 1, &value[0]); }
+inline void setUniform(GLint location, const glm::vec4& value) { glUniform4fv(location, 1, &value[0]); }
+inline void setUniform(GLint location, const glm::mat4& value) { glUniformMatrix4fv(location, 1, GL_FALSE, &value[0][0]); }
+
+// The location of a uniform of type T, resolved once by ShaderProgram::uniformHandle. Setting
+// a value through it is a single glUniform call.
+template <typename T>
+class Uniform
+{
+public:
+	Uniform() : location(-1) {}
+	explicit Uniform(GLint location) : location(location) {}
+
+	void set(const T& value) const { setUniform(location, value); }
+
+	GLint location;
+};
+
 class ShaderProgram
 {
 private:
@@ -171,11 +203,19 @@ private:
 		initialised = true;
 	}
 
-	// Private method to load the shader source code from a file
-	std::string loadShaderFromFile(const std::string filename)
+	// Private method to load the shader source code from a file. Lines of the form
+	// #include "name" are replaced by that file, looked up next to the one including it, so
+	// shaders can share code (GLSL has no #include of its own). #line directives keep the
+	// compiler's line numbers right, with the source string number giving the include depth.
+	std::string loadShaderFromFile(const std::string filename, int depth = 0)
 	{
-		// Create an input filestream and attempt to open the specified file
-		std::ifstream file(filename.c_str());
+		if (depth > 8)
+		{
+			throw std::runtime_error("Shader includes nested too deeply: " + filename);
+		}
+
+		// Open the file, from the asset pack if it is in there
+		AssetStream file(filename);
 
 		// If we couldn't open the file we'll bail out
 		if (!file.good())
@@ -183,14 +223,38 @@ private:
 			throw std::runtime_error("Failed to open file: " + filename);
 		}
 
-		// Otherwise, create a string stream...
+		// Included files are relative to the directory of this one
+		size_t slash = filename.find_last_of("/\\");
+		std::string directory = slash == std::string::npos ? "" : filename.substr(0, slash + 1);
+
+		// Create a string stream...
 		std::stringstream stream;
 
-		// ...and dump the contents of the file into it.
-		stream << file.rdbuf();
+		// ...and copy the file into it a line at a time, expanding includes
+		std::string line;
+		int lineNumber = 0;
+		while (std::getline(file, line))
+		{
+			lineNumber++;
+
+			size_t start = line.find_first_not_of(" \t");
+			if (start == std::string::npos || line.compare(start, 8, "#include") != 0)
+			{
+				stream << line << '\n';
+				continue;
+			}
+
+			size_t open = line.find('"', start + 8);
+			size_t close = open == std::string::npos ? open : line.find('"', open + 1);
+			if (close == std::string::npos)
+			{
+				throw std::runtime_error("Malformed #include in " + filename + ": " + line);
+			}
 
-		// Now that we've read the file we can close it
-		file.close();
+			stream << "#line 1 " << depth + 1 << '\n';
+			stream << loadShaderFromFile(directory + line.substr(open + 1, close - open - 1), depth + 1);
+			stream << "#line " << lineNumber + 1 << ' ' << depth << '\n';
+		}
 
 		// Finally, convert the stringstream into a string and return it
 		return stream.str();
@@ -304,12 +368,9 @@ public:
 		// value which will likely cause the program to segfault. So we're making sure
 		// the attribute asked for exists, and if it doesn't then we alert the user & bail.
 
-		// Create an iterator to look through our attribute map (only create iterator on first run -
-		// reuse it for all further calls).
-		static std::map<std::string, int>::const_iterator attributeIter;
-
-		// Try to find the named attribute
-		attributeIter = attributeMap.find(attributeName);
+		// Try to find the named attribute. The iterator is local, so lookups on two threads
+		// don't trample each other.
+		std::map<std::string, int>::const_iterator attributeIter = attributeMap.find(attributeName);
 
 		// Not found? Bail.
 		if (attributeIter == attributeMap.end())
@@ -317,8 +378,8 @@ public:
 			throw std::runtime_error("Could not find attribute in shader program: " + attributeName);
 		}
 
-		// Otherwise return the attribute location from the attribute map
-		return attributeMap[attributeName];
+		// Otherwise return the attribute location we found, without looking it up again
+		return attributeIter->second;
 	}
 
 	// Method to returns the bound location of a named uniform
@@ -330,12 +391,8 @@ public:
 		//
 		// But we're not doing that. Explanation in the attribute() method above.
 
-		// Create an iterator to look through our uniform map (only create iterator on first run -
-		// reuse it for all further calls).
-		static std::map<std::string, int>::const_iterator uniformIter;
-
 		// Try to find the named uniform
-		uniformIter = uniformMap.find(uniformName);
+		std::map<std::string, int>::const_iterator uniformIter = uniformMap.find(uniformName);
 
 		// Found it? Great - pass it back! Didn't find it? Alert user and halt.
 		if (uniformIter == uniformMap.end())
@@ -343,8 +400,16 @@ public:
 			throw std::runtime_error("Could not find uniform in shader program: " + uniformName);
 		}
 
-		// Otherwise return the attribute location from the uniform map
-		return uniformMap[uniformName];
+		// Otherwise return the uniform location we found
+		return uniformIter->second;
+	}
+
+	// Method to return a typed handle for a uniform added with addUniform, for setting it
+	// without looking the name up again. Throws like uniform() if it wasn't added.
+	template <typename T>
+	Uniform<T> uniformHandle(const std::string uniformName)
+	{
+		return Uniform<T>(uniform(uniformName));
 	}
 
 	// Method to add an attribute to the shader and return the bound location
@@ -393,6 +458,24 @@ public:
 		return uniformMap[uniformName];
 	}
 
+	// Method to connect a uniform block to a binding point, where glBindBufferRange supplies
+	// its contents. Unlike a uniform's location, the binding is chosen by the caller, so
+	// there is nothing to store.
+	void bindUniformBlock(const std::string blockName, GLuint bindingPoint)
+	{
+		GLuint blockIndex = glGetUniformBlockIndex(programId, blockName.c_str());
+		if (blockIndex == GL_INVALID_INDEX)
+		{
+			throw std::runtime_error("Could not bind uniform block: " + blockName + " - not found in the program.");
+		}
+		glUniformBlockBinding(programId, blockIndex, bindingPoint);
+
+		if (DEBUG)
+		{
+			std::cout << "Uniform block " << blockName << " bound to binding point: " << bindingPoint << std::endl;
+		}
+	}
+
 }; // End of class
 
 #endif // SHADER_PROGRAM_HPP
\ No newline at end of file
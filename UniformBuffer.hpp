@@ -0,0 +1,88 @@
+#pragma once
+/***
+description: A uniform buffer refilled once a frame with every uniform block the frame
+draws with. Blocks are added on the CPU with add(), which returns where each one starts;
+upload() then sends them all with a single glBufferData, and a draw only has to bind its
+blocks' ranges with bind().
+
+Each block starts on a multiple of GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, as glBindBufferRange
+requires. The structs added must match the std140 layout of the blocks they are bound to:
+vec3s padded to 16 bytes unless a scalar follows, arrays and structs rounded up to vec4s.
+***/
+
+#ifndef UNIFORM_BUFFER_HPP
+#define UNIFORM_BUFFER_HPP
+
+#include "Libs\glew-2.0.0-win32\glew-2.0.0\include\GL\glew.h"
+
+#include <vector>
+#include <cstring>
+
+class UniformBuffer
+{
+public:
+	// Needs a current GL context
+	UniformBuffer()
+		: mBuffer(0), mCapacity(0)
+	{
+		GLint alignment = 0;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		mAlignment = alignment > 0 ? alignment : 256;
+		glGenBuffers(1, &mBuffer);
+	}
+
+	~UniformBuffer()
+	{
+		glDeleteBuffers(1, &mBuffer);
+	}
+
+	UniformBuffer(const UniformBuffer&) = delete;
+	UniformBuffer& operator=(const UniformBuffer&) = delete;
+
+	// Start a new frame's blocks. Ranges bound from the last frame stay valid until upload().
+	void clear()
+	{
+		mData.clear();
+	}
+
+	// Append a block, returning its offset in the buffer
+	template <typename Block>
+	GLintptr add(const Block& block)
+	{
+		size_t offset = (mData.size() + mAlignment - 1) / mAlignment * mAlignment;
+		mData.resize(offset + sizeof(Block));
+		memcpy(&mData[offset], &block, sizeof(Block));
+		return static_cast<GLintptr>(offset);
+	}
+
+	// Send everything added since clear(). The old storage is orphaned rather than
+	// overwritten, so the driver doesn't wait for last frame's draws to finish with it.
+	void upload()
+	{
+		glBindBuffer(GL_UNIFORM_BUFFER, mBuffer);
+		if (mData.size() > mCapacity)
+		{
+			mCapacity = mData.size();
+		}
+		glBufferData(GL_UNIFORM_BUFFER, mCapacity, nullptr, GL_STREAM_DRAW);
+		if (!mData.empty())
+		{
+			glBufferSubData(GL_UNIFORM_BUFFER, 0, mData.size(), mData.data());
+		}
+	}
+
+	// Point a block binding at a block added this frame
+	template <typename Block>
+	void bind(GLuint bindingPoint, GLintptr offset) const
+	{
+		glBindBufferRange(GL_UNIFORM_BUFFER, bindingPoint, mBuffer, offset, sizeof(Block));
+	}
+
+private:
+	GLuint mBuffer;
+	size_t mCapacity;
+	size_t mAlignment;
+	std::vector<GLubyte> mData;
+};
+
+#endif // UNIFORM_BUFFER_HPP
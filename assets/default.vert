@@ -3,37 +3,28 @@
 
 #version 330 core
 
+// Frame block, material and object layouts and the lighting itself
+#include "lighting.glsl"
+
+// Locations must match PositionAttributeLocation and friends in Mesh.hpp. Texture
+// coordinates are there for texturing; Gouraud shading doesn't read them.
 layout(location=0) in vec4 vPosition;
 layout(location=1) in vec3 vNormal;
+layout(location=2) in vec2 vTexcoord;
 
-// Transformation matrices
-uniform mat4 P;
-uniform mat4 M;
-uniform mat4 V;
+// Uniforms come in three std140 blocks, bound by Game::initDefaultShader and filled from
+// one buffer a frame: Frame, declared in lighting.glsl, and these two
+layout(std140) uniform Material {
+ MaterialData material;
+};
 
-// Light/Material  properties
-uniform vec4 lightPosition; 
-uniform vec4 ambientContrib;
-uniform vec4 diffuseContrib;
-uniform vec4 specularContrib;
-uniform float shininess;
+layout(std140) uniform Object {
+ ObjectData object;
+};
 
 // Calculated vertex colour
 out vec4 colour;
 
 void main() {
- mat4 MV = V * M;
- vec4 vEyeSpacePosition = MV * vPosition;
- vec3 N = normalize(mat3(MV)*vNormal);
- vec4 aV = lightPosition + (-1.0)*vEyeSpacePosition;
- vec3 L = normalize(aV.xyz);
- vec3 E = normalize(vEyeSpacePosition.xyz);
- vec3 H = normalize(L+E);
- vec4 ambientColour = ambientContrib;
- float Kd = max(0, dot(L,N));
- float Ks = pow(max(0, (dot(N, H))),shininess);
- vec4 diffuseColour = Kd * diffuseContrib;
- vec4 specularColour = Ks * specularContrib;
- colour = ambientColour + diffuseColour + specularColour;
- gl_Position = P * MV * vPosition;
+ colour = shadeVertex(vPosition, vNormal, object, material);
 }
\ No newline at end of file
@@ -0,0 +1,41 @@
+// Gouraud shading for multi-draw indirect -- vertex shader
+// The lighting is default.vert's, from lighting.glsl. What default.vert gets from the
+// Material and Object blocks comes from storage buffers instead, indexed by the draw, see
+// IndirectRenderer.cpp.
+
+#version 430 core
+#extension GL_ARB_shader_draw_parameters : require
+
+// Frame block, material and object layouts and the lighting itself. The frame block is
+// bound by Game::initIndirectShader as for default.vert.
+#include "lighting.glsl"
+
+// Locations must match PositionAttributeLocation and friends in Mesh.hpp
+layout(location=0) in vec4 vPosition;
+layout(location=1) in vec3 vNormal;
+layout(location=2) in vec2 vTexcoord;
+
+// std430 places MaterialData and ObjectData as std140 does. Bindings must match
+// ObjectStorageBinding and friends.
+layout(std430, binding=0) readonly buffer Objects {
+ ObjectData objects[];
+};
+
+layout(std430, binding=1) readonly buffer Materials {
+ MaterialData materials[];
+};
+
+// Object and material of each draw. gl_DrawIDARB counts from 0 in every multi-draw call,
+// so firstDraw says where the call's draws start.
+layout(std430, binding=2) readonly buffer Draws {
+ uvec2 draws[];
+};
+uniform int firstDraw;
+
+// Calculated vertex colour
+out vec4 colour;
+
+void main() {
+ uvec2 draw = draws[firstDraw + gl_DrawIDARB];
+ colour = shadeVertex(vPosition, vNormal, objects[draw.x], materials[draw.y]);
+}
\ No newline at end of file
@@ -0,0 +1,61 @@
+// Gouraud lighting shared by default.vert and indirect.vert, which #include it after their
+// #version line (see ShaderProgram::loadShaderFromFile). The two only differ in where an
+// object's transform and material come from, so everything else lives here.
+
+// Camera and light, the same for everything drawn in a frame. The layout must match
+// FrameBlock in Header.hpp.
+layout(std140) uniform Frame {
+ mat4 V;
+ mat4 P;
+ vec4 lightPosition;
+ vec4 lightAmbient;
+ vec4 lightDiffuse;
+ vec4 lightSpecular;
+};
+
+// Material properties, laid out as MaterialBlock in Header.hpp
+struct MaterialData {
+ vec4 ambientReflectivity;
+ vec4 diffuseReflectivity;
+ vec4 specularReflectivity;
+ float shininess;
+};
+
+// Model transform, and vertex format decoding, see MeshQuantise.cpp. Quantised positions
+// are relative to the mesh bounding box; for float positions scale is 1 and offset 0.
+// Laid out as ObjectBlock in Header.hpp.
+struct ObjectData {
+ mat4 M;
+ vec3 positionScale;
+ vec3 positionOffset;
+ bool octahedralNormals;
+};
+
+// Unfold a normal stored as a point on the octahedron (only xy of the normal are set)
+vec3 octahedralDecode(vec2 e) {
+ vec3 n = vec3(e.xy, 1.0 - abs(e.x) - abs(e.y));
+ if (n.z < 0.0) {
+  n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+ }
+ return n;
+}
+
+// Light a vertex as stored in its vertex format, setting gl_Position and returning its colour
+vec4 shadeVertex(vec4 vPosition, vec3 vNormal, ObjectData object, MaterialData material) {
+ vec4 position = vec4(vPosition.xyz * object.positionScale + object.positionOffset, 1.0);
+ vec3 normal = object.octahedralNormals ? octahedralDecode(vNormal.xy) : vNormal;
+ mat4 MV = V * object.M;
+ vec4 vEyeSpacePosition = MV * position;
+ vec3 N = normalize(mat3(MV)*normal);
+ vec4 aV = lightPosition + (-1.0)*vEyeSpacePosition;
+ vec3 L = normalize(aV.xyz);
+ vec3 E = normalize(vEyeSpacePosition.xyz);
+ vec3 H = normalize(L+E);
+ vec4 ambientColour = lightAmbient * material.ambientReflectivity;
+ float Kd = max(0, dot(L,N));
+ float Ks = pow(max(0, (dot(N, H))),material.shininess);
+ vec4 diffuseColour = Kd * lightDiffuse * material.diffuseReflectivity;
+ vec4 specularColour = Ks * lightSpecular * material.specularReflectivity;
+ gl_Position = P * MV * position;
+ return ambientColour + diffuseColour + specularColour;
+}
@@ -1,7 +1,21 @@
 #include "Header.hpp"
 
-int main(void)
+#include "AssetPack.hpp"
+
+int main(int argc, char* argv[])
 {
+	// "game --pack <pack file> [files...]" builds an asset pack instead of running the game.
+	// With no files listed it packs everything in assets/.
+	if (argc >= 3 && std::string(argv[1]) == "--pack")
+	{
+		std::vector<std::string> files(argv + 3, argv + argc);
+		if (files.empty())
+		{
+			files = listAssetFiles("assets");
+		}
+		return writeAssetPack(argv[2], files) ? 0 : 1;
+	}
+
 	Game * theGame = new Game();
 
 	theGame->initialise();